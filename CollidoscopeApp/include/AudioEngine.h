@@ -22,6 +22,11 @@
 #pragma once
 
 #include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "cinder/audio/Context.h"
 #include "cinder/audio/ChannelRouterNode.h"
@@ -29,12 +34,64 @@
 #include "cinder/audio/FilterNode.h"
 #include "BufferToWaveRecorderNode.h"
 #include "PGranularNode.h"
-#include "RingBufferPack.h"
+#include "SilenceGateNode.h"
+#include "SampleLoader.h"
+#include "WaveAnalyzer.h"
+#include "PagePrefetcher.h"
+#include "DspLoadMeter.h"
+#include "LatencyTracer.h"
 
 #include "Messages.h"
 #include "Config.h"
 
 
+// Cinder nodes of the output part of the graph. They skip processing while the PGranularNode upstream is silent: 
+// the filter and the monitor do their work in process(). The output router is not gated, since a ChannelRouterNode 
+// does its work in sumInputs(), that runs whether process() is skipped or not 
+typedef SilenceGateNode< ci::audio::MonitorNode > GatedMonitorNode;
+
+/**
+ * Gated low pass filter whose cutoff can be set from any thread ( GUI, MIDI ).
+ * FilterLowPassNode::setCutoffFreq() is not thread safe, therefore the cutoff is stored in an atomic
+ * and passed to the Cinder node by the audio thread at the beginning of the next block.
+ */
+class GatedFilterLowPassNode : public SilenceGateNode< ci::audio::FilterLowPassNode >
+{
+public:
+
+    /** Constructor, arguments are forwarded to the constructor of the filter */
+    template <typename... Args>
+    explicit GatedFilterLowPassNode( Args&&... args ) :
+        SilenceGateNode< ci::audio::FilterLowPassNode >( std::forward<Args>( args )... ),
+        mPendingCutoff( kNoCutoff )
+    {}
+
+    /** Sets the cutoff frequency of the filter. Can be called from any thread, the last value set before a block wins */
+    void setCutoffFreqAsync( float freq )
+    {
+        mPendingCutoff.store( freq, std::memory_order_relaxed );
+    }
+
+protected:
+
+    void process( ci::audio::Buffer *buffer ) override
+    {
+        const float cutoff = mPendingCutoff.exchange( kNoCutoff, std::memory_order_relaxed );
+        if ( cutoff != kNoCutoff ){
+            setCutoffFreq( cutoff );
+        }
+
+        SilenceGateNode< ci::audio::FilterLowPassNode >::process( buffer );
+    }
+
+private:
+
+    // no new cutoff since the last block 
+    static constexpr float kNoCutoff = -1.0f;
+
+    std::atomic<float> mPendingCutoff;
+};
+
 /**
  * Audio engine of the application. It uses the Cinder library to process audio in input and output. 
  * The audio engine manages both waves. All methods have a waveIndx parameter to address a specific wave.
@@ -52,45 +109,113 @@ public:
     AudioEngine & operator=(const AudioEngine &copy) = delete;
 
     /**
-    * Set up of the audio engine. 
+    * Set up of the audio engine. The audio graph runs in the master context and takes its input from the default input device.
     */
     void setup( const Config& Config );
 
+    /**
+    * Set up of the audio engine in the context \a ctx, taking the input from \a inputNode. 
+    * This is used to run the engine without a sound card, e.g. in the ContextHeadless. 
+    */
+    void setup( const Config& Config, ci::audio::Context *ctx, const ci::audio::InputNodeRef &inputNode );
+
     size_t getSampleRate();
 
-    void record( size_t index );
+    /** 
+     * Starts recording the wave one block from now, on the exact frame whatever the time within the period the call is made. 
+     * Returns false if the command was dropped, see getRecordMsgStats() 
+     */
+    bool record( size_t index );
+
+    /** Starts recording the wave at \a frame of the audio context, or at the start of the next block if \a frame is past */
+    bool record( size_t index, uint64_t frame );
+
+    /** Ends the recording in progress one block from now: the wave is as long as what was recorded so far. Ignored in capture mode */
+    bool finishRecord( size_t index );
 
-    void loopOn( size_t waveIdx );
+    /** Ends the recording in progress at \a frame of the audio context, or at the start of the next block if \a frame is past */
+    bool finishRecord( size_t index, uint64_t frame );
 
-    void loopOff( size_t waveIdx );
+    /** Mixes the input in the wave, over its whole length, keeping the wave at the overdub feedback. Ignored in capture mode */
+    void overdub( size_t index );
 
-    void noteOn( size_t waveIdx, int note );
+    /** Plays the previous version of the wave, recorded, captured or overdubbed, without copying any audio. Ignored while recording */
+    void undo( size_t index );
 
-    void noteOff( size_t waveIdx, int note );
+    /** Plays the version undone last, if no new version was made since. Ignored while recording */
+    void redo( size_t index );
+
+    /** 
+     * The loop and the notes are started and stopped through a queue, read by the audio thread at each sub-block.
+     * \a inputTime is when the MIDI message that caused the call was received ( see MIDIMessage::getTimestamp() ), or 0. 
+     * It traces the latency of the event in the LatencyTracer 
+     */
+    void loopOn( size_t waveIdx, uint64_t inputTime = 0 );
+
+    void loopOff( size_t waveIdx, uint64_t inputTime = 0 );
+
+    void noteOn( size_t waveIdx, int note, uint64_t inputTime = 0 );
+
+    void noteOff( size_t waveIdx, int note, uint64_t inputTime = 0 );
 
     /**
-    * Returns the number of elements available to read in the wave ring buffer.
-    * The wave ring buffer is used to pass the size of the wave chunks from the audio thread to the graphic thread, 
-    * when a new wave is recorded.
+    * Returns the queue that passes the WAVE_* messages from the audio thread to the graphic thread, as a wave gets recorded.
+    * Only the graphic thread reads it, in place with consume().
     */ 
-    size_t getRecordWaveAvailable( size_t index );
+    RecordWaveMsgQueue& getRecordWaveQueue( size_t waveIdx );
+
     /**
-    * Called from the graphic thread. Reads \a count elements from the wave ring buffer into \a buffer.
-    * The wave ring buffer is used to pass the size of the wave chunks from the audio thread to the graphic thread, 
-    * when a new wave is recorded.
-    *
-    */
-    bool readRecordWave( size_t waveIdx, RecordWaveMsg* buffer, size_t count );
+     * Loads the sample file at \a path in the wave, in place of the recorded wave. The file is loaded in a background thread 
+     * and the wave is replaced as soon as it's ready. Errors are logged.
+     */
+    void loadSample( size_t waveIdx, const ci::fs::path &path );
 
-    void setSelectionSize( size_t waveIdx, size_t size );
+    /**
+     * Loads a wave already in memory, e.g. in the mapped session file, in place of the recorded wave. \a samples holds the 
+     * whole wave of \a numFrames frames and is played as it is. \a owner keeps \a samples alive as long as the wave is played.
+     */
+    void restoreWave( size_t waveIdx, const float *samples, size_t numFrames, const std::shared_ptr<const void> &owner );
+
+    /**
+     * Copies the samples of the wave currently played into \a samples, in wave order. Called from the graphic thread,
+     * when the wave is not being recorded. A long wave played from its sample file is not copied, nor the delay line of the 
+     * live mode: \a samples is left empty.
+     */
+    void copyWave( size_t waveIdx, std::vector<float> &samples ) const;
+
+    /**
+     * Returns the min/max/RMS summary of the wave being recorded. It can be read from the graphic thread at any time
+     * to draw the wave at any resolution.
+     */
+    const PeakPyramid& getPeakPyramid( size_t waveIdx ) const;
+
+    /** Sets the selection size in chunks. Chunks are converted to samples of the wave being played, whatever its length */
+    void setSelectionSize( size_t waveIdx, size_t numChunks );
 
-    void setSelectionStart( size_t waveIdx, size_t start );
+    /** Sets the selection start in chunks. Chunks are converted to samples of the wave being played, whatever its length */
+    void setSelectionStart( size_t waveIdx, size_t startChunk );
+
+    /** 
+     * Moves the selection start to \a startChunk, as Wave::Selection::setStart() does: the selection gets at least one chunk, 
+     * and shrinks so that it doesn't go past the last chunk. Can be called from any thread, e.g. straight from the MIDI threads 
+     */
+    void moveSelection( size_t waveIdx, size_t startChunk );
+
+    /** Resizes the selection to \a numChunks, as Wave::Selection::setSize() does, up to the last chunk. Can be called from any thread */
+    void resizeSelection( size_t waveIdx, size_t numChunks );
+
+    /** Returns the selection last set from any thread, in chunks, so that the graphic thread can show it */
+    void getSelection( size_t waveIdx, size_t &startChunk, size_t &numChunks ) const;
 
     void setGrainDurationCoeff( size_t waveIdx, double coeff );
 
     void setFilterCutoff( size_t waveIdx, double cutoff );
 
-    void checkCursorTriggers( size_t waveIdx, std::vector<CursorTriggerMsg>& cursorTriggers );
+    /**
+    * Returns the queue that passes the TRIGGER_* messages from the audio thread to the graphic thread, as the grains play.
+    * Only the graphic thread reads it, in place with consume().
+    */
+    CursorTriggerMsgQueue& getCursorTriggerQueue( size_t waveIdx );
 
     /**
      * Returns a const reference to the audio output buffer. This is the buffer that is sent off to the audio interface at each audio cycle. 
@@ -98,9 +223,47 @@ public:
      */
     const ci::audio::Buffer& getAudioOutputBuffer( size_t waveIdx ) const;
 
+    /**
+     * Returns the meter of the time spent by the audio thread in each node of the graph and in the whole audio callback.
+     * The meter can be read from the graphic thread at any time.
+     */
+    DspLoadMeter& getDspLoadMeter() { return mDspLoadMeter; }
+
+    /** Returns the histograms of the latency of the notes and the loop, from the MIDI input to the first grain. Can be read from any thread */
+    const LatencyTracer& getLatencyTracer() const { return mLatencyTracer; }
+
+    /** Counters of one of the queues between the threads, named after the wave and the messages, e.g. "w0.notes" */
+    struct QueueStats
+    {
+        std::string name;
+        MsgQueueStats stats;
+    };
+
+    /** Returns the counters of the queue the recording of the wave is started and finished through, with the commands dropped. Can be called from any thread */
+    MsgQueueStats getRecordMsgStats( size_t waveIdx ) const;
+
+    /** Fills \a stats with the counters of all the queues between the threads. Can be called from any thread */
+    void getQueueStats( std::vector<QueueStats> &stats ) const;
+
+    /** Returns the counters of all the queues as one line, for the log */
+    std::string queueStatsToString() const;
+
+    /** Returns the number of times the grains of the wave read a page of a long wave not resident in memory, and played silence instead */
+    size_t getNumPageMisses( size_t waveIdx ) const;
+
 
 private:
 
+    // stamps the note message as dispatched, records its input hop and pushes it to the granular node of the wave 
+    void pushNoteMsg( size_t waveIdx, NoteMsg &msg, uint64_t inputTime );
+
+    // changes the start and size of the selection of the granular node with \a change( start, size ), atomically 
+    template <typename Change>
+    void changeSelection( size_t waveIdx, Change change );
+
+    // context the audio graph runs in 
+    ci::audio::Context *mContext;
+
     // nodes for mic input 
     std::array< ci::audio::ChannelRouterNodeRef, NUM_WAVES > mInputRouterNodes;
     // nodes for recording audio input into buffer. Also sends chunks information through 
@@ -112,10 +275,23 @@ private:
 
     std::array< ci::audio::ChannelRouterNodeRef, NUM_WAVES > mOutputRouterNodes;
     // nodes to get the audio buffer scoped in the oscilloscope 
-    std::array< ci::audio::MonitorNodeRef, NUM_WAVES > mOutputMonitorNodes;
+    std::array< std::shared_ptr< GatedMonitorNode >, NUM_WAVES > mOutputMonitorNodes;
     // nodes for lowpass filtering
-    std::array< cinder::audio::FilterLowPassNodeRef, NUM_WAVES> mLowPassFilterNodes;
+    std::array< std::shared_ptr< GatedFilterLowPassNode >, NUM_WAVES> mLowPassFilterNodes;
+
+    std::array< std::unique_ptr< CursorTriggerMsgQueue >, NUM_WAVES > mCursorTriggerQueues;
+
+    // number of chunks the selections are measured in 
+    size_t mNumChunks;
+
+    DspLoadMeter mDspLoadMeter;
+    LatencyTracer mLatencyTracer;
 
-    std::array< std::unique_ptr< RingBufferPack<CursorTriggerMsg> >, NUM_WAVES > mCursorTriggerRingBufferPacks;
+    // loads samples from disk in the recorders. Declared after the recorders, so that its thread is stopped first 
+    std::unique_ptr< SampleLoader > mSampleLoader;
+    // indexes the waves for the grains. Declared after the nodes, so that its thread is stopped first 
+    std::unique_ptr< WaveAnalyzer > mWaveAnalyzer;
+    // keeps the pages of the long waves the grains read in memory. Declared after the nodes, so that its thread is stopped first 
+    std::unique_ptr< PagePrefetcher > mPagePrefetcher;
 
 };
@@ -52,65 +52,205 @@
 #include "cinder/Filesystem.h"
 
 #include "Messages.h"
+#include "MpscQueue.h"
+#include "SpscQueue.h"
+#include "DspLoadMeter.h"
+#include "SubBlock.h"
+#include "GrainBuffer.h"
+#include "PeakPyramid.h"
+#include "DiskWriter.h"
+#include "LoadedWave.h"
+
+#include <vector>
 
 typedef std::shared_ptr<class BufferToWaveRecorderNode> BufferToWaveRecorderNodeRef;
 
-typedef ci::audio::dsp::RingBufferT<RecordWaveMsg> RecordWaveMsgRingBuffer;
+typedef SpscQueue<RecordWaveMsg> RecordWaveMsgQueue;
+// recordings are started and finished from the graphic thread and the MIDI threads 
+typedef MpscQueue<RecordMsg> RecordMsgQueue;
 
 /**
  * A \a Node in the audio graph of the Cinder audio library that records input in a buffer.
  *
  * This class is similar to \a cinder::audio::BufferRecorderNode (it's a derivative work of this class indeed) but it has an additional feature:
  * when recording, it uses the audio input samples to compute the size values of the visual chunks. 
- * The chunks values are stored in a ring buffer and fetched by the graphic thread to paint the wave as it gets recorded.
+ * The chunks values are pushed in a queue and read in place by the graphic thread to paint the wave as it gets recorded.
+ * The recorded samples are also summarized in a PeakPyramid, so that the graphic thread can draw the wave at any resolution.
+ * Input is recorded in sub-blocks of kSubBlockFrames frames.
+ *
+ * start() and finish() don't touch the state of the audio thread: they send a RecordMsg, stamped with the frame it must take 
+ * effect at, through a lock-free queue. process() reads the commands in place and splits the block at that frame, so that a recording starts and ends 
+ * on the exact frame whatever the jack period. A command stamped with getCommandFrame() takes effect one block after it's sent, 
+ * rather than at the start of whatever block comes next.
+ *
+ * The node holds a number of buffer slots, all allocated in initialize() as long as the longest wave: the front buffer with the wave 
+ * the grains are read from, the back buffer the input is recorded into, and the older versions of the wave. When a recording is complete 
+ * the back buffer becomes the front buffer and the new wave is published to the PGranularNode through an atomic pointer, so that 
+ * the grains never read a wave that is being overwritten. The input is recorded next in a slot that holds no version. 
+ * A slot dropped from the history is written again only after the grains have crossfaded out of it ( see setSlotReleaseTime() ): 
+ * with two slots the version played is dropped by each new one, so at least three slots are needed for a crossfade without clicks.
+ *
+ * The versions of the wave, recorded, captured or overdubbed, make the history: undo() and redo() publish the previous or the next 
+ * version at the start of the next block, without copying any audio, and send its chunks to the graphic thread. A new version drops 
+ * the versions undone, and the oldest version when all the slots are taken. With two slots there is no history: each recording 
+ * replaces the previous one.
+ *
+ * A recording lasts numSeconds, unless finish() is called before: the wave is then as long as what was recorded so far
+ * ( but no shorter than the minimum length ). The length of the wave is published along with it, so changing the length 
+ * never locks nor allocates.
+ *
+ * A wave loaded from a file ( see SampleLoader ) can take the place of the front buffer: it's handed over with loadWave() 
+ * and published at the start of the next block, without copying any audio. When a new wave is recorded the loaded wave is retired 
+ * and given back to the loader with popRetiredWave(), so that it's never freed on the audio thread.
+ *
+ * In capture mode the node captures the input all the time in a circular buffer. When start() is called the last ( or the next ) 
+ * numSeconds of input become the new wave by swapping the capture buffer with the wave buffer, without copying any audio, 
+ * and all the chunks of the new wave are sent to the graphic thread at once. The capture buffer is summarized and converted 
+ * as it's written, and the older samples left in it are silenced a few sub-blocks at a time, so a commit only fades the edges 
+ * of the wave: the last numSeconds can be committed again once this is done, a fraction of numSeconds after the previous commit.
+ *
+ * In live mode there is no recording step: the input is written all the time in a circular delay line, that is published as 
+ * a live wave ( see GrainBuffer ) and granulated as it's written. The write head is published after each sub-block, through 
+ * an atomic, and the grains read behind it ( see PGranular::setLiveDelay() ), so neither side ever waits. The peak pyramid 
+ * summarizes the line in place and scrolls with the write head: a WAVE_SCROLL message is sent each time the line moves by a chunk. 
+ * start(), overdub(), undo(), redo() and the loaded waves are ignored.
+ *
+ * With a record threshold set, start() arms the node rather than recording right away: the input goes through a short pre-roll 
+ * ring buffer until the peak level of a sub-block reaches the threshold. The recording then starts with the pre-roll, so that the 
+ * attack of the sound is kept, and the wave doesn't begin with the silence before the visitor makes a sound.
+ *
+ * overdub() mixes the input into the wave being played rather than replacing it: one pass over the whole wave, where each sample 
+ * becomes the old sample times the feedback plus the input. The wave is first copied in a new version, that can be undone, 
+ * and changed in place as the grains play it. The wave is copied a few sub-blocks at a time, ahead of the overdub, 
+ * and the grains keep reading it until the copy is complete. Only the chunks overdubbed are summarized again and sent to the graphic thread, 
+ * as WAVE_OVERDUB_CHUNK messages.
+ *
+ * With GrainStorage::eInt16 each buffer has a 16 bits copy, written along with the float samples, that the grains read in place 
+ * of the float samples ( see GrainBuffer ). The float samples are still the wave that is drawn, saved and analyzed.
  *
  */
 class BufferToWaveRecorderNode : public ci::audio::SampleRecorderNode {
 public:
 
     static const float kRampTime;
+    //! The loader collects the retired waves before each load, and the node owns two waves at most ( pending and published ): 
+    //! no more than three waves are retired between two collections, so the queue never fills up 
+    static const size_t kMaxRetiredWaves = 16;
+    static const size_t kMaxRecordMsgs = 16;
+
+    enum class CaptureMode {
+        eOff,  // records numSeconds of input from when start() is called, sending the chunks as they are recorded 
+        eLast, // captures the input all the time, start() commits the last numSeconds of input 
+        eNext, // captures the input all the time, start() commits the next numSeconds of input when they are over 
+        eLive  // writes the input all the time in a delay line the grains read from, start() does nothing 
+    };
 
     //! Constructor. numChunks is the total number of chunks this biffer has to be borken down in. 
-    //! numSeconds lenght of the buffer in seconds 
-    BufferToWaveRecorderNode( std::size_t numChunks, double numSeconds );
-
-    //! Starts recording. Resets the write position to zero (call disable() to pause recording).
-    void start();
+    //! numSeconds maximum lenght of a wave in seconds, minNumSeconds minimum lenght of a wave ended with finish() 
+    //! numSlots number of buffers, at least two: the history keeps numSlots - 1 versions of the wave 
+    BufferToWaveRecorderNode( std::size_t numChunks, double numSeconds, double minNumSeconds = 0.0, std::size_t numSlots = 2 );
+
+    //! Returns the memory taken by a slot for waves of \a numFrames frames, read by the grains as \a storage, in bytes 
+    static std::size_t getSlotSize( std::size_t numFrames, GrainStorage storage );
+
+    //! Destructor. Frees the loaded waves still owned by this node.
+    ~BufferToWaveRecorderNode();
+
+    //! Starts recording at \a frame of the context, or at the start of the next block if \a frame is past. The write position is reset 
+    //! to zero by the audio thread: the node must be enabled, and is left enabled when it's not recording.
+    //! Only sends a command, so it can be called from any thread, as finish(), overdub(), undo() and redo().
+    //! With a record threshold, the recording starts when the input reaches the threshold.
+    //! In capture mode, requests the audio thread to commit the captured input as the new wave.
+    //! Returns false if the command was dropped, the queue being full: the drop is counted in getRecordMsgStats().
+    bool start( uint64_t frame = 0 );
     //! Stops recording. Same as calling disable().
     void stop();
+    //! Ends the recording in progress at \a frame of the context, if any: the wave is as long as what was recorded so far, or the minimum length. 
+    //! If the node is armed and the input hasn't reached the threshold yet, nothing is recorded and the wave is left as it is.
+    //! Not supported in capture mode, where the waves are always numSeconds long. Returns false if the command was dropped, as start().
+    bool finish( uint64_t frame = 0 );
 
-    //! \brief Sets the length of the recording buffer in frames.
-    //!
-    //! If the write position is non-zero, the old contents will be preserved (by copying it to the newly allocated Buffer).
-    //! If \a shrinkToFit is set to `true`, the internal Buffer will be down-sized if necessary, otherwise it will only re-allocate when growing while changing its dimensions to match \a numFrames (default shrinkToFit = false).
-    void setNumFrames(size_t numFrames, bool shrinkToFit = false);
-    //! Sets the length of the recording buffer in seconds. \see setNumFrames
-    void setNumSeconds(double numSeconds, bool shrinkToFit = false);
-
-    //! Returns the length of the recording buffer in frames.
-    size_t      getNumFrames() const    { return mRecorderBuffer.getNumFrames(); }
+    //! Returns the frame of the context a command sent now is applied at: one block from now, as estimated from the time 
+    //! the last block was processed. Returns 0, that is the next block, if the node never processed a block. Can be called from any thread.
+    uint64_t getCommandFrame() const;
+
+    //! Starts an overdub pass over the wave being played, unless a recording is in progress or the wave is paged. Not supported in capture mode.
+    //! The pass always covers the whole wave: finish() doesn't end it. A new recording stops it.
+    void overdub();
+
+    //! Sets how much of the wave is kept at each overdub, between 0 and 1.
+    void setOverdubFeedback( float feedback ) { mOverdubFeedback = feedback; }
+
+    //! Plays the previous version of the wave, if any. A loaded wave is undone to the version played before it was loaded. 
+    //! An overdub in progress stops. Ignored while recording.
+    void undo();
+
+    //! Plays the next version of the wave, if the versions after it were undone and no new version was made since. Ignored while recording.
+    void redo();
+
+    //! Returns the length of the recording buffer in frames, which is the maximum length of a wave.
+    size_t      getNumFrames() const    { return mRecorderBuffer->getNumFrames(); }
     //! Returns the length of the recording buffer in seconds.
     double      getNumSeconds() const;
 
-    //! \brief Returns a copy of the recored samples, up to the current write position.
+    //! \brief Sets the writer each recorded wave is streamed to, as it gets recorded ( or after the commit when it's captured ).
     //!
-    //! This method is non locking, and as such any resizing calls must be performed on the same thread or be otherwise synchronized.
-    ci::audio::BufferRef    getRecordedCopy() const;
-
-    //! \brief Writes the currently recorded samples to a file at \a filePath
+    //! The last frames recorded, as many as the fade out, are held back until the wave is complete, so that they're written faded.
     //!
-    //! The encoding format is derived from \a filePath's extension and \a sampleType (default = SampleType::INT_16).
-    //! \note throws AudioFileExc if the write request cannot be completed.
-    void writeToFile(const ci::fs::path &filePath, ci::audio::SampleType sampleType = ci::audio::SampleType::INT_16);
+    //! Must be called before the audio graph is enabled. Pass nullptr to not write the waves to disk.
+    void setDiskWriter( const std::shared_ptr<DiskWriter> &diskWriter ) { mDiskWriter = diskWriter; }
+    //! Returns the writer set with setDiskWriter(), or nullptr
+    const std::shared_ptr<DiskWriter>& getDiskWriter() const { return mDiskWriter; }
 
     //! Returns the frame of the last buffer overrun or 0 if none since the last time this method was called. When this happens, it means the recorded buffer probably has skipped some frames.
     uint64_t getLastOverrun();
 
-    //! returns a reference to the ring buffer when the size values of the chunks is stored, when a new wave is recorder
-    RecordWaveMsgRingBuffer& getRingBuffer() { return mRingBuffer; }
+    //! returns a reference to the queue where the size values of the chunks are pushed, when a new wave is recorded. Read by the graphic thread
+    RecordWaveMsgQueue& getRecordWaveQueue() { return mRecordWaveQueue; }
+
+    //! Returns the counters of the queue the recording is started and finished through. Can be called from any thread
+    MsgQueueStats getRecordMsgStats() const { return mRecordMsgs.getStats(); }
+
+    //! Returns the counters of the queue the loaded waves are retired through. Can be called from any thread
+    MsgQueueStats getRetiredWaveStats() const { return mRetiredWaves.getStats(); }
+
+    //! Returns the min/max/RMS summary of the wave being recorded ( or last committed in capture mode, or last loaded, or undone to )
+    const PeakPyramid& getPeakPyramid() const { return *mPublishedPeakPyramid.load( std::memory_order_acquire ); }
+
+    //! \brief Hands a loaded wave over to the audio thread, that publishes it in place of the recorded wave at the start of the next block.
+    //!
+    //! Called from any thread but the audio thread. The node takes ownership of \a wave. If the previous wave handed over 
+    //! has not been published yet, it's replaced and returned to the caller, that owns it again. Otherwise returns nullptr.
+    //! \a wave must not be longer than the recorder buffer, unless it's paged. The node must be enabled.
+    const LoadedWave* loadWave( const LoadedWave *wave ) { return mPendingWave.exchange( wave, std::memory_order_acq_rel ); }
+
+    //! Returns a loaded wave no longer played, or nullptr. The caller owns the wave and must keep it alive for a little while, 
+    //! as the grains can still read it during the crossfade. Called by one thread only.
+    const LoadedWave* popRetiredWave();
+
+    //! Returns the wave last recorded, as published to the audio thread. This is used by the PGranular to create the granular synthesis 
+    const AtomicGrainBuffer& getGrainBuffer() const { return mPublishedGrainBuffer; }
+
+    //! Returns the number of waves published so far, counting each overdub as a new wave. It changes after getGrainBuffer() does, 
+    //! so a reader that sees a new count sees the new wave
+    uint32_t getNumPublishedWaves() const { return mNumPublishedWaves.load( std::memory_order_acquire ); }
+
+    //! Sets how the grains read the waves recorded. Must be called before the audio graph is initialized.
+    void setGrainStorage( GrainStorage storage ) { mGrainStorage = storage; }
+
+    //! Sets the capture mode. Must be called before the audio graph is enabled. In capture mode the node must be enabled all the time.
+    void setCaptureMode( CaptureMode mode ) { mCaptureMode = mode; }
+
+    //! Sets how long a slot dropped from the history is kept out of use, so that the grains reading it, e.g. while crossfading 
+    //! to a new wave, never read it being overwritten. Must be called before the audio graph is initialized.
+    void setSlotReleaseTime( double seconds ) { mSlotReleaseTime = seconds; }
 
-    //!returns a pointer to the buffer where the audio is recorder. This is used by the PGranular to create the granular synthesis 
-    ci::audio::Buffer* getRecorderBuffer() { return &mRecorderBuffer; }
+    //! Sets the peak level the input must reach for a recording to start, 0 to start recording right away. 
+    //! Must be called before the audio graph is initialized. Ignored in capture mode.
+    void setRecordThreshold( float threshold ) { mRecordThreshold = threshold; }
+
+    //! Sets the meter and the slot where the time spent in process() is recorded
+    void setDspLoadMeter( DspLoadMeter *meter, size_t slot ) { mLoadMeter = meter; mLoadMeterSlot = slot; }
 
 
 protected:
@@ -119,28 +259,223 @@ protected:
 
     void initBuffers(size_t numFrames);
 
+    //! Records \a numFrames frames of \a data, one sub-block of the buffer passed to process()
+    void processSubBlock( const float *data, size_t numFrames );
+
+    //! Records \a numFrames frames of \a data, one sub-block after the other
+    void processFrames( const float *data, size_t numFrames );
+
+    //! Applies a start or finish command, at the frame the next sub-block starts at 
+    void applyRecordMsg( const RecordMsg &msg );
+
+    //! Appends \a numFrames frames of \a data to the wave being recorded 
+    void recordFrames( const float *data, size_t numFrames );
+
+    //! Keeps \a numFrames frames of \a data in the pre-roll and starts recording if they reach the threshold 
+    void processArmed( const float *data, size_t numFrames );
+
+    //! Starts the overdub pass over a copy of the wave played, made in the back buffer ( see copyOverdubFrames() ) 
+    void beginOverdub();
+
+    //! Mixes \a numFrames frames of \a data in the wave being overdubbed and sends the chunks completed 
+    void processOverdub( const float *data, size_t numFrames );
+
+    //! Copies the wave played in mOverdubBuffer up to frame \a end of the wave, and publishes the copy once complete 
+    void copyOverdubFrames( size_t end );
+
+    //! Ends the wave being recorded, that has \a writePos frames so far. The frames already recorded fade out if needed 
+    void finishRecording( size_t writePos );
+
+    //! Publishes the wave just recorded 
+    void completeRecording();
+
+    //! Captures \a numFrames frames of \a data in the capture buffer and commits the capture buffer when requested. 
+    //! Also silences the next uncaptured frames and writes the next frames of the last committed wave to disk 
+    void processCapture( const float *data, size_t numFrames );
+
+    //! Summarizes and converts the \a numFrames frames of the capture buffer starting at \a begin 
+    void refreshCapture( size_t begin, size_t numFrames );
+
+    //! Swaps the capture buffer with the wave buffer and sends all the chunks of the new wave to the graphic thread. 
+    //! Doesn't touch more than the edges of the wave 
+    void commitCapture();
+
+    //! Writes \a numFrames frames of \a data in the delay line, at the write head, and publishes the new write head 
+    void processLive( const float *data, size_t numFrames );
+
+    //! Publishes the front buffer as the delay line of the live mode 
+    void publishLive();
+
+    //! Adds the back buffer to the history as the latest version, a wave of \a numFrames frames starting at \a offset, and publishes it. 
+    //! The versions undone are dropped, and the oldest version if the history is full. The next back buffer is a slot with no version 
+    void commitVersion( size_t offset, size_t numFrames );
+
+    //! Puts \a slot, dropped from the history, back in mFreeSlots once the grains can't be reading it anymore 
+    void releaseSlot( size_t slot );
+
+    //! Takes a free slot for the next back buffer: the one released first if none was released long enough ago 
+    size_t takeFreeSlot();
+
+    //! Publishes mRecorderBuffer to the PGranularNode, a wave of \a numFrames frames starting at \a offset. Retires the loaded wave, if any 
+    void publishGrainBuffer( size_t offset, size_t numFrames );
+
+    //! Publishes mRecorderBuffer again, as described by its GrainBuffer. Retires the loaded wave, if any 
+    void publishFront();
+
+    //! Publishes the version undone or redone to, if any was requested 
+    void applyHistorySteps();
+
+    //! Returns the index in mBuffers of the version at \a pos in the history, 0 being the oldest 
+    size_t historySlot( size_t pos ) const { return mHistory[( mHistoryStart + pos ) % mHistory.size()]; }
+
+    //! Returns the index of \a buffer in mBuffers 
+    size_t slotOf( const ci::audio::BufferDynamic *buffer ) const { return size_t( buffer - mBuffers.data() ); }
+
+    //! Returns the summary of the wave in \a buffer, one of mBuffers 
+    PeakPyramid& peaksOf( const ci::audio::BufferDynamic *buffer ) { return mPeakPyramids[slotOf( buffer )]; }
+
+    //! Publishes the wave handed over with loadWave(), if any 
+    void adoptPendingWave();
+
+    //! Gives \a wave back to the loader. If the queue is full the wave is kept, and retired again by the next block 
+    void retireWave( const LoadedWave *wave );
+
+    //! Sends WAVE_START and all the chunks of \a peaks to the graphic thread in one write. If the queue is full they're sent again later 
+    void sendAllChunks( const PeakPyramid &peaks );
+
+    //! Writes the frames in [ \a begin, \a end ) of \a buffer ( one of mBuffers ) to its 16 bits copy. Does nothing with GrainStorage::eFloat 
+    void updateCompactBuffer( const ci::audio::BufferDynamic *buffer, size_t begin, size_t end );
+
     static const float kMinAudioVal; 
     static const float kMaxAudioVal;
 
-    ci::audio::BufferDynamic        mRecorderBuffer;
-    ci::audio::BufferDynamicRef     mCopiedBuffer;
+    // the slots the input is recorded in. See mRecorderBuffer, mBackBuffer and mHistory 
+    std::vector<ci::audio::BufferDynamic> mBuffers;
+    // front buffer, with the wave the grains are read from: the version of the history played 
+    ci::audio::BufferDynamic        *mRecorderBuffer;
+    // back buffer, where the input is recorded. In capture mode it's a circular buffer. Becomes mRecorderBuffer when a wave is complete 
+    ci::audio::BufferDynamic        *mBackBuffer;
+
+    // 16 bits copy of each buffer in mBuffers, with GrainStorage::eInt16 
+    GrainStorage mGrainStorage;
+    std::vector<std::vector<int16_t>> mCompactBuffers;
+
+    // one descriptor for each buffer in mBuffers, and the one currently published 
+    std::vector<GrainBuffer> mGrainBuffers;
+    AtomicGrainBuffer mPublishedGrainBuffer;
+    std::atomic<uint32_t> mNumPublishedWaves;
+
+    CaptureMode mCaptureMode;
+    std::atomic<bool> mCommitRequested;
+    // write position in mBackBuffer 
+    size_t mCapturePos;
+    // frames captured since the last commit, up to the length of mBackBuffer 
+    size_t mCapturedFrames;
+    // frames silenced ahead of mCapturePos since the last commit 
+    size_t mClearedFrames;
+    // the last committed wave, as it's written to disk: mArchivePos of its mArchiveLen frames are written 
+    const float *mArchiveData;
+    size_t mArchiveOffset;
+    size_t mArchivePos;
+    size_t mArchiveLen;
+    // in CaptureMode::eNext, frames left to capture before committing. 0 if no commit is pending 
+    size_t mCommitCountdown;
+    // in live mode, the first sample of the delay line, that is the write head, and the frames written since the last WAVE_SCROLL 
+    std::atomic<size_t> mLiveOffset;
+    size_t mLiveScrollFrames;
+    // WAVE_START and all the chunks of a committed wave, sent in one write 
+    std::vector<RecordWaveMsg> mChunkBatch;
+    // the last batch didn't fit in mRecordWaveQueue: the chunks of the published wave are sent again by a later block 
+    bool mResendChunks;
     std::atomic<uint64_t>   mLastOverrun;
 
-    RecordWaveMsgRingBuffer mRingBuffer;
+    RecordWaveMsgQueue mRecordWaveQueue;
+
+    // start and finish commands sent by start() and finish(). A command not due yet stays in the queue, along with the ones after it 
+    RecordMsgQueue mRecordMsgs;
+    // time of frame 0 of the context, as estimated at the start of the last block, in microseconds from mEpochReference. 
+    // A single 32 bits value, so that getCommandFrame() reads it without locking ( 64 bits atomics are not lock-free on the Raspberry Pi ). 
+    // It only moves by the drift between the audio clock and the system clock, so it stays in range for months 
+    const int64_t mEpochReference;
+    std::atomic<int32_t> mFrameEpoch;
+
+    // summary of the wave in each buffer of mBuffers, in wave order ( the offset of a captured wave is taken into account ) 
+    std::vector<PeakPyramid> mPeakPyramids;
+    // the summary of the wave shown by the graphic thread: the one of the back buffer while recording, of the front buffer or of mLoadedWave 
+    std::atomic<const PeakPyramid*> mPublishedPeakPyramid;
+
+    // the versions of the wave, oldest first: indexes in mBuffers, in a circular list of mBuffers.size() - 1 entries starting at mHistoryStart 
+    std::vector<size_t> mHistory;
+    size_t mHistoryStart;
+    size_t mHistoryLen;
+    // position in the history of the version in mRecorderBuffer 
+    size_t mHistoryPos;
+    // indexes in mBuffers of the slots that hold no version and are not the back buffer. Reserved, so it never allocates 
+    std::vector<size_t> mFreeSlots;
+    // slots dropped from the history and the frame of the context from which they can be written again, oldest first. Reserved too 
+    std::vector<std::pair<size_t, uint64_t>> mReleasedSlots;
+    double mSlotReleaseTime;
+    size_t mSlotReleaseFrames;
+    // undo and redo requested by the other threads and not applied yet: -1 for each undo, +1 for each redo 
+    std::atomic<int> mHistorySteps;
+
+    // wave handed over by loadWave() and not yet published 
+    std::atomic<const LoadedWave*> mPendingWave;
+    // loaded wave currently published, or nullptr when the grains read mRecorderBuffer 
+    const LoadedWave *mLoadedWave;
+    // loaded waves no longer published, waiting to be freed by the loader thread 
+    SpscQueue<const LoadedWave*> mRetiredWaves;
+    // waves retired while mRetiredWaves was full, pushed again at the start of each block. Reserved in the constructor 
+    std::vector<const LoadedWave*> mHeldWaves;
 
     const std::size_t mNumChunks;
     const double mNumSeconds;
-    std::size_t mNumSamplesPerChunk;
+    const double mMinNumSeconds;
+
+    // set by a finish command, read by the next sub-block 
+    std::atomic<bool> mFinishRequested;
+    // length of the wave being recorded: the length of the buffer, until finish() is called 
+    size_t mRecordLen;
+    // minimum length of a wave ended by finish() 
+    size_t mMinRecordLen;
     std::atomic<std::size_t> mChunkIndex;
 
-    size_t mChunkSampleCounter;
     float mChunkMaxAudioVal;
     float mChunkMinAudioVal;
 
-    float mEnvRamp;
     float mEnvRampRate;
     size_t mEnvRampLen;
     size_t mEnvDecayStart;
 
+    // set by a start command when there is a record threshold, cleared when the recording starts 
+    std::atomic<bool> mArmed;
+    float mRecordThreshold;
+    // the input before the threshold is reached, in a circular buffer allocated in initialize() 
+    std::vector<float> mPreRoll;
+    // write position in mPreRoll 
+    size_t mPreRollPos;
+    // frames written in mPreRoll since the node was armed, up to its length 
+    size_t mPreRollFrames;
+
+    // set by overdub(), read by the audio thread 
+    std::atomic<bool> mOverdubRequested;
+    std::atomic<float> mOverdubFeedback;
+    // position in the wave being overdubbed, and length of the wave. The pass is over when the position reaches the length 
+    size_t mOverdubPos;
+    size_t mOverdubLen;
+    // next chunk sent to the graphic thread 
+    size_t mOverdubChunk;
+    // buffer the overdub is mixed into, the back buffer until the copy of mOverdubSource is complete, and the frames copied so far 
+    ci::audio::BufferDynamic *mOverdubBuffer;
+    GrainBuffer mOverdubSource;
+    size_t mOverdubCopyPos;
+
+    std::shared_ptr<DiskWriter> mDiskWriter;
+    // frames of the wave being recorded sent to mDiskWriter so far 
+    size_t mDiskWritePos;
+
+    DspLoadMeter *mLoadMeter;
+    size_t mLoadMeterSlot;
+
 };
 
@@ -59,12 +59,61 @@ public:
         return mNumChunks;
     }
 
-    /** returns wave lenght in seconds */
+    /** returns wave lenght in seconds. A recording ended early is shorter ( see isRecordHoldEnabled() ) */
     double getWaveLen() const
     {
         return mWaveLen;
     }
 
+    /** Returns the minimum lenght in seconds of a recording ended early */
+    double getMinWaveLen() const
+    {
+        return 0.25;
+    }
+
+    /**
+     * If true the recording lasts as long as the record button is held, up to getWaveLen() seconds.
+     * The record button must then send the record CC with value 0 when released. If false the recording always lasts getWaveLen() seconds.
+     */
+    bool isRecordHoldEnabled() const
+    {
+        return false;
+    }
+
+    /**
+     * If true the MIDI messages are passed to the audio engine straight from the MIDI threads, as they are received.
+     * If false they wait for the next frame and are passed from the graphic thread, with the GUI.
+     */
+    bool isDirectMidiEnabled() const
+    {
+        return true;
+    }
+
+    /**
+     * Peak level, between 0 and 1, the input must reach for a recording to start once record is pressed, e.g. 0.05. 
+     * The wave then starts a little before the sound, rather than with the silence before it. 0 starts recording right away.
+     */
+    float getRecordThreshold() const
+    {
+        return 0.0f;
+    }
+
+    /** How much of the wave is kept when the input is overdubbed on it, between 0 and 1 */
+    float getOverdubFeedback() const
+    {
+        return 0.7f;
+    }
+
+    /**
+     * Memory for the waves and their history, in megabytes, shared by all the waves. Each version of a wave kept for undo takes 
+     * as much memory as the longest wave, and the waves need two versions' worth at least: below that there is no undo. 
+     * With a crossfade or a capture mode they take three versions' worth at least, so that the grains never read a slot being overwritten.
+     */
+    double getHistoryMemory() const
+    {
+        return 8.0;
+    }
+
     /**
      * Returns wave selection color
      */ 
@@ -79,13 +128,128 @@ public:
     }
 
     /**
-     * The size of the ring buffer used to trigger a visual cursor from the audio thread when a new grain is created
+     * How a wave is recorded when the record button is pressed:
+     * "off"  records the next getWaveLen() seconds of input, drawing the wave as it gets recorded.
+     * "last" captures the input all the time and turns the last getWaveLen() seconds of input into the wave at once.
+     * "next" captures the input all the time and turns the next getWaveLen() seconds of input into the wave at once, when they are over.
+     * "live" records nothing: the wave is the last getWaveLen() seconds of input, written all the time in a delay line, 
+     *        and the grains read it as it scrolls, at least getLiveDelay() behind the input.
+     */
+    std::string getCaptureMode() const
+    {
+        return "off";
+    }
+
+    /**
+     * In live capture mode, minimum delay in seconds between the input and the grains reading it. It must be longer than 
+     * a jack period, as the grains see the write head move once per period. The selection sets the actual delay: the end 
+     * of the wave is the most recent input.
+     */
+    double getLiveDelay() const
+    {
+        return 0.05;
+    }
+
+    /**
+     * Length in seconds of the crossfade from the old wave to the new one, when a recording completes while the grains are playing.
+     * 0 swaps the waves abruptly.
+     */
+    double getGrainBufferCrossfadeTime() const
+    {
+        return 0.01;
+    }
+
+    /**
+     * How the grains read the waves: "float" reads the float samples, "int16" a 16 bits copy, with half the memory traffic
+     * when many grains play ( see GrainStorage ).
+     */
+    std::string getGrainStorage() const
+    {
+        return "float";
+    }
+
+    /**
+     * Where the grains start: "zero" moves each grain start to the nearest zero crossing of the wave, "onset" to the nearest onset,
+     * "off" leaves the grains start where the selection and the random offset put them.
+     */
+    std::string getGrainSnapMode() const
+    {
+        return "off";
+    }
+
+    /**
+     * Directory of the samples that can be loaded in the waves in place of a recording ( see SampleLoader for the formats ).
+     */
+    std::string getSampleLibraryDirectory() const
+    {
+        return "./samples";
+    }
+
+    /**
+     * Longest sample that can be loaded in a wave, in seconds. A mono 32 bits float sample at the audio sample rate longer than
+     * getWaveLen() is played from the file one page at a time, with the pages the grains are about to read kept in memory. 
+     * Any other sample is cut to getWaveLen() seconds. Long samples are not saved in the session.
+     */
+    double getMaxSampleLen() const
+    {
+        return 600.0;
+    }
+
+    /**
+     * File the state of the waves is saved to after each change, and restored from at startup. Empty to not save the session.
+     */
+    std::string getSessionFile() const
+    {
+        return "./collidoscope_session.bin";
+    }
+
+    /** Seconds without changes before the session is saved, so that turning a knob doesn't save the session at each step */
+    double getSessionSaveDelay() const
+    {
+        return 2.0;
+    }
+
+    /**
+     * Directory where every recorded wave is archived as an audio file, one file per recording. Empty to not archive the waves.
+     */
+    std::string getRecordingsDirectory() const
+    {
+        return "";
+    }
+
+    /** Format of the archived waves, as a file extension */
+    std::string getRecordingsFileExtension() const
+    {
+        return "wav";
+    }
+
+    /**
+     * Seconds of audio queued for the archive writer before the audio thread starts dropping blocks.
+     * A committed capture is queued all at once, so this must be longer than a wave.
+     */
+    double getRecordingsBufferSeconds() const
+    {
+        return mWaveLen + 1.0;
+    }
+
+    /**
+     * The size of the queue used to trigger a visual cursor from the audio thread when a new grain is created.
+     * The high-water mark in the queue stats log says how much of it is used
      */ 
     std::size_t getCursorTriggerMessageBufSize() const
     {
         return 512;
     }
 
+    /**
+     * The size of the queue the notes and the loop are started and stopped through, per wave. 
+     * The high-water mark in the queue stats log says how much of it is used
+     */
+    std::size_t getNoteMessageBufSize() const
+    {
+        return 128;
+    }
+
     /** returns the index of the wave associated to the MIDI channel passed as argument */
     size_t getWaveForMIDIChannel( unsigned char channelIdx )
     {
@@ -97,9 +261,12 @@ public:
         return 8.0;
     }
 
-    double getMaxFilterCutoffFreq() const
+    /**
+     * Returns the cutoff frequency of the fully open filter: the Nyquist frequency of \a sampleRate ( 22050 Hz at 44.1 kHz ).
+     */
+    double getMaxFilterCutoffFreq( size_t sampleRate ) const
     {
-        return 22050.;
+        return sampleRate / 2.;
     }
 
     double getMinFilterCutoffFreq() const
@@ -130,6 +297,41 @@ public:
         return 4;
     }
 
+    /**
+     * Whether the time spent by the audio thread in each node of the audio graph is drawn on screen at startup.
+     * The overlay can be toggled at runtime with the 'l' key.
+     */
+    bool isDspLoadOverlayEnabled() const
+    {
+        return false;
+    }
+
+    /**
+     * Interval in seconds between two log lines reporting the time spent by the audio thread in each node. 0 disables the log.
+     */
+    double getDspLoadLogInterval() const
+    {
+        return 60.0;
+    }
+
+    /**
+     * Interval in seconds between two log lines reporting the messages pushed, dropped and waiting at most in each queue 
+     * between the threads. 0 disables the log.
+     */
+    double getQueueStatsLogInterval() const
+    {
+        return 60.0;
+    }
+
+    /**
+     * Interval in seconds between two dumps of the histograms of the latency of the notes and the loop, from the MIDI input 
+     * to their first grain ( see LatencyTracer ). 0 disables the log.
+     */
+    double getLatencyLogInterval() const
+    {
+        return 60.0;
+    }
+
 private:
 
     void parseWave( const ci::XmlTree &wave, int id );
@@ -0,0 +1,112 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "cinder/audio/Context.h"
+#include "cinder/audio/InputNode.h"
+#include "cinder/audio/OutputNode.h"
+#include "cinder/audio/Target.h"
+#include "cinder/Filesystem.h"
+
+
+/**
+ * InputNode (as in the cinder::audio::InputNode) that reads the audio input from a file loaded in memory, instead of from the sound card.
+ * When no file is set, or the end of the file is reached, the node outputs silence.
+ */
+class InputNodeFile : public ci::audio::InputNode {
+public:
+    InputNodeFile( const Format &format );
+
+    /**
+     * Loads the whole file at \a path, converting it to the sample rate of the context. Mono files are copied to both channels.
+     * Must be called after the node is created by the context and before the context is enabled. Throws ci::audio::AudioFileExc
+     */
+    void loadFile( const ci::fs::path &path );
+
+protected:
+    void process( ci::audio::Buffer *buffer ) override;
+
+private:
+    ci::audio::BufferRef mSourceBuffer;
+    size_t mReadPos;
+};
+
+/**
+ * OutputNode (as in the cinder::audio::OutputNode) that is not attached to any sound card.
+ * The audio graph is processed each time render() is called, as fast as the CPU allows, and the output is
+ * optionally written to a file.
+ */
+class OutputNodeHeadless : public ci::audio::OutputNode {
+public:
+    OutputNodeHeadless( const Format &format, size_t sampleRate, size_t framesPerBlock );
+
+    /** Writes the output of the graph to \a path. If never called, the output is discarded. */
+    void setOutputFile( const ci::fs::path &path );
+
+    /** Processes one block of audio, the same way the jack callback does in ContextJack */
+    void render();
+
+    size_t getOutputSampleRate()        override { return mSampleRate; }
+    size_t getOutputFramesPerBlock()    override { return mFramesPerBlock; }
+
+protected:
+    bool supportsProcessInPlace() const override { return false; }
+
+private:
+    const size_t mSampleRate;
+    const size_t mFramesPerBlock;
+
+    ci::audio::TargetFileRef mTargetFile;
+};
+
+/**
+ * Audio context that drives the Collidoscope audio graph without jack and without a sound card.
+ * Input comes from an InputNodeFile, output goes to an OutputNodeHeadless. The graph is processed by calling processBlock()
+ * from a plain loop, so the engine can run faster than real time for profiling and regression tests.
+ */
+class ContextHeadless : public ci::audio::Context {
+public:
+
+    /** Creates a new headless context, with its output node already set up */
+    static std::shared_ptr<ContextHeadless> create( size_t sampleRate, size_t framesPerBlock );
+
+    virtual ~ContextHeadless() {}
+
+    /** There are no devices in a headless context: throws ci::audio::AudioContextExc */
+    ci::audio::OutputDeviceNodeRef createOutputDeviceNode( const ci::audio::DeviceRef &device, const ci::audio::Node::Format &format = ci::audio::Node::Format() ) override;
+    /** There are no devices in a headless context: throws ci::audio::AudioContextExc */
+    ci::audio::InputDeviceNodeRef  createInputDeviceNode( const ci::audio::DeviceRef &device, const ci::audio::Node::Format &format = ci::audio::Node::Format() ) override;
+
+    /** Creates the input node that reads the audio input from a file. The file is set with InputNodeFile::loadFile() */
+    std::shared_ptr<InputNodeFile> createInputFileNode();
+
+    /** Returns the output node of this context */
+    const std::shared_ptr<OutputNodeHeadless>& getHeadlessOutput() const { return mOutputNode; }
+
+    /** Processes one block of getFramesPerBlock() frames of the whole audio graph */
+    void processBlock() { mOutputNode->render(); }
+
+private:
+    ContextHeadless() {}
+
+    std::shared_ptr<OutputNodeHeadless> mOutputNode;
+};
@@ -0,0 +1,119 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "cinder/audio/dsp/RingBuffer.h"
+#include "cinder/audio/Buffer.h"
+#include "cinder/audio/Target.h"
+#include "cinder/Filesystem.h"
+
+#include "SubBlock.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+
+
+/**
+ * Streams the recorded waves to audio files, without ever blocking the audio thread.
+ *
+ * The audio thread calls beginFile(), write() and endFile() as a wave is recorded. The samples are copied in blocks of
+ * kSubBlockFrames frames to a lock-free ring buffer, allocated once in the constructor, and a background thread
+ * with low priority drains the ring and writes each block to the current file as soon as it's available.
+ * A new file is created at each beginFile(), named after the prefix, the date and a counter. The format is taken
+ * from the extension ( e.g. "wav" ).
+ *
+ * If the writer thread falls behind and the ring is full, the blocks that don't fit are dropped and counted as overruns:
+ * the file gets shorter but the audio thread never waits.
+ */
+class DiskWriter
+{
+public:
+
+    /**
+     * Creates a writer for files in \a directory, named \a prefix plus the date and a counter.
+     * \a capacityFrames is the number of frames the ring can hold before the audio thread starts dropping them.
+     */
+    DiskWriter( const ci::fs::path &directory, const std::string &prefix, const std::string &extension, size_t sampleRate, size_t capacityFrames );
+
+    /** Stops the writer thread, after writing everything left in the ring, and closes the current file */
+    ~DiskWriter();
+
+    DiskWriter( const DiskWriter &copy ) = delete;
+    DiskWriter & operator=( const DiskWriter &copy ) = delete;
+
+    /** Called from the audio thread: the next frames go to a new file. Any file not ended yet is closed */
+    void beginFile();
+
+    /** Called from the audio thread: appends \a numFrames frames of \a data to the current file */
+    void write( const float *data, size_t numFrames );
+
+    /** Called from the audio thread: closes the current file */
+    void endFile();
+
+    /** Returns the number of blocks dropped because the ring was full. Can be called from any thread */
+    uint32_t getNumOverruns() const { return mNumOverruns.load( std::memory_order_relaxed ); }
+
+    /** Returns the number of files completely written. Can be called from any thread */
+    uint32_t getNumFilesWritten() const { return mNumFilesWritten.load( std::memory_order_relaxed ); }
+
+private:
+
+    enum class BlockType : uint32_t { eBegin, eData, eEnd };
+
+    struct Block
+    {
+        BlockType type;
+        uint32_t numFrames;
+        float data[kSubBlockFrames];
+    };
+
+    // pushes a block in the ring or counts an overrun
+    void push( const Block &block );
+
+    // writer thread
+    void run();
+    void openFile();
+    void closeFile();
+    void flush();
+
+    const ci::fs::path mDirectory;
+    const std::string mPrefix;
+    const std::string mExtension;
+    const size_t mSampleRate;
+
+    ci::audio::dsp::RingBufferT<Block> mRing;
+
+    // only touched by the writer thread
+    ci::audio::TargetFileRef mTargetFile;
+    ci::audio::Buffer mStagingBuffer;
+    size_t mStagingFrames;
+    size_t mFileCounter;
+
+    std::atomic<bool> mRunning;
+    std::atomic<uint32_t> mNumOverruns;
+    std::atomic<uint32_t> mNumFilesWritten;
+
+    std::thread mThread;
+};
@@ -0,0 +1,157 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+/**
+ * Measures where the audio thread spends its time.
+ *
+ * Each node of the audio graph (and the audio callback as a whole) records the time spent in its process() method in a slot of the meter.
+ * For each slot the meter keeps the time of the last block, a rolling average and the worst case.
+ *
+ * record() is called only by the audio thread. The values are published through relaxed atomics, so that the graphic thread
+ * can read them at any time without ever blocking the audio thread. Slots must be added before the audio graph is enabled.
+ * Times are stored in 32 bits ( up to ~4 seconds ) because 64 bits atomics are not lock-free on the Raspberry Pi.
+ *
+ */
+class DspLoadMeter
+{
+public:
+
+    static const size_t kMaxSlots = 16;
+    static const size_t kNoSlot = kMaxSlots;
+
+    /** Snapshot of the statistics of one slot, in microseconds */
+    struct SlotStats
+    {
+        std::string name;
+        double lastMicros;
+        double avgMicros;
+        double worstMicros;
+        // average time as a fraction of the time available to process one block
+        double avgLoad;
+    };
+
+    /**
+     * Times a block of code and records the elapsed time in the meter when it goes out of scope.
+     * If the meter is null, nothing is recorded.
+     */
+    class Scope
+    {
+    public:
+        Scope( DspLoadMeter *meter, size_t slot ) :
+            mMeter( meter ),
+            mSlot( slot ),
+            mStart( meter != nullptr ? now() : 0 )
+        {}
+
+        ~Scope()
+        {
+            if ( mMeter != nullptr )
+                mMeter->record( mSlot, now() - mStart );
+        }
+
+        Scope( const Scope &copy ) = delete;
+        Scope & operator=( const Scope &copy ) = delete;
+
+    private:
+        DspLoadMeter *mMeter;
+        size_t mSlot;
+        uint64_t mStart;
+    };
+
+    DspLoadMeter();
+
+    // no copies
+    DspLoadMeter( const DspLoadMeter &copy ) = delete;
+    DspLoadMeter & operator=( const DspLoadMeter &copy ) = delete;
+
+    /** Adds a new slot named \a name and returns its index, or kNoSlot if all the slots are taken */
+    size_t addSlot( const std::string &name );
+
+    /** Sets the time available to process one block. The load of each slot is calculated against this value */
+    void setBlockBudget( size_t framesPerBlock, size_t sampleRate );
+
+    /** Called from the audio thread. Records that \a nanos nanoseconds were spent in the slot at index \a slot */
+    void record( size_t slot, uint64_t nanos )
+    {
+        if ( slot >= mNumSlots )
+            return;
+
+        Slot &s = mSlots[slot];
+        const uint32_t value = nanos > UINT32_MAX ? UINT32_MAX : uint32_t( nanos );
+
+        // exponential moving average, only ever touched by the audio thread
+        s.avgState += ( double( value ) - s.avgState ) * kAvgCoeff;
+
+        s.last.store( value, std::memory_order_relaxed );
+        s.avg.store( uint32_t( s.avgState ), std::memory_order_relaxed );
+        if ( value > s.worst.load( std::memory_order_relaxed ) )
+            s.worst.store( value, std::memory_order_relaxed );
+    }
+
+    /** Fills \a stats with a snapshot of all the slots. Called from the graphic thread */
+    void getStats( std::vector<SlotStats> &stats ) const;
+
+    /** Resets the worst case of all the slots. Called from the graphic thread */
+    void resetWorstCases();
+
+    /** Returns a one line summary of all the slots, suitable for logging */
+    std::string toString() const;
+
+    /** Returns a monotonic time stamp in nanoseconds */
+    static uint64_t now()
+    {
+        return uint64_t( std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count() );
+    }
+
+private:
+
+    // weight of the last value in the moving average. Roughly averages over the last 64 blocks
+    static const double kAvgCoeff;
+
+    struct Slot
+    {
+        Slot() : last( 0 ), avg( 0 ), worst( 0 ), avgState( 0.0 ) {}
+
+        std::string name;
+
+        std::atomic<uint32_t> last;
+        std::atomic<uint32_t> avg;
+        std::atomic<uint32_t> worst;
+
+        // audio thread only
+        double avgState;
+    };
+
+    std::array<Slot, kMaxSlots> mSlots;
+    std::atomic<size_t> mNumSlots;
+
+    std::atomic<uint32_t> mBlockBudgetNanos;
+};
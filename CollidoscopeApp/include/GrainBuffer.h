@@ -0,0 +1,78 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+class PagedWave;
+
+/**
+ * How the samples of the waves are stored for the grains. The grains read a wave at random positions, so with many grains
+ * playing the memory bandwidth is the limit ( e.g. on the Raspberry Pi ), and 16 bits samples take half of it.
+ */
+enum class GrainStorage {
+    eFloat, // the grains read the float samples 
+    eInt16  // the grains read a 16 bits copy of the samples, kept along with the float samples 
+};
+
+/** Value of a full scale sample in the 16 bits copy of a wave: the float sample times this, rounded */
+const float kInt16FullScale = 32767.0f;
+
+/**
+ * The recorded wave the grains are read from.
+ *
+ * The wave is a circular buffer of \a numFrames mono samples: the first sample of the wave is at data[offset]
+ * and the wave wraps around at the end of \a data. A wave recorded from the start of the buffer has offset 0.
+ * With GrainStorage::eInt16 \a data16 is the same wave in 16 bits, laid out as \a data, and the grains read it rather than \a data.
+ * It's nullptr otherwise.
+ * A wave too long to be held in memory, loaded from a sample file, is \a paged: the grains read \a data only through the pages 
+ * resident in memory. It's nullptr for any other wave.
+ * A \a live wave is a delay line the input is written into while the grains read it: its first sample, the oldest one, 
+ * moves as the input is written, and is read from \a live rather than \a offset. It's nullptr for any other wave.
+ */
+struct GrainBuffer
+{
+    const float *data;
+    std::size_t numFrames;
+    std::size_t offset;
+    const int16_t *data16;
+    PagedWave *paged;
+    const std::atomic<std::size_t> *live;
+};
+
+inline bool operator==( const GrainBuffer &lhs, const GrainBuffer &rhs )
+{
+    return lhs.data == rhs.data && lhs.numFrames == rhs.numFrames && lhs.offset == rhs.offset && lhs.data16 == rhs.data16 && lhs.paged == rhs.paged && lhs.live == rhs.live;
+}
+
+inline bool operator!=( const GrainBuffer &lhs, const GrainBuffer &rhs )
+{
+    return !( lhs == rhs );
+}
+
+/**
+ * The GrainBuffer currently published by the recorder. The recorder swaps the pointer when a new wave is committed
+ * and the PGranularNode picks up the new wave at the start of its next block.
+ */
+typedef std::atomic<const GrainBuffer*> AtomicGrainBuffer;
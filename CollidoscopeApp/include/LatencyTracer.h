@@ -0,0 +1,128 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+/**
+ * Measures how long the control events take from the MIDI input to the first grain they start, one hop at a time.
+ *
+ * The events are stamped with DspLoadMeter::now() when the MIDI callback receives them, when the graphic thread hands them to 
+ * the audio engine, when the audio thread dequeues them and when the sub-block where their first grain starts is rendered. 
+ * The last stamp is taken at the end of the sub-block, so it includes the rendering of the whole sub-block. The time of each hop 
+ * is counted in a histogram with power of two buckets, in microseconds, along with the worst case.
+ *
+ * The input hop is recorded by the threads that dispatch the events to the audio engine: the graphic thread, or the MIDI 
+ * threads with the direct path ( see collidoscope::MIDI::setDirectCallback() ). The other hops are recorded by the audio thread. 
+ * As in the DspLoadMeter, the counters are relaxed atomics of 32 bits, so they can be read from any thread without blocking the writers.
+ */
+class LatencyTracer
+{
+public:
+
+    enum class Hop {
+        eInputToDispatch,   // MIDI callback to the thread dispatching the event: with the graphic thread, the MIDI mutex and the wait for the frame 
+        eDispatchToDequeue, // graphic thread to the audio thread: the note queue and the wait for the next period 
+        eDequeueToRender,   // audio thread dequeuing a note or loop start to the end of the first sub-block rendered with a grain it triggers 
+        eInputToRender      // the whole path, for the events that came from MIDI, to the end of the same sub-block 
+    };
+
+    static const size_t kNumHops = 4;
+    // bucket 0 counts the times under 1 us, bucket i the times under 2^i us. The last one counts all the longer times 
+    static const size_t kNumBuckets = 24;
+
+    /** Snapshot of the histogram of one hop */
+    struct HopStats
+    {
+        std::string name;
+        uint32_t count;
+        double maxMicros;
+        // upper bounds of the buckets the median and the 99th percentile fall in 
+        double p50Micros;
+        double p99Micros;
+        std::array<uint32_t, kNumBuckets> buckets;
+    };
+
+    LatencyTracer();
+
+    // no copies
+    LatencyTracer( const LatencyTracer &copy ) = delete;
+    LatencyTracer & operator=( const LatencyTracer &copy ) = delete;
+
+    /** Records that an event took \a nanos nanoseconds through \a hop. Can be called by several threads at once */
+    void record( Hop hop, uint64_t nanos )
+    {
+        Histogram &h = mHistograms[size_t( hop )];
+        const uint32_t value = nanos > UINT32_MAX ? UINT32_MAX : uint32_t( nanos );
+
+        h.buckets[bucketOf( value )].fetch_add( 1, std::memory_order_relaxed );
+
+        uint32_t max = h.max.load( std::memory_order_relaxed );
+        while ( value > max && !h.max.compare_exchange_weak( max, value, std::memory_order_relaxed ) )
+            ;
+    }
+
+    /** Records the time from \a since to now through \a hop. A null \a since means the event was not stamped and is ignored */
+    void recordSince( Hop hop, uint64_t since, uint64_t now )
+    {
+        if ( since != 0 && now >= since )
+            record( hop, now - since );
+    }
+
+    /** Fills \a stats with a snapshot of the histograms of all the hops. Can be called from any thread */
+    void getStats( std::vector<HopStats> &stats ) const;
+
+    /** Returns one line per hop with its percentiles and its non empty buckets, suitable for logging */
+    std::string toString() const;
+
+    /** Returns the upper bound in microseconds of the times counted in bucket \a index */
+    static double getBucketMicros( size_t index ) { return double( uint32_t( 1 ) << index ); }
+
+private:
+
+    static size_t bucketOf( uint32_t nanos )
+    {
+        size_t index = 0;
+        for ( uint32_t micros = nanos / 1000; micros > 0 && index < kNumBuckets - 1; micros >>= 1 )
+            index++;
+        return index;
+    }
+
+    struct Histogram
+    {
+        Histogram() : max( 0 )
+        {
+            for ( auto &bucket : buckets )
+                bucket = 0;
+        }
+
+        std::array<std::atomic<uint32_t>, kNumBuckets> buckets;
+        std::atomic<uint32_t> max;
+    };
+
+    std::array<Histogram, kNumHops> mHistograms;
+};
@@ -0,0 +1,50 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "GrainBuffer.h"
+#include "PagedWave.h"
+#include "PeakPyramid.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+
+/**
+ * A wave loaded from a sample file by the SampleLoader, ready to be played by the grains and drawn by the graphic thread.
+ *
+ * The samples are either in \a samples, when the file had to be converted, or straight in a memory mapped file
+ * ( the sample file or the session file ), kept alive by \a mapping. \a grainBuffer points to either of them, 
+ * and to \a compactSamples with GrainStorage::eInt16. A wave longer than the recorded waves is \a paged, and has no compact samples.
+ */
+struct LoadedWave
+{
+    GrainBuffer grainBuffer;
+    PeakPyramid peaks;
+
+    std::vector<float> samples;
+    std::vector<int16_t> compactSamples;
+    std::shared_ptr<const void> mapping;
+    // declared after the mapping, so that its pages are unpinned before the file is unmapped 
+    std::unique_ptr<PagedWave> paged;
+};
@@ -21,6 +21,8 @@
 
 #pragma once 
 
+#include <string>
+
 
 /**
  * Utility function to log errors using the cinder::log library.
@@ -36,3 +38,11 @@ void logError( const std::string &errorMsg );
  *
  */ 
 void logInfo( const std::string &infoMsg );
+
+
+/**
+ * Utility function to log performance statistics using the cinder::log library.
+ * Unlike logInfo, statistics are logged to the terminal in release builds too.
+ *
+ */ 
+void logStats( const std::string &statsMsg );
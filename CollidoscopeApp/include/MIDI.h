@@ -22,6 +22,8 @@
 #pragma once
 
 #include "RtMidi.h"
+#include <cstdint>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <array>
@@ -60,19 +62,24 @@ public:
 
     enum class Voice { eNoteOn, eNoteOff, ePitchBend, eControlChange, eIgnore };
 
-    Voice getVoice() { return mVoice; }
+    Voice getVoice() const { return mVoice; }
 
-    unsigned char getChannel() { return mChannel; }
+    unsigned char getChannel() const { return mChannel; }
 
     /**
      * First byte of MIDI data 
      */ 
-    unsigned char getData_1() { return mData1; }
+    unsigned char getData_1() const { return mData1; }
 
     /**
      * Second byte of MIDI data 
      */ 
-    unsigned char getData_2() { return mData2; }
+    unsigned char getData_2() const { return mData2; }
+
+    /**
+     * Monotonic time in nanoseconds ( DspLoadMeter::now() ) when the message was received 
+     */ 
+    uint64_t getTimestamp() const { return mTimestamp; }
 
 private:
 
@@ -80,6 +87,7 @@ private:
     unsigned char mChannel;
     unsigned char mData1;
     unsigned char mData2;
+    uint64_t mTimestamp = 0;
 
     
 };
@@ -87,15 +95,27 @@ private:
 /**
  * Handles MIDI messages from the keyboards and Teensy. It uses RtMidi library.
  *
+ * RtMidi calls back from a thread of its own for each input port. The messages can be passed straight to the audio engine 
+ * from there, through the direct callback, and are also queued for the graphic thread, that reads them once per frame with 
+ * checkMessages().
  */ 
 class MIDI
 {
 
 public:
 
+    /** Called from the MIDI threads, for each message, as soon as it is received */
+    typedef std::function<void( const MIDIMessage& )> DirectCallback;
+
     MIDI();
     ~MIDI();
 
+    /**
+     * Sets the callback that gets each message in the MIDI thread that received it, before it's queued for checkMessages(). 
+     * The callback must not block, and can be called by several threads at once, one per input port. Call before setup() 
+     */
+    void setDirectCallback( const DirectCallback &callback ) { mDirectCallback = callback; }
+
     void setup( const Config& );
 
     /**
@@ -121,6 +141,9 @@ private:
     // Same principle as mPitchBendMessages
     std::array< MIDIMessage, NUM_WAVES > mFilterMessages;
 
+    // passes the messages to the audio engine without waiting for the graphic thread 
+    DirectCallback mDirectCallback;
+
     // vector containing all the MIDI input devices detected.
     std::vector< std::unique_ptr <RtMidiIn> > mInputs;
     // Used for mutual access to the MIDI messages by the MIDI thread and the graphic thread.  
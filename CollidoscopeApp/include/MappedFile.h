@@ -0,0 +1,59 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "cinder/Filesystem.h"
+
+#include <cstddef>
+#include <memory>
+
+
+/**
+ * Maps the file at \a path in memory and sets \a size to its size in bytes. The mapping is copy on write: writing to it
+ * never changes the file, and it stays valid if the file is replaced or deleted. The file is unmapped when the last copy 
+ * of the returned pointer is destroyed. On Windows the whole file is read in memory instead. Returns nullptr on error.
+ */
+std::shared_ptr<void> mapFile( const ci::fs::path &path, size_t &size );
+
+/** Tells the system that all the \a size bytes of the mapping at \a data will be read soon */
+void prefetchMapping( void *data, size_t size );
+
+/**
+ * Tells the system that the \a size bytes of the mapping at \a data won't be read soon: their pages are dropped, and read again 
+ * from the file when needed. Only whole pages are dropped. The range must not hold pages written to, as they would be lost
+ */
+void releaseMapping( const void *data, size_t size );
+
+/**
+ * Makes the whole mapping at \a data, returned by mapFile(), read only. The pages written before stay as they were written.
+ * A read only mapping can be pinned without copying its pages.
+ */
+void protectMapping( void *data, size_t size );
+
+/**
+ * Pins the \a size bytes of the mapping at \a data in memory: they are read in now and never paged out until unlockMapping().
+ * Returns false if they can't be pinned, e.g. over the memory lock limit of the process. Always false on Windows.
+ */
+bool lockMapping( const void *data, size_t size );
+
+/** Lets the system page out the \a size bytes at \a data pinned by lockMapping() */
+void unlockMapping( const void *data, size_t size );
@@ -21,6 +21,9 @@
 
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+
 /**
  * Enumeration of all the possible commands exchanged between audio thread and graphic thread.
  *
@@ -30,6 +33,10 @@ enum class Command {
     WAVE_CHUNK,
     // message sent when a new recording starts. The gui resets the wave upon receiving it. 
     WAVE_START,
+    // message carrying info about one chunk of the wave changed by an overdub. The gui redraws only this chunk. 
+    WAVE_OVERDUB_CHUNK,
+    // message sent when a live wave scrolled by a chunk. The gui redraws the whole wave 
+    WAVE_SCROLL,
 
     // new grain created 
     TRIGGER_UPDATE,
@@ -40,7 +47,11 @@ enum class Command {
     NOTE_OFF,
 
     LOOP_ON,
-    LOOP_OFF
+    LOOP_OFF,
+
+    // start and end of a recording, at the frame carried by the message 
+    RECORD_START,
+    RECORD_FINISH
 };
 
 /** Message sent from the audio thread to the graphic wave when a new wave is recorded. 
@@ -51,7 +62,7 @@ enum class Command {
  */
 struct RecordWaveMsg
 {
-    Command cmd; // WAVE_CHUNK or WAVE_START
+    Command cmd; // WAVE_CHUNK, WAVE_START, WAVE_OVERDUB_CHUNK or WAVE_SCROLL
     std::size_t index;
     float arg1;
     float arg2;
@@ -103,6 +114,9 @@ struct NoteMsg
     Command cmd; // NOTE_ON/OFF ot LOOP_ON/OFF 
     int midiNote;
     double rate;
+    // DspLoadMeter::now() when the MIDI message arrived, or 0 if it didn't come from MIDI, and when it was pushed ( see LatencyTracer ) 
+    std::uint64_t inputTime;
+    std::uint64_t dispatchTime;
 };
 
 /**
@@ -115,6 +129,32 @@ inline NoteMsg makeNoteMsg( Command cmd, int midiNote, double rate )
     msg.cmd = cmd;
     msg.midiNote = midiNote;
     msg.rate = rate;
+    msg.inputTime = 0;
+    msg.dispatchTime = 0;
+
+    return msg;
+}
+
+/**
+ * Message sent from the graphic (main) thread to the audio thread to start or end a recording. 
+ * The command takes effect at \a frame of the audio context, counted from the first frame ever processed, 
+ * or at the start of the next block if that frame is already past.
+ */ 
+struct RecordMsg
+{
+    Command cmd; // RECORD_START or RECORD_FINISH
+    std::uint64_t frame;
+};
+
+/**
+ * Utility function to create a new RecordMsg.
+ */ 
+inline RecordMsg makeRecordMsg( Command cmd, std::uint64_t frame )
+{
+    RecordMsg msg;
+
+    msg.cmd = cmd;
+    msg.frame = frame;
 
     return msg;
 }
@@ -0,0 +1,220 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "SpscQueue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+
+/**
+ * Lock-free queue of messages from any number of producer threads to one consumer thread, e.g. from the MIDI threads 
+ * and the graphic thread to the audio thread. 
+ *
+ * The consumer side is the same as the SpscQueue's, so the two can be swapped. The producers claim a slot each by moving 
+ * the write position with a compare and swap, then copy their message and mark the slot as ready through its sequence 
+ * number ( the bounded queue of D. Vyukov ). A producer never waits: if the queue is full the message is dropped and counted. 
+ * The consumer reads the ready messages in place and gives each slot back to the producers through its sequence number. 
+ * A producer preempted between claiming a slot and filling it holds back the messages after it until it's done: 
+ * the consumer reads them at its next call. 
+ */
+template <typename T>
+class MpscQueue
+{
+public:
+
+    typedef typename SpscQueue<T>::Span Span;
+
+    static const std::size_t kCacheLineSize = SpscQueue<T>::kCacheLineSize;
+
+    /** Allocates room for at least \a capacity messages */
+    explicit MpscQueue( std::size_t capacity ) :
+        mWritePos( 0 ),
+        mNumPushed( 0 ),
+        mNumOverflows( 0 ),
+        mReadPos( 0 ),
+        mHighWater( 0 ),
+        mMask( roundUpToPowerOfTwo( std::max<std::size_t>( capacity, 1 ) ) - 1 ),
+        mSlots( new T[mMask + 1] ),
+        mSequences( new std::atomic<std::size_t>[mMask + 1] )
+    {
+        // a slot is free for the producer that claims position pos when its sequence is pos, ready for the consumer at pos + 1 
+        for ( std::size_t i = 0; i <= mMask; i++ )
+            mSequences[i].store( i, std::memory_order_relaxed );
+    }
+
+    MpscQueue( const MpscQueue &copy ) = delete;
+    MpscQueue & operator=( const MpscQueue &copy ) = delete;
+
+    /** Returns the number of messages the queue can hold */
+    std::size_t getCapacity() const { return mMask + 1; }
+
+    // --------- producer side, any thread 
+
+    /** Pushes a copy of \a msg. Returns false and counts an overflow if the queue is full */
+    bool push( const T &msg )
+    {
+        std::size_t pos = mWritePos.load( std::memory_order_relaxed );
+
+        for ( ;; ){
+            const std::size_t sequence = mSequences[pos & mMask].load( std::memory_order_acquire );
+            const std::ptrdiff_t diff = std::ptrdiff_t( sequence - pos );
+
+            if ( diff == 0 ){
+                // the slot is free: claim it, unless another producer did first. pos is reloaded on failure 
+                if ( mWritePos.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+                    break;
+            }
+            else if ( diff < 0 ){
+                // the consumer has not read the message a lap before yet 
+                mNumOverflows.fetch_add( 1, std::memory_order_relaxed );
+                return false;
+            }
+            else{
+                pos = mWritePos.load( std::memory_order_relaxed );
+            }
+        }
+
+        mSlots[pos & mMask] = msg;
+        mSequences[pos & mMask].store( pos + 1, std::memory_order_release );
+        mNumPushed.fetch_add( 1, std::memory_order_relaxed );
+        return true;
+    }
+
+    // --------- consumer side 
+
+    /** 
+     * Returns the oldest ready messages, up to the end of the array: call again after commitRead() to get the ones that wrapped around. 
+     * The messages stay valid until they are committed. An empty span means no message is ready 
+     */
+    Span peek()
+    {
+        const std::size_t index = mReadPos & mMask;
+        const std::size_t maxSize = getCapacity() - index;
+
+        Span span;
+        span.data = mSlots.get() + index;
+        span.size = 0;
+        while ( span.size < maxSize && isReady( mReadPos + span.size ) )
+            span.size++;
+
+        updateHighWater( span.size );
+        return span;
+    }
+
+    /** Frees the \a count oldest messages, that were read through peek(), for the producers */
+    void commitRead( std::size_t count )
+    {
+        for ( std::size_t i = 0; i < count; i++ )
+            release( mReadPos + i );
+        mReadPos += count;
+    }
+
+    /** 
+     * Calls \a func( msg ) for each ready message, in place and in order, and frees each slot after the call. 
+     * Returns the number of messages consumed 
+     */
+    template <typename Func>
+    std::size_t consume( Func func )
+    {
+        std::size_t count = 0;
+        for ( ; isReady( mReadPos ); mReadPos++, count++ ){
+            func( static_cast<const T&>( mSlots[mReadPos & mMask] ) );
+            release( mReadPos );
+        }
+
+        updateHighWater( count );
+        return count;
+    }
+
+    // --------- any thread 
+
+    /** Returns the number of messages dropped so far because the queue was full, modulo 2^32 */
+    std::uint32_t getNumOverflows() const { return mNumOverflows.load( std::memory_order_relaxed ); }
+
+    /** Returns the counters of the queue */
+    MsgQueueStats getStats() const
+    {
+        MsgQueueStats stats;
+        stats.capacity = getCapacity();
+        stats.numPushed = mNumPushed.load( std::memory_order_relaxed );
+        stats.numOverflows = mNumOverflows.load( std::memory_order_relaxed );
+        stats.highWater = stats.numOverflows > 0 ? stats.capacity : mHighWater.load( std::memory_order_relaxed );
+        return stats;
+    }
+
+private:
+
+    static std::size_t roundUpToPowerOfTwo( std::size_t n )
+    {
+        std::size_t size = 1;
+        while ( size < n )
+            size <<= 1;
+        return size;
+    }
+
+    bool isReady( std::size_t pos ) const
+    {
+        return mSequences[pos & mMask].load( std::memory_order_acquire ) == pos + 1;
+    }
+
+    // the slot is free again for the producer that claims it a lap later 
+    void release( std::size_t pos )
+    {
+        mSequences[pos & mMask].store( pos + getCapacity(), std::memory_order_release );
+    }
+
+    void updateHighWater( std::size_t available )
+    {
+        if ( available > mHighWater.load( std::memory_order_relaxed ) )
+            mHighWater.store( available, std::memory_order_relaxed );
+    }
+
+    // padded as the SpscQueue, so that the producers and the consumer don't share cache lines 
+    char mPadStart[kCacheLineSize];
+
+    // written by all the producers 
+    std::atomic<std::size_t> mWritePos;
+    std::atomic<std::uint32_t> mNumPushed;
+    std::atomic<std::uint32_t> mNumOverflows;
+    static_assert( ATOMIC_INT_LOCK_FREE == 2, "the counters are updated by the producers, the audio thread among them: they must be lock-free" );
+
+    char mPadProducers[kCacheLineSize];
+
+    // written by the consumer 
+    std::size_t mReadPos;
+    std::atomic<std::size_t> mHighWater;
+
+    char mPadConsumer[kCacheLineSize];
+
+    // only read after construction. The sequences are written by both sides, one slot at a time 
+    const std::size_t mMask;
+    const std::unique_ptr<T[]> mSlots;
+    const std::unique_ptr<std::atomic<std::size_t>[]> mSequences;
+};
+
+template <typename T>
+const std::size_t MpscQueue<T>::kCacheLineSize;
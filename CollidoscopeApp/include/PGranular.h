@@ -22,7 +22,10 @@
 
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cstdint>
 #include <type_traits>
 #include <cmath>
 
@@ -46,6 +49,13 @@ using std::size_t;
  *
  *
  * PGranular uses a linear ASR envelope with 10 milliseconds attack and 50 milliseconds release.
+ * All the time constants are in seconds and are converted to samples in the constructor, according to the sample rate.
+ *
+ * The sample can also be paged ( see setBuffer() ): a page not resident in memory is read as silence and the miss is counted, 
+ * so that the audio thread never waits for the disk.
+ *
+ * The sample can also be live ( see setLiveDelay() ): a delay line written as the grains read it. The grains then start 
+ * behind the write head, far enough not to catch up with it, nor to be caught up, before they end.
  *
  * Note that PGranular is header based and only depends on std library and on "EnvASR.h" (also header based).
  * This means you can embedd it in two your project just by copying these two files over.
@@ -62,7 +72,10 @@ class PGranular
 
 public:
     static const size_t kMaxGrains = 32;
-    static const size_t kMinGrainsDuration = 640;
+    /** Minimum duration of grains and minimum inter onset, in seconds ( 640 samples at 44.1 kHz ) */
+    static constexpr double kMinGrainsDurationSeconds = 640.0 / 44100.0;
+    /** Value of the 16 bits samples of a compact buffer ( see setBuffer() ) for a sample at full scale */
+    static constexpr double kInt16FullScale = 32767.0;
 
     static inline T interpolateLin( double xn, double xn_1, double decimal )
     {
@@ -102,12 +115,26 @@ public:
     PGranular( const T* buffer, size_t bufferLen, size_t sampleRate, RandOffsetFunc & rand, TriggerCallbackFunc & triggerCallback, int ID ) :
         mBuffer( buffer ),
         mBufferLen( bufferLen ),
+        mBufferOffset( 0 ),
+        mCompactBuffer( nullptr ),
+        mPrevBuffer( buffer ),
+        mPrevCompactBuffer( nullptr ),
+        mPages( nullptr ),
+        mPageShift( 0 ),
+        mNumPageMisses( 0 ),
+        mCrossfadeLen( 0 ),
+        mCrossfadeLeft( 0 ),
+        mLiveDelay( 0 ),
+        mMinGrainsDuration( size_t( std::lround( kMinGrainsDurationSeconds * sampleRate ) ) ),
         mNumAliveGrains( 0 ),
         mGrainsRate( 1.0 ),
         mTrigger( 0 ),
         mTriggerRate( 0 ), // start silent 
         mGrainsStart( 0 ),
-        mGrainsDuration( kMinGrainsDuration ),
+        mSnapPoints( nullptr ),
+        mNumSnapPoints( 0 ),
+        mSnapMaxDistance( 0 ),
+        mGrainsDuration( mMinGrainsDuration ),
         mGrainsDurationCoeff( 1 ),
         mRand( rand ),
         mTriggerCallback( triggerCallback ),
@@ -138,8 +165,87 @@ public:
 
         mGrainsDuration = std::lround( mTriggerRate * coeff ); 
 
-        if ( mGrainsDuration < kMinGrainsDuration )
-            mGrainsDuration = kMinGrainsDuration;
+        if ( mGrainsDuration < mMinGrainsDuration )
+            mGrainsDuration = mMinGrainsDuration;
+    }
+
+    /** 
+     * Sets the buffer the grains are read from. \a bufferOffset is the index in \a buffer of the first sample of the recorded sample, 
+     * which wraps around the end of \a buffer. The selection start is relative to \a bufferOffset.
+     *
+     * If \a crossfadeLen is not 0, the grains fade from the old buffer to the new one over \a crossfadeLen samples, so the old buffer 
+     * must stay valid for that long. There is no crossfade if the new buffer is longer than the old one. 
+     * The grains playing past the end of a shorter buffer wrap around its end.
+     *
+     * \a compactBuffer, if not nullptr, is the same sample in 16 bits, scaled by kInt16FullScale. The grains then read it rather than 
+     * \a buffer, converting each sample as they interpolate it: half the memory traffic of the float samples.
+     * There is no crossfade between a compact buffer and a float one.
+     *
+     * \a pages, if not nullptr, pages \a buffer: pages[i] points to the samples from i << \a pageShift in \a buffer when they are resident in memory, 
+     * and is nullptr otherwise. The grains then read the samples through \a pages only, and read silence from a page not resident. 
+     * There is no crossfade from or to a paged buffer.
+     */
+    void setBuffer( const T* buffer, size_t bufferLen, size_t bufferOffset, size_t crossfadeLen = 0, const int16_t *compactBuffer = nullptr,
+        const std::atomic<const T*> *pages = nullptr, size_t pageShift = 0 )
+    {
+        if ( ( compactBuffer == nullptr ) != ( mCompactBuffer == nullptr ) || pages != nullptr || mPages != nullptr )
+            crossfadeLen = 0;
+
+        if ( bufferLen > 0 && bufferLen < mBufferLen ){
+            for ( size_t i = 0; i < mNumAliveGrains; i++ )
+                mGrains[i].phase = std::fmod( mGrains[i].phase, double( bufferLen ) );
+        }
+
+        if ( crossfadeLen > 0 && bufferLen <= mBufferLen && !isIdle() ){
+            mPrevBuffer = mBuffer;
+            mPrevCompactBuffer = mCompactBuffer;
+            mCrossfadeLen = crossfadeLen;
+            mCrossfadeLeft = crossfadeLen;
+        }
+        else{
+            mCrossfadeLeft = 0;
+        }
+
+        mBuffer = buffer;
+        mCompactBuffer = compactBuffer;
+        mPages = pages;
+        mPageShift = pageShift;
+        mBufferLen = bufferLen;
+        mBufferOffset = bufferOffset;
+    }
+
+    /**
+     * Moves the first sample of the recorded sample to \a bufferOffset, without changing the buffer. Only the grains triggered 
+     * from now on start relative to the new offset: the grains playing keep reading where they are. Used with a live buffer, 
+     * whose first sample is the oldest one and moves as the buffer is written.
+     */
+    void setBufferOffset( size_t bufferOffset )
+    {
+        mBufferOffset = bufferOffset;
+    }
+
+    /**
+     * Makes the buffer a live one: a delay line written at the buffer offset ( see setBufferOffset() ), that is at the end 
+     * of the recorded sample, while the grains read it. Each new grain starts at least \a delay samples away from both ends 
+     * of the sample, and farther if its rate makes it move towards an end, so that it never reads a sample being written. 
+     * The selection start is moved back as needed. A grain whose rate would carry it to an end before it's over is shortened, 
+     * and not started at all if it would be shorter than the minimum duration. 0 for a buffer that doesn't change as it's read.
+     */
+    void setLiveDelay( size_t delay )
+    {
+        mLiveDelay = delay;
+    }
+
+    /**
+     * Sets the positions the grains start on: \a points is an array of \a numPoints positions in the recorded sample, sorted, 
+     * e.g. its zero crossings. The start of each new grain moves to the nearest point, if it's at most \a maxDistance samples away.
+     * The nearest point is found with a binary search. \a points must stay valid until the next call. Pass 0 points to not snap the grains.
+     */
+    void setSnapPoints( const uint32_t *points, size_t numPoints, size_t maxDistance )
+    {
+        mSnapPoints = points;
+        mNumSnapPoints = numPoints;
+        mSnapMaxDistance = maxDistance;
     }
 
     /** Sets rate of grains. e.g rate = 2 means one octave higer */
@@ -158,8 +264,8 @@ public:
     void setSelectionSize( size_t size )
     {
 
-        if ( size < kMinGrainsDuration )
-            size = kMinGrainsDuration;
+        if ( size < mMinGrainsDuration )
+            size = mMinGrainsDuration;
 
         mTriggerRate = size;
 
@@ -180,8 +286,8 @@ public:
     {
         if ( mEnvASR.getState() == EnvASR<T>::State::eIdle ){
             // note on sets triggering top the min value 
-            if ( mTriggerRate < kMinGrainsDuration ){
-                mTriggerRate = kMinGrainsDuration;
+            if ( mTriggerRate < mMinGrainsDuration ){
+                mTriggerRate = mMinGrainsDuration;
             }
 
             setGrainsRate( rate );
@@ -203,6 +309,24 @@ public:
         return mEnvASR.getState() == EnvASR<T>::State::eIdle;
     }
 
+    /** Returns the number of grains playing */
+    size_t getNumAliveGrains() const
+    {
+        return mNumAliveGrains;
+    }
+
+    /** Returns how many samples past their start the grains triggered now read: their duration times their rate */
+    size_t getGrainsReach() const
+    {
+        return size_t( std::ceil( mGrainsDuration * mGrainsRate ) ) + 1;
+    }
+
+    /** Returns the number of times a grain found a page of a paged buffer not resident, at most once per grain and block */
+    size_t getNumPageMisses() const
+    {
+        return mNumPageMisses;
+    }
+
     /**
      * Runs the granular engine and stores the output in \a audioOut
      * 
@@ -232,6 +356,8 @@ public:
         // does the actual grains processing 
         processGrains( audioOut, tempBuffer, envSamples );
 
+        mCrossfadeLeft -= std::min( mCrossfadeLeft, envSamples );
+
         // becomes idle if the envelope goes to idle state 
         if ( becameIdle ){
             mTriggerCallback( 'e', mID );
@@ -246,7 +372,7 @@ private:
 
         /* process all existing alive grains */
         for ( size_t grainIdx = 0; grainIdx < mNumAliveGrains;  ){
-            synthesizeGrain( mGrains[grainIdx], audioOut, envelopeValues, numSamples );
+            synthesizeGrain( mGrains[grainIdx], audioOut, envelopeValues, numSamples, 0 );
 
             if ( !mGrains[grainIdx].alive ){
                 // this grain is dead so copy the last of the active grains here 
@@ -273,31 +399,34 @@ private:
         // trigger new grain and synthesize them as well 
         while ( mTrigger < numSamples ){
             
-            // if there is room to accommodate new grains 
-            if ( mNumAliveGrains < kMaxGrains ){
+            size_t start = 0;
+            size_t duration = mGrainsDuration;
+
+            // if there is room to accommodate new grains, and a place in the buffer for this one 
+            if ( mNumAliveGrains < kMaxGrains && placeGrain( randOffset, start, duration ) ){
                 // get next grain will be placed at the end of the alive ones 
                 size_t grainIdx = mNumAliveGrains;
                 mNumAliveGrains++;
 
                 // initialize and synthesise the grain 
                 PGrain &grain = mGrains[grainIdx];
-                
-                double phase = mGrainsStart + double( randOffset );
-                if ( phase >= mBufferLen )
+
+                double phase = double( mBufferOffset + start );
+                while ( phase >= mBufferLen )
                     phase -= mBufferLen;
 
                 grain.phase = phase;
                 grain.rate = mGrainsRate;
                 grain.alive = true;
                 grain.age = 0;
-                grain.duration = mGrainsDuration;
+                grain.duration = duration;
 
-                const double w = 3.14159265358979323846 / mGrainsDuration;
+                const double w = 3.14159265358979323846 / duration;
                 grain.b1 = 2.0 * std::cos( w );
                 grain.y1 = std::sin( w );
                 grain.y2 = 0.0;
 
-                synthesizeGrain( grain, audioOut + mTrigger, envelopeValues + mTrigger, numSamples - mTrigger );
+                synthesizeGrain( grain, audioOut + mTrigger, envelopeValues + mTrigger, numSamples - mTrigger, mTrigger );
 
                 if ( grain.alive == false ) {
                     mNumAliveGrains--;
@@ -318,11 +447,72 @@ private:
         }
     }
 
+    // reads the samples of a paged buffer: the samples of a page not resident are 0 
+    struct PageReader
+    {
+        const std::atomic<const T*> *pages;
+        size_t pageShift;
+        size_t pageMask;
+        // last page read, looked up again only when the grain moves to another page 
+        size_t page;
+        const T* pageData;
+        bool missed;
+
+        PageReader( const std::atomic<const T*> *pages_, size_t pageShift_ ) :
+            pages( pages_ ), pageShift( pageShift_ ), pageMask( ( size_t( 1 ) << pageShift_ ) - 1 ), page( size_t( -1 ) ), pageData( nullptr ), missed( false ) 
+        {
+        }
+
+        T operator[]( size_t index )
+        {
+            if ( ( index >> pageShift ) != page ){
+                page = index >> pageShift;
+                pageData = pages[page].load( std::memory_order_acquire );
+            }
+
+            if ( pageData == nullptr ){
+                missed = true;
+                return T( 0 );
+            }
+
+            return pageData[index & pageMask];
+        }
+    };
+
     // synthesize a single grain 
     // audioOut = pointer to audio block to fill 
     // numSamples = number of samples to process for this block
-    void synthesizeGrain( PGrain &grain, T* audioOut, T* envelopeValues, size_t numSamples )
+    // blockOffset = position of audioOut[0] in the block, used for the crossfade between buffers 
+    void synthesizeGrain( PGrain &grain, T* audioOut, T* envelopeValues, size_t numSamples, size_t blockOffset )
     {
+        // the storage is chosen once per grain and block, so that the loop reading the samples has no branch 
+        if ( mPages != nullptr ){
+            // no crossfade with a paged buffer: the previous buffer is never read 
+            PageReader reader( mPages, mPageShift );
+            synthesizeGrain( grain, audioOut, envelopeValues, numSamples, blockOffset, reader, reader );
+            if ( reader.missed )
+                mNumPageMisses++;
+        }
+        else if ( mCompactBuffer != nullptr ){
+            synthesizeGrain( grain, audioOut, envelopeValues, numSamples, blockOffset, mCompactBuffer, mPrevCompactBuffer );
+        }
+        else{
+            synthesizeGrain( grain, audioOut, envelopeValues, numSamples, blockOffset, mBuffer, mPrevBuffer );
+        }
+    }
+
+    // scale of the samples of a buffer, applied after interpolating them 
+    static constexpr T sampleScale( const T* ) { return T( 1 ); }
+    static constexpr T sampleScale( const int16_t* ) { return T( 1.0 / kInt16FullScale ); }
+    static constexpr T sampleScale( const PageReader & ) { return T( 1 ); }
+
+    // synthesize a single grain reading the samples from buffer, and from prevBuffer during the crossfade. 
+    // The buffers are pointers to the samples, or a PageReader 
+    template <typename R>
+    void synthesizeGrain( PGrain &grain, T* audioOut, T* envelopeValues, size_t numSamples, size_t blockOffset, R &buffer, R &prevBuffer )
+    {
+        // the 16 bits samples are widened as they are interpolated, and scaled once 
+        const T scale = sampleScale( buffer );
 
         // copy all grain data into local variable for faster processing
         const auto rate = grain.rate;
@@ -345,7 +535,14 @@ private:
 
             const double decimal = phase - readIndex;
 
-            T out = interpolateLin( mBuffer[readIndex], mBuffer[nextReadIndex], decimal );
+            T out = interpolateLin( buffer[readIndex], buffer[nextReadIndex], decimal ) * scale;
+
+            // the buffer was just swapped: fade out the previous buffer 
+            if ( blockOffset + sampleIdx < mCrossfadeLeft ){
+                const T prevGain = T( mCrossfadeLeft - blockOffset - sampleIdx ) / mCrossfadeLen;
+                const T prevOut = interpolateLin( prevBuffer[readIndex], prevBuffer[nextReadIndex], decimal ) * scale;
+                out = out * ( 1 - prevGain ) + prevOut * prevGain;
+            }
             
             // apply raised cosine bell envelope 
             auto y0 = b1 * y1 - y2;
@@ -378,6 +575,71 @@ private:
         }
     }
 
+    // sets the start of a new grain, the selection start plus randOffset snapped, and keeps the grain away from the write head 
+    // of a live buffer ( see fitLive() ). Returns false if the grain must not be started 
+    bool placeGrain( size_t randOffset, size_t &start, size_t &duration ) const
+    {
+        start = mGrainsStart + randOffset;
+        while ( start >= mBufferLen )
+            start -= mBufferLen;
+        start = snap( start );
+
+        return mLiveDelay == 0 || fitLive( start, duration );
+    }
+
+    // moves pos to the nearest position a new grain of a live buffer can start from, and shortens the grain if it can't fit: 
+    // a grain faster than the write head gets closer to the end of the sample as it plays, a slower one gets closer to its start, 
+    // that is overwritten next. Returns false if the grain would be shorter than the minimum duration 
+    bool fitLive( size_t &pos, size_t &duration ) const
+    {
+        // the live delay at both ends, and one more sample for the interpolation 
+        const size_t margin = 2 * mLiveDelay + 1;
+        if ( mBufferLen <= margin )
+            return false;
+
+        // the grain drifts from the write head by its rate minus one at each sample: no more than the room between the margins 
+        const size_t room = mBufferLen - margin;
+        const double speed = std::abs( mGrainsRate - 1.0 );
+        if ( speed * duration > room ){
+            duration = size_t( room / speed );
+            if ( duration < mMinGrainsDuration )
+                return false;
+        }
+
+        const double drift = ( mGrainsRate - 1.0 ) * duration;
+        const size_t toEnd = mLiveDelay + ( drift > 0.0 ? size_t( std::ceil( drift ) ) : 0 ) + 1;
+        const size_t fromStart = mLiveDelay + ( drift < 0.0 ? size_t( std::ceil( -drift ) ) : 0 );
+
+        pos = std::min( std::max( pos, fromStart ), mBufferLen - toEnd );
+        return true;
+    }
+
+    // returns the snap point nearest to pos, or pos if there is none close enough 
+    size_t snap( size_t pos ) const
+    {
+        if ( mNumSnapPoints == 0 )
+            return pos;
+
+        const uint32_t *end = mSnapPoints + mNumSnapPoints;
+        const uint32_t *next = std::lower_bound( mSnapPoints, end, uint32_t( pos ) );
+
+        size_t nearest = pos;
+        size_t distance = mSnapMaxDistance + 1;
+
+        if ( next != end ){
+            nearest = *next;
+            distance = *next - pos;
+        }
+
+        if ( next != mSnapPoints && pos - *( next - 1 ) < distance ){
+            nearest = *( next - 1 );
+            distance = pos - *( next - 1 );
+        }
+
+        // the points are in the recorded sample: a shorter sample than the one analyzed is never read past its end 
+        return ( distance <= mSnapMaxDistance && nearest < mBufferLen ) ? nearest : pos;
+    }
+
     void copyGrain( size_t from, size_t to)
     {
         mGrains[to] = mGrains[from];
@@ -386,6 +648,7 @@ private:
     void reset()
     {
         mTrigger = 0;
+        mCrossfadeLeft = 0;
         for ( size_t i = 0; i < mNumAliveGrains; i++ ){
             mGrains[i].alive = false;
         }
@@ -398,11 +661,38 @@ private:
     // pointer to (mono) buffer, where the underlying sample is recorder 
     const T* mBuffer;
     // length of mBuffer in samples 
-    const size_t mBufferLen;
+    size_t mBufferLen;
+    // index in mBuffer of the first sample of the recorded sample 
+    size_t mBufferOffset;
+
+    // 16 bits copy of mBuffer read by the grains, or nullptr 
+    const int16_t* mCompactBuffer;
+
+    // buffer before the last call to setBuffer(), read during the crossfade, and its 16 bits copy 
+    const T* mPrevBuffer;
+    const int16_t* mPrevCompactBuffer;
+
+    // pages of mBuffer, see setBuffer(), or nullptr 
+    const std::atomic<const T*> *mPages;
+    size_t mPageShift;
+    size_t mNumPageMisses;
+    size_t mCrossfadeLen;
+    // samples left before the crossfade is over 
+    size_t mCrossfadeLeft;
+    // see setLiveDelay(), 0 if the buffer is not live 
+    size_t mLiveDelay;
+
+    // kMinGrainsDurationSeconds in samples 
+    const size_t mMinGrainsDuration;
 
     // offset in the buffer where the grains start. a.k.a. selection start 
     size_t mGrainsStart;
 
+    // sorted positions the grains start on, see setSnapPoints() 
+    const uint32_t *mSnapPoints;
+    size_t mNumSnapPoints;
+    size_t mSnapMaxDistance;
+
     // attenuates signal prevents clipping of grains (to some degree)
     T mAttenuation;
 
@@ -430,6 +720,12 @@ private:
 
 
 
+template <typename T, typename RandOffsetFunc, typename TriggerCallbackFunc>
+constexpr double PGranular<T, RandOffsetFunc, TriggerCallbackFunc>::kMinGrainsDurationSeconds;
+
+template <typename T, typename RandOffsetFunc, typename TriggerCallbackFunc>
+constexpr double PGranular<T, RandOffsetFunc, TriggerCallbackFunc>::kInt16FullScale;
+
 } // namespace collidoscope
 
 
@@ -23,55 +23,123 @@
 
 #include "cinder/Cinder.h"
 #include "cinder/audio/Node.h"
-#include "cinder/audio/dsp/RingBuffer.h"
 #include "boost/optional.hpp"
 #include "Messages.h"
-#include "RingBufferPack.h"
+#include "MpscQueue.h"
+#include "SpscQueue.h"
 
+#include <atomic>
+#include <cstdint>
 #include <memory>
 
 #include "PGranular.h"
 #include "EnvASR.h"
+#include "SilenceGateNode.h"
+#include "DspLoadMeter.h"
+#include "LatencyTracer.h"
+#include "SubBlock.h"
+#include "GrainBuffer.h"
+#include "WaveIndex.h"
 
 typedef std::shared_ptr<class PGranularNode> PGranularNodeRef;
-typedef ci::audio::dsp::RingBufferT<CursorTriggerMsg> CursorTriggerMsgRingBuffer;
+typedef SpscQueue<CursorTriggerMsg> CursorTriggerMsgQueue;
+// notes are played from the graphic thread and the MIDI threads 
+typedef MpscQueue<NoteMsg> NoteMsgQueue;
 
 
 struct RandomGenerator;
 
 /*
 A node in the Cinder audio graph that holds PGranulars for loop and keyboard playing  
+The node is silent when the loop and all the keyboard voices are idle 
+Audio is processed in sub-blocks of kSubBlockFrames frames, and selection, duration and notes are updated before each sub-block 
+The selection is set in chunks and converted to samples of the wave being played, so it follows the wave when its length changes 
+The grains can start on the zero crossings or on the onsets of the wave, once the WaveAnalyzer has published its WaveIndex 
+A live wave, the delay line of a recorder in live mode, is read behind its write head, that the node follows at each block 
 */
-class PGranularNode : public ci::audio::Node
+class PGranularNode : public ci::audio::Node, public SilenceAware
 {
 public:
     static const size_t kMaxVoices = 6;
     static const int kNoMidiNote = -50;
 
-    explicit PGranularNode( ci::audio::Buffer *grainBuffer, CursorTriggerMsgRingBuffer &triggerRingBuffer );
+    enum class SnapMode {
+        eOff,           // the grains start anywhere 
+        eZeroCrossings, // the grains start on the nearest zero crossing, to avoid clicks 
+        eOnsets         // the grains start on the nearest onset, if any is close, to play the attacks of the sounds 
+    };
+
+    /** 
+     * numChunks is the number of chunks the waves are split in, that the selection is measured in. 
+     * noteQueueSize is the number of note and loop messages that can wait for the audio thread 
+     */
+    PGranularNode( const AtomicGrainBuffer &grainBuffer, CursorTriggerMsgQueue &triggerQueue, size_t numChunks, size_t noteQueueSize );
     ~PGranularNode();
 
-    /** Set selection size in samples */
-    void setSelectionSize( size_t size )
-    {
-        mSelectionSize.set( size );
-    }
+    /** 
+     * Packs a selection in one word, start chunk in the high 16 bits and size in chunks in the low 16 bits, 
+     * so that the start and the size always change together 
+     */
+    static uint32_t packSelection( size_t startChunk, size_t numChunks ) { return uint32_t( ( startChunk << 16 ) | ( numChunks & 0xFFFF ) ); }
+    static size_t selectionStartOf( uint32_t selection ) { return selection >> 16; }
+    static size_t selectionSizeOf( uint32_t selection ) { return selection & 0xFFFF; }
 
-    /** Set selection start in samples */
-    void setSelectionStart( size_t start )
-    {
-        mSelectionStart.set( start );
-    }
+    /** Returns the selection last set, packed with packSelection(). Can be called from any thread */
+    uint32_t getSelection() const { return mSelection.load(); }
+
+    /** 
+     * Sets the selection, packed with packSelection(), if it's still \a expected. Otherwise returns false and sets \a expected 
+     * to the current selection. Can be called from any thread 
+     */
+    bool compareExchangeSelection( uint32_t &expected, uint32_t selection ) { return mSelection.compareExchange( expected, selection ); }
 
     void setGrainsDurationCoeff( double coeff )
     {
         mGrainDurationCoeff.set( coeff );
     }
 
+    /** Sets the duration in seconds of the crossfade when the recorder publishes a new wave. 0 disables the crossfade. Call before initialize() */
+    void setGrainBufferCrossfadeTime( double seconds ) { mGrainBufferCrossfadeTime = seconds; }
+
+    /** Sets how close to the write head of a live wave, in seconds, the grains can read ( see PGranular::setLiveDelay() ). Call before initialize() */
+    void setLiveDelayTime( double seconds ) { mLiveDelayTime = seconds; }
+
+    /** Sets where the grains start. Call before initialize() */
+    void setSnapMode( SnapMode mode ) { mSnapMode = mode; }
+
+    /** 
+     * Returns the index of the wave, published by the WaveAnalyzer. The index is used only if it was built for the wave being played.
+     * The node owns the index published last and frees it when destroyed.
+     */
+    AtomicWaveIndex& getWaveIndex() { return mWaveIndex; }
+
     /* PGranularNode passes itself as trigger callback in PGranular */
     void operator()( char msgType, int ID );
 
-    ci::audio::dsp::RingBufferT<NoteMsg>& getNoteRingBuffer() { return mNoteMsgRingBufferPack.getBuffer(); }
+    /* Returns the queue the notes and the loop are started and stopped through. Can be written by any thread */
+    NoteMsgQueue& getNoteQueue() { return mNoteQueue; }
+
+    /* true if no PGranular produced sound in the last processed block */
+    bool isSilent() const override { return mSilent; }
+
+    /** 
+     * Returns the part of the wave the grains are about to read, when the wave is paged: \a numFrames frames from \a begin, 
+     * relative to the start of the wave. Updated at each block, read by the PagePrefetcher 
+     */
+    void getPrefetchWindow( size_t &begin, size_t &numFrames ) const
+    {
+        begin = mPrefetchBegin.load( std::memory_order_relaxed );
+        numFrames = mPrefetchNumFrames.load( std::memory_order_relaxed );
+    }
+
+    /** Returns the number of times a grain read a page of a paged wave that was not resident, and played silence instead */
+    size_t getNumPageMisses() const { return mNumPageMisses.load( std::memory_order_relaxed ); }
+
+    /* Sets the meter and the slot where the time spent in process() is recorded */
+    void setDspLoadMeter( DspLoadMeter *meter, size_t slot ) { mLoadMeter = meter; mLoadMeterSlot = slot; }
+
+    /* Sets the tracer where the latency of the note messages is recorded, as they are dequeued and at the end of the sub-block of their first grain */
+    void setLatencyTracer( LatencyTracer *tracer ) { mLatencyTracer = tracer; }
 
 protected:
     
@@ -97,6 +165,16 @@ private:
             mAtomic = val;
         }
 
+        T load() const
+        {
+            return mAtomic;
+        }
+
+        bool compareExchange( T &expected, T val )
+        {
+            return mAtomic.compare_exchange_weak( expected, val );
+        }
+
         boost::optional<T> get()
         {
             const T val = mAtomic;
@@ -117,6 +195,30 @@ private:
     // creates or re-start a PGranular and sets the pitch according to the MIDI note passed as argument
     void handleNoteMsg( const NoteMsg &msg );
 
+    // the voice, or kMaxVoices for the loop, was started by \a msg: its first grain closes the trace of the message 
+    void startTrace( size_t voice, const NoteMsg &msg );
+
+    // passes the new selection, grain duration and note messages from the other threads to the PGranulars 
+    void updateControls();
+
+    // passes the wave last committed by the recorder to the PGranulars, if it changed 
+    void updateGrainBuffer();
+
+    // passes the first sample of the live wave, that moves as the recorder writes it, to the PGranulars 
+    void updateLiveOffset();
+
+    // passes the selection size and/or start to the PGranulars, converted from chunks to samples of the wave being played 
+    void updateSelection( bool updateSize, bool updateStart );
+
+    // passes the points the grains start on to the PGranulars, if the index of the wave being played is available 
+    void updateSnapPoints();
+
+    // publishes the part of the paged wave the grains are about to read, and the page misses 
+    void updatePrefetchWindow();
+
+    // runs the PGranulars on one sub-block. Returns true if they were all idle 
+    bool processSubBlock( float *audioOut, size_t numFrames );
+
     // pointers to PGranular objects 
     std::unique_ptr < collidoscope::PGranular<float, RandomGenerator, PGranularNode > > mPGranularLoop;
     std::array<std::unique_ptr < collidoscope::PGranular<float, RandomGenerator, PGranularNode > >, kMaxVoices> mPGranularNotes;
@@ -126,20 +228,57 @@ private:
     // pointer to the random generator struct passed over to PGranular 
     std::unique_ptr< RandomGenerator > mRandomOffset;
     
-    // buffer containing the recorded audio, to pass to PGranular in initialize()
-    ci::audio::Buffer *mGrainBuffer;
+    // wave published by the recorder, where the grains are read from 
+    const AtomicGrainBuffer &mGrainBuffer;
+    // wave the PGranulars are currently reading from 
+    GrainBuffer mCurrentGrainBuffer;
+    // crossfade when a new wave is published, in seconds and in samples 
+    double mGrainBufferCrossfadeTime;
+    size_t mGrainBufferCrossfadeLen;
+    // minimum delay behind the write head of a live wave, in seconds and in samples 
+    double mLiveDelayTime;
+    size_t mLiveDelayLen;
+
+    AtomicWaveIndex mWaveIndex;
+    SnapMode mSnapMode;
 
     ci::audio::BufferRef mTempBuffer;
 
-    CursorTriggerMsgRingBuffer &mTriggerRingBuffer;
-    RingBufferPack<NoteMsg> mNoteMsgRingBufferPack;
+    CursorTriggerMsgQueue &mTriggerQueue;
+    NoteMsgQueue mNoteQueue;
 
-    LazyAtomic<size_t> mSelectionSize;
-    
-    LazyAtomic<size_t> mSelectionStart;
+    const size_t mNumChunks;
+
+    // selection start and size in chunks, packed with packSelection() 
+    LazyAtomic<uint32_t> mSelection;
+
+    // last selection read from mSelection 
+    size_t mSelectionSizeChunks;
+    size_t mSelectionStartChunk;
     
     LazyAtomic<double> mGrainDurationCoeff;
 
+    bool mSilent;
+
+    DspLoadMeter *mLoadMeter;
+    size_t mLoadMeterSlot;
+
+    // stamps of the message that started each voice, and the loop last, until their first grain. 0 when not traced 
+    struct PendingTrace
+    {
+        uint64_t inputTime;
+        uint64_t dequeueTime;
+    };
+
+    LatencyTracer *mLatencyTracer;
+    std::array<PendingTrace, kMaxVoices + 1> mPendingTraces;
+    // when the note messages of the current sub-block were dequeued, 0 until the first is 
+    uint64_t mDequeueTime;
+
+    std::atomic<size_t> mPrefetchBegin;
+    std::atomic<size_t> mPrefetchNumFrames;
+    std::atomic<size_t> mNumPageMisses;
+
 
 };
 
@@ -0,0 +1,75 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#pragma once
+
+#include "BufferToWaveRecorderNode.h"
+#include "PGranularNode.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+/**
+ * Keeps the pages of the paged waves the grains are about to read resident in memory, in a background thread.
+ *
+ * Every few milliseconds the prefetcher reads the wave published by each recorder and, if it's paged ( see PagedWave ), 
+ * the window the PGranularNode of the wave is about to read: the selection plus the random offset and the reach of the grains.
+ * The pages of the window are made resident and the others are released.
+ */
+class PagePrefetcher
+{
+public:
+
+    /** Starts the prefetcher thread */
+    PagePrefetcher();
+
+    /** Stops the prefetcher thread */
+    ~PagePrefetcher();
+
+    PagePrefetcher( const PagePrefetcher &copy ) = delete;
+    PagePrefetcher & operator=( const PagePrefetcher &copy ) = delete;
+
+    /** Prefetches the pages of the waves published by \a recorder, in the window read by \a granular */
+    void addWave( const BufferToWaveRecorderNodeRef &recorder, const PGranularNodeRef &granular );
+
+private:
+
+    struct Wave
+    {
+        BufferToWaveRecorderNodeRef recorder;
+        PGranularNodeRef granular;
+    };
+
+    // prefetcher thread
+    void run();
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::vector<Wave> mWaves;
+    bool mRunning;
+
+    std::thread mThread;
+};
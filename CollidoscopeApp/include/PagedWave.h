@@ -0,0 +1,99 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <vector>
+
+
+/**
+ * A wave too long to be held in memory as a whole, played from a memory mapped file one page at a time.
+ *
+ * The wave is split in pages of kPageFrames frames. The grains read a page only when it's published in getPages(), 
+ * and read silence otherwise: the audio thread never touches a page that could fault. The PagePrefetcher thread calls prefetch()
+ * with the part of the wave the grains are about to read. The pages covering it are pinned in memory and published, 
+ * a few at a time, and the pages not covered anymore are withdrawn and unpinned a while later.
+ *
+ * If the pages can't be pinned, e.g. over the memory lock limit of the process, they are only read in before being published,
+ * and the system could still page them out.
+ */
+class PagedWave
+{
+public:
+
+    /** Page size as a power of two. 16384 frames are 64 KB, 0.37 seconds at 44.1 kHz */
+    static const size_t kPageShift = 14;
+    static const size_t kPageFrames = size_t( 1 ) << kPageShift;
+
+    typedef std::atomic<const float*> Page;
+
+    /** Pages the \a numFrames frames at \a data, that must stay mapped as long as the wave exists. No page is published yet */
+    PagedWave( const float *data, size_t numFrames );
+
+    /** Unpins the pages still pinned */
+    ~PagedWave();
+
+    PagedWave( const PagedWave &copy ) = delete;
+    PagedWave & operator=( const PagedWave &copy ) = delete;
+
+    /** Returns the pages the grains read: the page at index i points to the frames from i << kPageShift when published, and is nullptr otherwise */
+    const Page* getPages() const { return mPages.data(); }
+
+    size_t getNumPages() const { return mPages.size(); }
+
+    /** 
+     * Called by the prefetcher thread only. Makes resident the pages covering the \a numFrames frames from \a begin, wrapping around 
+     * the end of the wave, plus one page on each side. Pinning takes time, so at most kMaxPagesPerPrefetch pages are made resident per call.
+     */
+    void prefetch( size_t begin, size_t numFrames );
+
+    /** Returns the number of pages published. Called by the prefetcher thread only */
+    size_t getNumResidentPages() const;
+
+private:
+
+    enum class PageState { 
+        eOut,       // not resident 
+        eResident,  // pinned and published 
+        eLingering, // pinned and published, not needed anymore. Withdrawn after kLingerDelay, as grains may still be reading it 
+        eWithdrawn  // pinned and not published anymore. Unpinned at the next call, after the audio thread stopped reading it 
+    };
+
+    // makes the page resident and publishes it 
+    void pin( size_t page );
+    void unpin( size_t page );
+
+    const float *mData;
+    const size_t mNumFrames;
+
+    std::vector<Page> mPages;
+
+    // only touched by the prefetcher thread 
+    std::vector<PageState> mStates;
+    std::vector<bool> mPinned;
+    std::vector<std::chrono::steady_clock::time_point> mLingerSince;
+    std::vector<bool> mNeeded;
+    bool mPinningFailed;
+};
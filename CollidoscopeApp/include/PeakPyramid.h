@@ -0,0 +1,131 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+
+/**
+ * Multi-resolution summary of a recorded wave: minimum, maximum and RMS of any range of the wave, without reading the samples.
+ *
+ * The wave is split in leaves of kLeafFrames frames. Each level of the pyramid halves the number of nodes of the level below,
+ * and each node holds the min, max and sum of squares of the frames it covers. The pyramid is updated by the audio thread
+ * as the samples are recorded, recomputing only the leaves that changed and their ancestors, and any range of frames is
+ * answered by combining at most two nodes per level: O(log n) whatever the size of the range. The graphic thread can
+ * then draw the wave with any number of chunks, e.g. to match the pixels of the screen or to zoom in a long recording.
+ *
+ * update() is called only by the audio thread and never allocates. getPeak() can be called from any thread: the ranges
+ * are clipped to the frames published by the last update(), so the reader never sees leaves that have not been computed.
+ * A reader can still see a range that is being recorded over by a new wave, which only affects what is drawn.
+ */
+class PeakPyramid
+{
+public:
+
+    /** Number of frames summarized by a leaf of the pyramid. The bounds of a range are rounded to a multiple of kLeafFrames */
+    static const std::size_t kLeafFrames = 32;
+
+    /** Summary of a range of frames */
+    struct Peak
+    {
+        float min;
+        float max;
+        float rms;
+    };
+
+    PeakPyramid();
+
+    /** Allocates the pyramid for a wave of \a numFrames frames and clears it. Not to be called while the audio graph is running */
+    void setCapacity( std::size_t numFrames );
+
+    /** Returns the length of the wave the pyramid was allocated for */
+    std::size_t getCapacity() const { return mCapacity; }
+
+    /** Returns the memory taken by a pyramid allocated for a wave of \a numFrames frames, in bytes */
+    static std::size_t getMemorySize( std::size_t numFrames );
+
+    /** 
+     * Sets the length of the wave, up to the capacity. A wave being recorded is as long as the capacity 
+     * until the recording ends. Called by the audio thread only.
+     */
+    void setLength( std::size_t numFrames ) { mLength.store( numFrames, std::memory_order_release ); }
+
+    /** Returns the length of the wave. The chunks of the wave span this length */
+    std::size_t getLength() const { return mLength.load( std::memory_order_acquire ); }
+
+    /** Returns the number of frames of the wave summarized so far. Ranges past this point are clipped */
+    std::size_t getNumFrames() const { return mNumFrames.load( std::memory_order_acquire ); }
+
+    /**
+     * Sets the frame of the summary where the wave starts, for a wave that scrolls through a circular buffer, e.g. a delay line. 
+     * The ranges passed to getPeak() are then relative to \a origin and wrap around the capacity, while update() and refresh() 
+     * keep summarizing the buffer in its own order. 0 by default. Called by the audio thread only.
+     */
+    void setOrigin( std::size_t origin ) { mOrigin.store( origin, std::memory_order_release ); }
+
+    /**
+     * Recomputes the frames in [ \a begin, \a end ) of the wave and publishes \a end as the number of frames summarized.
+     *
+     * \a data is the circular buffer holding the wave, as in GrainBuffer: frame i of the wave is at data[( offset + i ) % capacity].
+     * The leaves that overlap the range are recomputed from their first frame up to \a end, so the wave must be written from the start.
+     */
+    void update( const float *data, std::size_t offset, std::size_t begin, std::size_t end );
+
+    /**
+     * Recomputes the frames in [ \a begin, \a end ) of a wave changed in place, e.g. by an overdub. Unlike update(), the frames 
+     * summarized past \a end are kept: the number of frames summarized only grows. \a data and \a offset are as in update().
+     */
+    void refresh( const float *data, std::size_t offset, std::size_t begin, std::size_t end );
+
+    /** Returns min, max and RMS of the frames in [ \a begin, \a end ). An empty range returns all zeros */
+    Peak getPeak( std::size_t begin, std::size_t end ) const;
+
+private:
+
+    struct Node
+    {
+        float min;
+        float max;
+        float sumSquares;
+        std::size_t numFrames;
+    };
+
+    static Node combine( const Node &lhs, const Node &rhs );
+
+    // combines the nodes covering [ begin, end ) of the summary, clipped to the frames summarized 
+    Node sum( std::size_t begin, std::size_t end ) const;
+
+    // recomputes the leaves overlapping [ begin, end ), up to end, and their ancestors 
+    void recompute( const float *data, std::size_t offset, std::size_t begin, std::size_t end );
+
+    // all the levels one after the other, the leaves first
+    std::vector<Node> mNodes;
+    // index in mNodes of the first node of each level, plus one past the end
+    std::vector<std::size_t> mLevels;
+
+    std::size_t mCapacity;
+    std::atomic<std::size_t> mLength;
+    std::atomic<std::size_t> mNumFrames;
+    std::atomic<std::size_t> mOrigin;
+};
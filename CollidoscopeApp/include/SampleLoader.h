@@ -0,0 +1,119 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "BufferToWaveRecorderNode.h"
+#include "LoadedWave.h"
+
+#include "cinder/Filesystem.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+/**
+ * Loads prepared samples from disk into the waves, in a background thread.
+ *
+ * Files are memory mapped and their samples are used as they are: no decoder is involved. The supported formats are
+ * WAV files with 16 bits integer or 32 bits float samples, and headerless files of mono samples at the sample rate of
+ * the audio engine: ".f32" for 32 bits float and ".s16" for 16 bits integer ( native byte order ).
+ * A mono float file at the sample rate of the engine is played straight from the mapped memory. Any other file is
+ * converted to mono float, taking the first channel, and resampled if needed. The sample is cut or padded with silence to
+ * the length of the wave and gets the same fade in and out as a recorded wave. A mono float file longer than the wave is 
+ * kept whole instead, up to the longest sample, and the grains read it one page at a time ( see PagedWave ). The peak pyramid is then built,
+ * which also brings all the pages of a wave in memory before the audio thread reads them. The pages of a paged wave are dropped again 
+ * as it's summarized. With GrainStorage::eInt16 the 16 bits copy the grains read is made too, except for a paged wave: 
+ * its grains always read the float samples of the file, so that no copy as long as the file is kept in memory.
+ *
+ * The loaded wave is handed to the BufferToWaveRecorderNode of the wave, that publishes it at the start of the next block.
+ * The waves retired by the recorders are freed by the loader thread, a while after the grains stopped reading them.
+ */
+class SampleLoader
+{
+public:
+
+    /** 
+     * Creates the loader for waves of \a waveLen frames at \a sampleRate, read by the grains as \a grainStorage, and starts the loader thread.
+     * Samples up to \a maxSampleLen frames are paged, if longer than \a waveLen 
+     */
+    SampleLoader( size_t sampleRate, size_t waveLen, GrainStorage grainStorage = GrainStorage::eFloat, size_t maxSampleLen = 0 );
+
+    /** Stops the loader thread. Loads still queued are discarded */
+    ~SampleLoader();
+
+    SampleLoader( const SampleLoader &copy ) = delete;
+    SampleLoader & operator=( const SampleLoader &copy ) = delete;
+
+    /** Queues the loading of the file at \a path into the wave recorded by \a recorder. Returns immediately. Errors are logged */
+    void load( const BufferToWaveRecorderNodeRef &recorder, const ci::fs::path &path );
+
+    /**
+     * Queues the loading of a wave already in memory, e.g. in a mapped session file, into the wave recorded by \a recorder.
+     * \a data holds a whole wave of \a numFrames frames, with its fades, and is played as it is. \a numFrames can't be longer than
+     * the waves of the loader. \a owner keeps \a data alive as long as the wave is played.
+     */
+    void load( const BufferToWaveRecorderNodeRef &recorder, const float *data, size_t numFrames, const std::shared_ptr<const void> &owner );
+
+private:
+
+    struct Request
+    {
+        BufferToWaveRecorderNodeRef recorder;
+        // file to load, or the samples of a wave already in memory and their owner
+        ci::fs::path path;
+        const float *data = nullptr;
+        size_t numFrames = 0;
+        std::shared_ptr<const void> owner;
+    };
+
+    void queue( const Request &request );
+
+    // loader thread
+    void run();
+    // loads the file, returns nullptr and logs the error if the file can't be loaded
+    LoadedWave* loadFile( const ci::fs::path &path ) const;
+    // builds the peak pyramid of \a wave and points it at the \a numFrames frames of \a data, paged if longer than a wave. Returns \a wave
+    LoadedWave* finishWave( LoadedWave *wave, const float *data, size_t numFrames ) const;
+    // takes the waves retired by the recorders and frees the ones retired long enough ago
+    void collectRetiredWaves();
+
+    const size_t mSampleRate;
+    const size_t mWaveLen;
+    const GrainStorage mGrainStorage;
+    const size_t mMaxSampleLen;
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::deque<Request> mRequests;
+    bool mRunning;
+
+    // recorders a wave was loaded into, whose retired waves are collected
+    std::vector<BufferToWaveRecorderNodeRef> mRecorders;
+    std::vector<std::pair<const LoadedWave*, std::chrono::steady_clock::time_point>> mRetiredWaves;
+
+    std::thread mThread;
+};
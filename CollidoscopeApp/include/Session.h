@@ -0,0 +1,124 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include "cinder/Filesystem.h"
+
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+/**
+ * The state of a wave saved in the session file.
+ */
+struct WaveSession
+{
+    /** Selection start, in chunks */
+    size_t selectionStart = 0;
+    /** Selection size in chunks, 0 if the selection is null */
+    size_t selectionSize = 0;
+    /** Grain duration coefficient */
+    double durationCoeff = 1.0;
+    /** Position of the filter knob, from 0 ( min cutoff ) to 1 ( max cutoff ) */
+    double filter = 1.0;
+
+    /** Samples of the wave, in wave order. Set when saving, empty if no wave was recorded */
+    std::vector<float> samples;
+
+    /** Samples of the wave in the mapped session file. Set when restoring, nullptr if no wave was saved */
+    const float *mappedSamples = nullptr;
+    /** Number of frames in mappedSamples. A wave can be shorter than the wave length */
+    size_t numMappedFrames = 0;
+    /** min and max of each chunk of the wave in the mapped session file, interleaved. Set when restoring along with mappedSamples */
+    const float *mappedChunks = nullptr;
+};
+
+/**
+ * The state of the whole installation saved in the session file.
+ */
+struct SessionState
+{
+    std::array<WaveSession, NUM_WAVES> waves;
+
+    /** Keeps the mapped session file alive, as long as the restored samples are played */
+    std::shared_ptr<const void> mapping;
+};
+
+/**
+ * Saves the state of the installation in a binary session file, so that it comes back as it was after a reboot or a crash.
+ *
+ * The file has a header with a version, followed by the state of each wave: the selection, the duration and filter
+ * settings, the min and max of each chunk and all the samples of the wave. Each wave takes the room of the longest wave. The samples are stored as native floats at
+ * an aligned offset, so that the restored file is memory mapped and the waves are played and drawn straight from it.
+ * A file saved with a different version, number of waves, sample rate, wave length or number of chunks is ignored.
+ *
+ * Saving happens in a background thread. The file is first written next to the session file, synced and then renamed
+ * over it, so that a crash while saving leaves the previous session intact.
+ */
+class Session
+{
+public:
+
+    /** Creates a session stored at \a path, for waves of \a waveLen frames at \a sampleRate, and starts the writer thread */
+    Session( const ci::fs::path &path, size_t sampleRate, size_t waveLen, size_t numChunks );
+
+    /** Stops the writer thread after saving the last state queued */
+    ~Session();
+
+    Session( const Session &copy ) = delete;
+    Session & operator=( const Session &copy ) = delete;
+
+    /** Restores the state saved in the session file into \a state. Returns false if there is no valid session file */
+    bool restore( SessionState &state ) const;
+
+    /**
+     * Queues \a state to be saved and returns immediately. The samples in \a state are moved. 
+     * If a state is still waiting to be saved it's replaced, as only the last state matters.
+     */
+    void save( SessionState &state );
+
+private:
+
+    // writer thread
+    void run();
+    void write( const SessionState &state ) const;
+    // size of the file for the current settings
+    size_t getFileSize() const;
+
+    const ci::fs::path mPath;
+    const size_t mSampleRate;
+    const size_t mWaveLen;
+    const size_t mNumChunks;
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::unique_ptr<SessionState> mPendingState;
+    bool mRunning;
+
+    std::thread mThread;
+};
@@ -0,0 +1,147 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "cinder/audio/Node.h"
+#include "cinder/audio/dsp/Dsp.h"
+
+#include "DspLoadMeter.h"
+
+#include <utility>
+
+
+/**
+ * Interface of the nodes of the Collidoscope audio graph that carry a "silent" flag along with their output.
+ * The flag refers to the last block processed by the node and is only accessed from the audio thread.
+ */
+class SilenceAware
+{
+public:
+    virtual ~SilenceAware() {}
+
+    /** Returns true if the last block output by this node was silent */
+    virtual bool isSilent() const = 0;
+};
+
+
+/**
+ * Wraps a Cinder node (filter, monitor) so that it stops processing while the node upstream is silent.
+ * Only process() is skipped: this saves work for nodes that do it in process(), like the filters and the monitors, 
+ * but not for nodes that do it in sumInputs(), like ChannelRouterNode, or that do nothing in process().
+ *
+ * When the upstream node becomes silent, the wrapped node keeps processing for at least \a tailFrames frames
+ * and until its own output has decayed below kDecayThreshold ( e.g. the tail of a filter ).
+ * After that the node is silent as well, and process() only zeroes the buffer until the upstream node outputs sound again.
+ * The time spent in process() is recorded in a DspLoadMeter, if one is set.
+ *
+ * Template arguments:
+ * NodeT: the Cinder node type to wrap.
+ *
+ */
+template <typename NodeT>
+class SilenceGateNode : public NodeT, public SilenceAware
+{
+public:
+
+    /** peak value under which the output of the node is considered decayed ( -120 dB ) */
+    static constexpr float kDecayThreshold = 1e-6f;
+
+    /** Constructor, arguments are forwarded to the constructor of the wrapped node */
+    template <typename... Args>
+    explicit SilenceGateNode( Args&&... args ) :
+        NodeT( std::forward<Args>( args )... ),
+        mSource( nullptr ),
+        mTailFrames( 0 ),
+        mSilentFrames( 0 ),
+        mSilent( false ),
+        mLoadMeter( nullptr ),
+        mLoadMeterSlot( DspLoadMeter::kNoSlot )
+    {}
+
+    /** Sets the node upstream whose silent flag this node follows. Pass nullptr to never skip processing */
+    void setSilenceSource( const SilenceAware *source )
+    {
+        mSource = source;
+    }
+
+    /** Sets the minimum number of frames this node keeps processing after the upstream node became silent */
+    void setSilenceTail( size_t tailFrames )
+    {
+        mTailFrames = tailFrames;
+    }
+
+    /** Sets the meter and the slot where the time spent in process() is recorded */
+    void setDspLoadMeter( DspLoadMeter *meter, size_t slot )
+    {
+        mLoadMeter = meter;
+        mLoadMeterSlot = slot;
+    }
+
+    bool isSilent() const override
+    {
+        return mSilent;
+    }
+
+protected:
+
+    void process( ci::audio::Buffer *buffer ) override
+    {
+        DspLoadMeter::Scope loadScope( mLoadMeter, mLoadMeterSlot );
+
+        if ( mSource == nullptr || !mSource->isSilent() ){
+            mSilent = false;
+            mSilentFrames = 0;
+            NodeT::process( buffer );
+            return;
+        }
+
+        if ( mSilent ){
+            // upstream silent and tail decayed: nothing to process
+            buffer->zero();
+            return;
+        }
+
+        // upstream silent but this node is still outputting its tail
+        NodeT::process( buffer );
+        mSilentFrames += buffer->getNumFrames();
+
+        if ( mSilentFrames >= mTailFrames && ci::audio::dsp::peak( buffer->getData(), buffer->getSize() ) < kDecayThreshold ){
+            mSilent = true;
+        }
+    }
+
+private:
+
+    const SilenceAware *mSource;
+
+    size_t mTailFrames;
+    // frames processed since the upstream node became silent
+    size_t mSilentFrames;
+
+    bool mSilent;
+
+    DspLoadMeter *mLoadMeter;
+    size_t mLoadMeterSlot;
+};
+
+template <typename NodeT>
+constexpr float SilenceGateNode<NodeT>::kDecayThreshold;
@@ -0,0 +1,244 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <cmath>
+
+#if defined( __SSE__ ) || defined( _M_X64 )
+#include <xmmintrin.h>
+#define COLLIDOSCOPE_SIMD_SSE
+#if defined( __SSE2__ ) || defined( _M_X64 )
+#include <emmintrin.h>
+#define COLLIDOSCOPE_SIMD_SSE2
+#endif
+#elif defined( __ARM_NEON ) || defined( __ARM_NEON__ )
+#include <arm_neon.h>
+#define COLLIDOSCOPE_SIMD_NEON
+#endif
+
+
+/**
+ * Vectorized loops of the audio thread. Each function has an SSE version, a NEON version and a plain version
+ * for the other targets ( e.g. a Raspberry Pi build without -mfpu=neon ), chosen at compile time.
+ * Pointers need not be aligned.
+ */
+namespace simd {
+
+/**
+ * Writes src[i] * gain( i ) into dst[i] for i in [ 0, numFrames ), where gain( i ) = clamp( \a gain + i * \a gainInc, 0, 1 ),
+ * and extends \a minVal and \a maxVal with the written samples. All in one pass over the samples.
+ */
+inline void rampCopyMinMax( const float *src, float *dst, std::size_t numFrames, float gain, float gainInc, float &minVal, float &maxVal )
+{
+    std::size_t i = 0;
+
+#if defined( COLLIDOSCOPE_SIMD_SSE )
+    if ( numFrames >= 4 ){
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps( 1.0f );
+        const __m128 inc = _mm_set1_ps( gainInc );
+        const __m128 start = _mm_set1_ps( gain );
+        const __m128 four = _mm_set1_ps( 4.0f );
+        __m128 index = _mm_set_ps( 3.0f, 2.0f, 1.0f, 0.0f );
+        __m128 vmin = _mm_set1_ps( minVal );
+        __m128 vmax = _mm_set1_ps( maxVal );
+
+        for ( ; i + 4 <= numFrames; i += 4 ){
+            // the gain is computed from the index rather than accumulated, so it doesn't drift
+            const __m128 g = _mm_min_ps( one, _mm_max_ps( zero, _mm_add_ps( start, _mm_mul_ps( index, inc ) ) ) );
+            const __m128 val = _mm_mul_ps( _mm_loadu_ps( src + i ), g );
+            _mm_storeu_ps( dst + i, val );
+            vmin = _mm_min_ps( vmin, val );
+            vmax = _mm_max_ps( vmax, val );
+            index = _mm_add_ps( index, four );
+        }
+
+        float mins[4], maxs[4];
+        _mm_storeu_ps( mins, vmin );
+        _mm_storeu_ps( maxs, vmax );
+        minVal = std::min( std::min( mins[0], mins[1] ), std::min( mins[2], mins[3] ) );
+        maxVal = std::max( std::max( maxs[0], maxs[1] ), std::max( maxs[2], maxs[3] ) );
+    }
+#elif defined( COLLIDOSCOPE_SIMD_NEON )
+    if ( numFrames >= 4 ){
+        const float32x4_t zero = vdupq_n_f32( 0.0f );
+        const float32x4_t one = vdupq_n_f32( 1.0f );
+        const float32x4_t inc = vdupq_n_f32( gainInc );
+        const float32x4_t start = vdupq_n_f32( gain );
+        const float32x4_t four = vdupq_n_f32( 4.0f );
+        const float indexInit[4] = { 0.0f, 1.0f, 2.0f, 3.0f };
+        float32x4_t index = vld1q_f32( indexInit );
+        float32x4_t vmin = vdupq_n_f32( minVal );
+        float32x4_t vmax = vdupq_n_f32( maxVal );
+
+        for ( ; i + 4 <= numFrames; i += 4 ){
+            // the gain is computed from the index rather than accumulated, so it doesn't drift
+            const float32x4_t g = vminq_f32( one, vmaxq_f32( zero, vmlaq_f32( start, index, inc ) ) );
+            const float32x4_t val = vmulq_f32( vld1q_f32( src + i ), g );
+            vst1q_f32( dst + i, val );
+            vmin = vminq_f32( vmin, val );
+            vmax = vmaxq_f32( vmax, val );
+            index = vaddq_f32( index, four );
+        }
+
+        float32x2_t min2 = vpmin_f32( vget_low_f32( vmin ), vget_high_f32( vmin ) );
+        float32x2_t max2 = vpmax_f32( vget_low_f32( vmax ), vget_high_f32( vmax ) );
+        minVal = vget_lane_f32( vpmin_f32( min2, min2 ), 0 );
+        maxVal = vget_lane_f32( vpmax_f32( max2, max2 ), 0 );
+    }
+#endif
+
+    // the tail that doesn't fill a vector, or everything on targets without SIMD
+    for ( ; i < numFrames; i++ ){
+        const float g = std::min( 1.0f, std::max( 0.0f, gain + i * gainInc ) );
+        const float val = src[i] * g;
+        dst[i] = val;
+        minVal = std::min( minVal, val );
+        maxVal = std::max( maxVal, val );
+    }
+}
+
+/**
+ * Mixes src into dst in place: dst[i] = dst[i] * \a feedback + src[i] * gain( i ), where gain( i ) = clamp( \a gain + i * \a gainInc, 0, 1 )
+ * as in rampCopyMinMax(). One multiply-add per sample.
+ */
+inline void rampMix( const float *src, float *dst, std::size_t numFrames, float feedback, float gain, float gainInc )
+{
+    std::size_t i = 0;
+
+#if defined( COLLIDOSCOPE_SIMD_SSE )
+    if ( numFrames >= 4 ){
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps( 1.0f );
+        const __m128 inc = _mm_set1_ps( gainInc );
+        const __m128 start = _mm_set1_ps( gain );
+        const __m128 four = _mm_set1_ps( 4.0f );
+        const __m128 fb = _mm_set1_ps( feedback );
+        __m128 index = _mm_set_ps( 3.0f, 2.0f, 1.0f, 0.0f );
+
+        for ( ; i + 4 <= numFrames; i += 4 ){
+            const __m128 g = _mm_min_ps( one, _mm_max_ps( zero, _mm_add_ps( start, _mm_mul_ps( index, inc ) ) ) );
+            const __m128 val = _mm_add_ps( _mm_mul_ps( _mm_loadu_ps( dst + i ), fb ), _mm_mul_ps( _mm_loadu_ps( src + i ), g ) );
+            _mm_storeu_ps( dst + i, val );
+            index = _mm_add_ps( index, four );
+        }
+    }
+#elif defined( COLLIDOSCOPE_SIMD_NEON )
+    if ( numFrames >= 4 ){
+        const float32x4_t zero = vdupq_n_f32( 0.0f );
+        const float32x4_t one = vdupq_n_f32( 1.0f );
+        const float32x4_t inc = vdupq_n_f32( gainInc );
+        const float32x4_t start = vdupq_n_f32( gain );
+        const float32x4_t four = vdupq_n_f32( 4.0f );
+        const float indexInit[4] = { 0.0f, 1.0f, 2.0f, 3.0f };
+        float32x4_t index = vld1q_f32( indexInit );
+
+        for ( ; i + 4 <= numFrames; i += 4 ){
+            const float32x4_t g = vminq_f32( one, vmaxq_f32( zero, vmlaq_f32( start, index, inc ) ) );
+            const float32x4_t val = vmlaq_f32( vmulq_n_f32( vld1q_f32( dst + i ), feedback ), vld1q_f32( src + i ), g );
+            vst1q_f32( dst + i, val );
+            index = vaddq_f32( index, four );
+        }
+    }
+#endif
+
+    for ( ; i < numFrames; i++ ){
+        const float g = std::min( 1.0f, std::max( 0.0f, gain + i * gainInc ) );
+        dst[i] = dst[i] * feedback + src[i] * g;
+    }
+}
+
+/**
+ * Returns the peak level of the \a numFrames samples of \a src: the highest absolute value, or 0 if \a numFrames is 0.
+ */
+inline float peak( const float *src, std::size_t numFrames )
+{
+    std::size_t i = 0;
+    float peakVal = 0.0f;
+
+#if defined( COLLIDOSCOPE_SIMD_SSE )
+    if ( numFrames >= 4 ){
+        // clearing the sign bit gives the absolute value
+        const __m128 signMask = _mm_set1_ps( -0.0f );
+        __m128 vpeak = _mm_setzero_ps();
+
+        for ( ; i + 4 <= numFrames; i += 4 )
+            vpeak = _mm_max_ps( vpeak, _mm_andnot_ps( signMask, _mm_loadu_ps( src + i ) ) );
+
+        float peaks[4];
+        _mm_storeu_ps( peaks, vpeak );
+        peakVal = std::max( std::max( peaks[0], peaks[1] ), std::max( peaks[2], peaks[3] ) );
+    }
+#elif defined( COLLIDOSCOPE_SIMD_NEON )
+    if ( numFrames >= 4 ){
+        float32x4_t vpeak = vdupq_n_f32( 0.0f );
+
+        for ( ; i + 4 <= numFrames; i += 4 )
+            vpeak = vmaxq_f32( vpeak, vabsq_f32( vld1q_f32( src + i ) ) );
+
+        float32x2_t peak2 = vpmax_f32( vget_low_f32( vpeak ), vget_high_f32( vpeak ) );
+        peakVal = vget_lane_f32( vpmax_f32( peak2, peak2 ), 0 );
+    }
+#endif
+
+    for ( ; i < numFrames; i++ )
+        peakVal = std::max( peakVal, std::abs( src[i] ) );
+
+    return peakVal;
+}
+
+/**
+ * Writes src[i] * \a scale into dst[i], rounded to the nearest integer and clamped to the range of int16_t.
+ */
+inline void toInt16( const float *src, int16_t *dst, std::size_t numFrames, float scale )
+{
+    std::size_t i = 0;
+
+#if defined( COLLIDOSCOPE_SIMD_SSE2 )
+    const __m128 vscale = _mm_set1_ps( scale );
+    for ( ; i + 8 <= numFrames; i += 8 ){
+        // the conversion rounds to nearest, the pack saturates 
+        const __m128i lo = _mm_cvtps_epi32( _mm_mul_ps( _mm_loadu_ps( src + i ), vscale ) );
+        const __m128i hi = _mm_cvtps_epi32( _mm_mul_ps( _mm_loadu_ps( src + i + 4 ), vscale ) );
+        _mm_storeu_si128( reinterpret_cast<__m128i*>( dst + i ), _mm_packs_epi32( lo, hi ) );
+    }
+#elif defined( COLLIDOSCOPE_SIMD_NEON )
+    const float32x4_t half = vdupq_n_f32( 0.5f );
+    const uint32x4_t signMask = vdupq_n_u32( 0x80000000 );
+    for ( ; i + 4 <= numFrames; i += 4 ){
+        // the conversion truncates: adding half with the sign of the sample rounds to nearest. The narrowing saturates 
+        const float32x4_t val = vmulq_n_f32( vld1q_f32( src + i ), scale );
+        const float32x4_t signedHalf = vreinterpretq_f32_u32( vorrq_u32( vandq_u32( vreinterpretq_u32_f32( val ), signMask ), vreinterpretq_u32_f32( half ) ) );
+        vst1_s16( dst + i, vqmovn_s32( vcvtq_s32_f32( vaddq_f32( val, signedHalf ) ) ) );
+    }
+#endif
+
+    for ( ; i < numFrames; i++ ){
+        const float val = std::min( 32767.0f, std::max( -32768.0f, src[i] * scale ) );
+        dst[i] = int16_t( val < 0.0f ? val - 0.5f : val + 0.5f );
+    }
+}
+
+} // namespace simd
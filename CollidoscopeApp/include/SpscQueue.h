@@ -0,0 +1,245 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+
+/** Counters of an SpscQueue or an MpscQueue, to size it from the actual traffic */
+struct MsgQueueStats
+{
+    std::size_t capacity;
+    // messages pushed, and dropped because the queue was full. They are counted in 32 bits, as 64 bits atomics are not lock-free 
+    // on the Raspberry Pi, and wrap around: the difference of two readings is right as long as it's taken in 32 bits 
+    std::uint32_t numPushed;
+    std::uint32_t numOverflows;
+    // most messages the consumer ever found waiting. Equals the capacity if any was dropped 
+    std::size_t highWater;
+};
+
+/**
+ * Lock-free queue of messages from one producer thread to one consumer thread, e.g. from the audio thread to the graphic thread.
+ *
+ * The messages are stored in a circular array allocated once in the constructor, so neither side ever allocates. The producer 
+ * pushes copies of the messages: a push that doesn't fit is dropped whole and its messages are counted as overflows, so the 
+ * producer never waits. The consumer reads the messages in place, through at most two contiguous spans of the array, 
+ * and commits all the messages it has read at once: no copy, and one atomic store per batch.
+ *
+ * The write and read positions only grow and are masked to index the array, whose size is a power of two. Each position is 
+ * written by one side only, and sits on its own cache line along with the copy of the other position that side read last, 
+ * so the two threads touch each other's line only when the queue looks full or empty.
+ *
+ * Each side also counts what goes through the queue on its own line, without read-modify-write: the producer the messages
+ * pushed and dropped, the consumer the high-water mark of the messages waiting. getStats() reads them from any thread.
+ */
+template <typename T>
+class SpscQueue
+{
+public:
+
+    static const std::size_t kCacheLineSize = 64;
+
+    /** A contiguous run of messages, read in place */
+    struct Span
+    {
+        const T *data;
+        std::size_t size;
+
+        const T* begin() const { return data; }
+        const T* end() const { return data + size; }
+    };
+
+    /** Allocates room for at least \a capacity messages */
+    explicit SpscQueue( std::size_t capacity ) :
+        mWritePos( 0 ),
+        mCachedReadPos( 0 ),
+        mNumPushed( 0 ),
+        mNumOverflows( 0 ),
+        mReadPos( 0 ),
+        mCachedWritePos( 0 ),
+        mHighWater( 0 ),
+        mMask( roundUpToPowerOfTwo( std::max<std::size_t>( capacity, 1 ) ) - 1 ),
+        mSlots( new T[mMask + 1] )
+    {
+    }
+
+    SpscQueue( const SpscQueue &copy ) = delete;
+    SpscQueue & operator=( const SpscQueue &copy ) = delete;
+
+    /** Returns the number of messages the queue can hold */
+    std::size_t getCapacity() const { return mMask + 1; }
+
+    // --------- producer side 
+
+    /** Pushes a copy of \a msg. Returns false and counts an overflow if the queue is full */
+    bool push( const T &msg ) { return push( &msg, 1 ); }
+
+    /** Pushes copies of the \a count messages of \a msgs, all of them or none. Returns false and counts \a count overflows if they don't fit */
+    bool push( const T *msgs, std::size_t count )
+    {
+        const std::size_t writePos = mWritePos.load( std::memory_order_relaxed );
+
+        // the read position is read again only when the copy says there is no room 
+        if ( writePos + count - mCachedReadPos > getCapacity() ){
+            mCachedReadPos = mReadPos.load( std::memory_order_acquire );
+            if ( writePos + count - mCachedReadPos > getCapacity() ){
+                mNumOverflows.store( mNumOverflows.load( std::memory_order_relaxed ) + std::uint32_t( count ), std::memory_order_relaxed );
+                return false;
+            }
+        }
+
+        for ( std::size_t i = 0; i < count; i++ )
+            mSlots[( writePos + i ) & mMask] = msgs[i];
+
+        mWritePos.store( writePos + count, std::memory_order_release );
+        mNumPushed.store( mNumPushed.load( std::memory_order_relaxed ) + std::uint32_t( count ), std::memory_order_relaxed );
+        return true;
+    }
+
+    /** Returns how many messages can be pushed now. Called by the producer */
+    std::size_t getAvailableWrite()
+    {
+        mCachedReadPos = mReadPos.load( std::memory_order_acquire );
+        return getCapacity() - ( mWritePos.load( std::memory_order_relaxed ) - mCachedReadPos );
+    }
+
+    // --------- consumer side 
+
+    /** 
+     * Returns the oldest messages, up to the end of the array: call again after commitRead() to get the ones that wrapped around. 
+     * The messages stay valid until they are committed. An empty span means the queue is empty 
+     */
+    Span peek()
+    {
+        const std::size_t readPos = mReadPos.load( std::memory_order_relaxed );
+
+        // the write position is read again only when the messages known are all read 
+        if ( readPos == mCachedWritePos ){
+            mCachedWritePos = mWritePos.load( std::memory_order_acquire );
+            updateHighWater( mCachedWritePos - readPos );
+        }
+
+        const std::size_t index = readPos & mMask;
+        Span span;
+        span.data = mSlots.get() + index;
+        span.size = std::min( mCachedWritePos - readPos, getCapacity() - index );
+        return span;
+    }
+
+    /** Frees the \a count oldest messages, that were read through peek(), for the producer */
+    void commitRead( std::size_t count )
+    {
+        mReadPos.store( mReadPos.load( std::memory_order_relaxed ) + count, std::memory_order_release );
+    }
+
+    /** 
+     * Calls \a func( msg ) for each message in the queue, in place and in order, and commits them all at once. 
+     * The messages pushed meanwhile are left for the next call. Returns the number of messages consumed 
+     */
+    template <typename Func>
+    std::size_t consume( Func func )
+    {
+        const std::size_t readPos = mReadPos.load( std::memory_order_relaxed );
+        mCachedWritePos = mWritePos.load( std::memory_order_acquire );
+        const std::size_t count = mCachedWritePos - readPos;
+        updateHighWater( count );
+
+        for ( std::size_t i = 0; i < count; i++ )
+            func( static_cast<const T&>( mSlots[( readPos + i ) & mMask] ) );
+
+        if ( count > 0 )
+            mReadPos.store( readPos + count, std::memory_order_release );
+        return count;
+    }
+
+    /** Returns the number of messages waiting to be read. Called by the consumer */
+    std::size_t getAvailableRead()
+    {
+        mCachedWritePos = mWritePos.load( std::memory_order_acquire );
+        const std::size_t available = mCachedWritePos - mReadPos.load( std::memory_order_relaxed );
+        updateHighWater( available );
+        return available;
+    }
+
+    // --------- any thread 
+
+    /** Returns the number of messages dropped so far because the queue was full, modulo 2^32 */
+    std::uint32_t getNumOverflows() const { return mNumOverflows.load( std::memory_order_relaxed ); }
+
+    /** Returns the counters of the queue. The counters of each side are consistent, not the two sides with each other */
+    MsgQueueStats getStats() const
+    {
+        MsgQueueStats stats;
+        stats.capacity = getCapacity();
+        stats.numPushed = mNumPushed.load( std::memory_order_relaxed );
+        stats.numOverflows = mNumOverflows.load( std::memory_order_relaxed );
+        stats.highWater = stats.numOverflows > 0 ? stats.capacity : mHighWater.load( std::memory_order_relaxed );
+        return stats;
+    }
+
+private:
+
+    void updateHighWater( std::size_t available )
+    {
+        if ( available > mHighWater.load( std::memory_order_relaxed ) )
+            mHighWater.store( available, std::memory_order_relaxed );
+    }
+
+    static std::size_t roundUpToPowerOfTwo( std::size_t n )
+    {
+        std::size_t size = 1;
+        while ( size < n )
+            size <<= 1;
+        return size;
+    }
+
+    // the queues live in nodes allocated with new, that doesn't honour alignas beyond the alignment of max_align_t in C++11: 
+    // a whole cache line of padding around each side keeps them on lines of their own wherever the queue is 
+    char mPadStart[kCacheLineSize];
+
+    // written by the producer 
+    std::atomic<std::size_t> mWritePos;
+    std::size_t mCachedReadPos;
+    std::atomic<std::uint32_t> mNumPushed;
+    std::atomic<std::uint32_t> mNumOverflows;
+    static_assert( ATOMIC_INT_LOCK_FREE == 2, "the counters are updated by the audio thread on each push: they must be lock-free" );
+
+    char mPadProducer[kCacheLineSize];
+
+    // written by the consumer 
+    std::atomic<std::size_t> mReadPos;
+    std::size_t mCachedWritePos;
+    std::atomic<std::size_t> mHighWater;
+
+    char mPadConsumer[kCacheLineSize];
+
+    // only read after construction 
+    const std::size_t mMask;
+    const std::unique_ptr<T[]> mSlots;
+};
+
+template <typename T>
+const std::size_t SpscQueue<T>::kCacheLineSize;
@@ -0,0 +1,45 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <algorithm>
+
+
+/**
+ * Number of frames the Collidoscope nodes process at a time, whatever the number of frames per block of the audio context.
+ * Control data ( selection, grain duration, notes, recording start ) is read between two sub-blocks, so its time resolution
+ * and the working set of the nodes stay the same for any jack period size.
+ */
+const std::size_t kSubBlockFrames = 64;
+
+/**
+ * Splits a block of \a numFrames frames in sub-blocks of kSubBlockFrames frames ( the last one can be shorter )
+ * and calls \a func( offset, subBlockFrames ) for each of them, in order.
+ */
+template <typename Func>
+inline void forEachSubBlock( std::size_t numFrames, Func func )
+{
+    for ( std::size_t offset = 0; offset < numFrames; offset += kSubBlockFrames ){
+        func( offset, std::min( kSubBlockFrames, numFrames - offset ) );
+    }
+}
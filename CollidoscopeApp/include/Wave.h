@@ -30,6 +30,7 @@
 
 #include "Chunk.h"
 #include "DrawInfo.h"
+#include "PeakPyramid.h"
 
 #ifdef USE_PARTICLES
 #include "ParticleController.h"
@@ -173,6 +174,11 @@ public:
 
     const Chunk & getChunk(size_t index);
 
+    /** Sets the chunks from the summary of the wave being recorded. Only the chunks that have been completely recorded 
+     *  since the last reset are set, each chunk spanning an equal share of the wave whatever the number of chunks of this wave.
+     */
+    void setChunks( const PeakPyramid &peaks );
+
     /** Places the cursor on the wave. Every cursor is associated to a synth voice of the audio engine. 
      *  The synth id identifies uniquely the cursor in the internal map of the wave.
      *  If the cursor doesn't exist it is created */
@@ -237,6 +243,9 @@ private:
     const size_t mNumChunks;
 
     std::vector<Chunk> mChunks;
+
+    // number of chunks set by setChunks() since the last reset 
+    size_t mNumChunksSet;
     
     Selection mSelection;
 
@@ -0,0 +1,97 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include "BufferToWaveRecorderNode.h"
+#include "PGranularNode.h"
+#include "WaveIndex.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+/**
+ * Builds the WaveIndex of each new wave, in a background thread.
+ *
+ * The analyzer checks the recorders every now and then. When a recorder publishes a new wave, recorded or loaded,
+ * the analyzer finds its zero crossings and its onsets, and publishes the index to the PGranularNode that plays the wave.
+ * The onsets are the peaks of the spectral flux: the sum of the increases in magnitude of each frequency bin from one FFT frame to the next.
+ *
+ * The indexes replaced are freed by the analyzer thread, a while after the PGranularNode stopped reading them.
+ *
+ * Paged waves ( see PagedWave ) and the delay line of the live mode are not indexed: the grains of a long loaded sample 
+ * are never snapped, whatever the snap mode. The analysis needs the whole wave in memory, and unrolling a paged wave 
+ * would bring all the pages of the file in, while the delay line changes all the time.
+ */
+class WaveAnalyzer
+{
+public:
+
+    /** Creates the analyzer for waves at \a sampleRate and starts the analyzer thread */
+    explicit WaveAnalyzer( size_t sampleRate );
+
+    /** Stops the analyzer thread */
+    ~WaveAnalyzer();
+
+    WaveAnalyzer( const WaveAnalyzer &copy ) = delete;
+    WaveAnalyzer & operator=( const WaveAnalyzer &copy ) = delete;
+
+    /** Analyzes the waves published by \a recorder and publishes their indexes to \a granular */
+    void addWave( const BufferToWaveRecorderNodeRef &recorder, const PGranularNodeRef &granular );
+
+private:
+
+    struct Wave
+    {
+        BufferToWaveRecorderNodeRef recorder;
+        PGranularNodeRef granular;
+        // count of the waves published by the recorder when the last wave was analyzed
+        uint32_t numPublishedWaves;
+    };
+
+    // analyzer thread
+    void run();
+    // builds the index of the wave in grainBuffer
+    WaveIndex* analyze( const GrainBuffer &grainBuffer ) const;
+    void findZeroCrossings( const std::vector<float> &wave, std::vector<uint32_t> &zeroCrossings ) const;
+    void findOnsets( const std::vector<float> &wave, std::vector<uint32_t> &onsets ) const;
+    // frees the indexes replaced long enough ago
+    void collectRetiredIndexes();
+
+    const size_t mSampleRate;
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::vector<Wave> mWaves;
+    bool mRunning;
+
+    // only touched by the analyzer thread
+    std::vector<std::pair<const WaveIndex*, std::chrono::steady_clock::time_point>> mRetiredIndexes;
+
+    std::thread mThread;
+};
@@ -0,0 +1,56 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include "GrainBuffer.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+/**
+ * Points of interest of a recorded wave, that the grains can start on: the zero crossings and the onsets of the wave.
+ *
+ * The positions are in wave order ( 0 is the first sample of the wave, whatever the offset of the GrainBuffer )
+ * and sorted, so that the point nearest to any position is found with a binary search ( see PGranular::setSnapPoints() ).
+ * The index is built by the WaveAnalyzer in a background thread and belongs to the wave in \a grainBuffer only.
+ */
+struct WaveIndex
+{
+    /** The wave the index was built for */
+    GrainBuffer grainBuffer;
+
+    /** Positions where the wave goes from negative to non negative or vice versa */
+    std::vector<uint32_t> zeroCrossings;
+
+    /** Positions of the onsets ( the attacks of the sounds ) of the wave */
+    std::vector<uint32_t> onsets;
+};
+
+/**
+ * The WaveIndex of the wave currently published, or nullptr if the wave has not been analyzed yet.
+ */
+typedef std::atomic<const WaveIndex*> AtomicWaveIndex;
+
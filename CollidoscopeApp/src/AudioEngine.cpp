@@ -25,8 +25,20 @@
 #include "cinder/app/App.h"
 #include "Log.h"
 
+#include <algorithm>
+#include <sstream>
+
+#if defined( CINDER_LINUX )
+#include "cinder/audio/linux/ContextJack.h"
+#endif
+
 using namespace ci::audio;
 
+constexpr float GatedFilterLowPassNode::kNoCutoff;
+
+/* number of blocks the monitor nodes keep processing after the sound stops, so that the oscilloscopes go flat */
+const size_t kMonitorSilenceTailBlocks = 4;
+
 /* Frequency ratios in the chromatic scale */
 double chromaticRatios[] = { 
     1, 
@@ -71,7 +83,8 @@ inline double calculateMidiNoteRatio( int midiNote )
 }
 
 
-AudioEngine::AudioEngine() 
+AudioEngine::AudioEngine() :
+    mContext( nullptr )
 {}
 
 AudioEngine::~AudioEngine()
@@ -79,16 +92,35 @@ AudioEngine::~AudioEngine()
 
 void AudioEngine::setup(const Config& config)
 {
-    
-    for ( int i = 0; i < NUM_WAVES; i++ ){
-        mCursorTriggerRingBufferPacks[i].reset( new RingBufferPack<CursorTriggerMsg>( 512 ) ); // FIXME 
-    }
-
     /* audio context */
     auto ctx = Context::master();
 
     /* audio input device */
     auto inputDeviceNode = ctx->createInputDeviceNode( Device::getDefaultInput() );
+
+    setup( config, ctx, inputDeviceNode );
+}
+
+void AudioEngine::setup( const Config& config, Context *ctx, const InputNodeRef &inputDeviceNode )
+{
+    
+    for ( int i = 0; i < NUM_WAVES; i++ ){
+        mCursorTriggerQueues[i].reset( new CursorTriggerMsgQueue( config.getCursorTriggerMessageBufSize() ) );
+    }
+    mNumChunks = config.getNumChunks();
+
+    mContext = ctx;
+    const GrainStorage grainStorage = config.getGrainStorage() == "int16" ? GrainStorage::eInt16 : GrainStorage::eFloat;
+    mSampleLoader.reset( new SampleLoader( ctx->getSampleRate(), size_t( config.getWaveLen() * ctx->getSampleRate() ), grainStorage, 
+        size_t( config.getMaxSampleLen() * ctx->getSampleRate() ) ) );
+    mWaveAnalyzer.reset( new WaveAnalyzer( ctx->getSampleRate() ) );
+    mPagePrefetcher.reset( new PagePrefetcher );
+
+    /* each wave gets its share of the memory for the history: as many slots as fit, one of them being the back buffer */
+    const size_t slotSize = BufferToWaveRecorderNode::getSlotSize( size_t( config.getWaveLen() * ctx->getSampleRate() ), grainStorage );
+    /* the crossfade to a new wave, and the capture modes that write the slot dropped right away, need a third slot not to click */
+    const size_t minSlots = config.getGrainBufferCrossfadeTime() > 0.0 || config.getCaptureMode() != "off" ? 3 : 2;
+    const size_t numSlots = std::max<size_t>( minSlots, size_t( config.getHistoryMemory() * 1024 * 1024 / NUM_WAVES ) / slotSize );
  
 
     /* route the audio input, which is two channels, to one wave graph for each channel */
@@ -98,9 +130,36 @@ void AudioEngine::setup(const Config& config)
         mInputRouterNodes[chan] = ctx->makeNode( new ChannelRouterNode( Node::Format().channels( 1 ) ) );
 
         /* buffer recorders */  
-        mBufferRecorderNodes[chan] = ctx->makeNode( new BufferToWaveRecorderNode( config.getNumChunks(), config.getWaveLen() ) );
-        /* this prevents the node from recording before record is pressed */
+        mBufferRecorderNodes[chan] = ctx->makeNode( new BufferToWaveRecorderNode( config.getNumChunks(), config.getWaveLen(), config.getMinWaveLen(), numSlots ) );
+        /* enabled below, whatever the connections */
         mBufferRecorderNodes[chan]->setAutoEnabled( false );
+        /* with a threshold, the recording starts when the input gets loud enough */
+        mBufferRecorderNodes[chan]->setRecordThreshold( config.getRecordThreshold() );
+        mBufferRecorderNodes[chan]->setOverdubFeedback( config.getOverdubFeedback() );
+        mBufferRecorderNodes[chan]->setGrainStorage( grainStorage );
+        /* a slot dropped from the history is written again only once the grains have crossfaded out of it */
+        mBufferRecorderNodes[chan]->setSlotReleaseTime( config.getGrainBufferCrossfadeTime() );
+        /* in capture mode the node records all the time and record commits what was captured */
+        if ( config.getCaptureMode() == "last" || config.getCaptureMode() == "next" ){
+            mBufferRecorderNodes[chan]->setCaptureMode( config.getCaptureMode() == "last" ? 
+                BufferToWaveRecorderNode::CaptureMode::eLast : BufferToWaveRecorderNode::CaptureMode::eNext );
+        }
+        /* in live mode the node writes the input all the time in a delay line, that the grains read */
+        else if ( config.getCaptureMode() == "live" ){
+            mBufferRecorderNodes[chan]->setCaptureMode( BufferToWaveRecorderNode::CaptureMode::eLive );
+        }
+        /* the node runs all the time, and records nothing until record is pressed: the commands from the graphic thread 
+           and the MIDI threads are applied by the audio thread alone, that never waits for the node to be enabled */
+        mBufferRecorderNodes[chan]->enable();
+        /* archive the recorded waves, streaming them to disk from a background thread */
+        if ( !config.getRecordingsDirectory().empty() ){
+            mBufferRecorderNodes[chan]->setDiskWriter( std::make_shared<DiskWriter>( 
+                config.getRecordingsDirectory(), 
+                "wave" + std::to_string( chan ), 
+                config.getRecordingsFileExtension(), 
+                ctx->getSampleRate(), 
+                size_t( config.getRecordingsBufferSeconds() * ctx->getSampleRate() ) ) );
+        }
 
         // route the input part of the audio graph. Two channels input goes into one channel route
         // and from one channel route to one channel buffer recorder 
@@ -109,14 +168,25 @@ void AudioEngine::setup(const Config& config)
 
         // create PGranular loops passing the buffer of the RecorderNode as argument to the contructor 
         // use -1 as ID as the loop corresponds to no midi note 
-        mPGranularNodes[chan] = ctx->makeNode( new PGranularNode( mBufferRecorderNodes[chan]->getRecorderBuffer(), mCursorTriggerRingBufferPacks[chan]->getBuffer() ) );
+        mPGranularNodes[chan] = ctx->makeNode( new PGranularNode( mBufferRecorderNodes[chan]->getGrainBuffer(), *mCursorTriggerQueues[chan], config.getNumChunks(), config.getNoteMessageBufSize() ) );
+        mPGranularNodes[chan]->setGrainBufferCrossfadeTime( config.getGrainBufferCrossfadeTime() );
+        mPGranularNodes[chan]->setLiveDelayTime( config.getLiveDelay() );
+        if ( config.getGrainSnapMode() == "zero" )
+            mPGranularNodes[chan]->setSnapMode( PGranularNode::SnapMode::eZeroCrossings );
+        else if ( config.getGrainSnapMode() == "onset" )
+            mPGranularNodes[chan]->setSnapMode( PGranularNode::SnapMode::eOnsets );
+
+        /* index the zero crossings and the onsets of each new wave, in a background thread */
+        mWaveAnalyzer->addWave( mBufferRecorderNodes[chan], mPGranularNodes[chan] );
+        /* keep the pages of a long wave the grains are about to read in memory */
+        mPagePrefetcher->addWave( mBufferRecorderNodes[chan], mPGranularNodes[chan] );
 
         // create filter nodes 
-        mLowPassFilterNodes[chan] = ctx->makeNode( new FilterLowPassNode( MonitorNode::Format().channels( 1 ) ) );
-        mLowPassFilterNodes[chan]->setCutoffFreq( config.getMaxFilterCutoffFreq() );
+        mLowPassFilterNodes[chan] = ctx->makeNode( new GatedFilterLowPassNode( MonitorNode::Format().channels( 1 ) ) );
+        mLowPassFilterNodes[chan]->setCutoffFreq( config.getMaxFilterCutoffFreq( ctx->getSampleRate() ) );
         mLowPassFilterNodes[chan]->setQ( 0.707f );
         // create monitor nodes for oscilloscopes 
-        mOutputMonitorNodes[chan] = ctx->makeNode( new MonitorNode( MonitorNode::Format().channels( 1 ) ) );
+        mOutputMonitorNodes[chan] = ctx->makeNode( new GatedMonitorNode( MonitorNode::Format().channels( 1 ) ) );
 
         // all output goes to the filter 
         mPGranularNodes[chan] >> mLowPassFilterNodes[chan];
@@ -129,7 +199,32 @@ void AudioEngine::setup(const Config& config)
         // what goes to output goes to oscilloscope as well
         mLowPassFilterNodes[chan] >> mOutputMonitorNodes[chan];
 
+        // silence propagates down the graph: when the PGranulars are idle, the filter stops after its tail 
+        // decays and the monitor after the filter stops as well 
+        mLowPassFilterNodes[chan]->setSilenceSource( mPGranularNodes[chan].get() );
+        mOutputMonitorNodes[chan]->setSilenceSource( mLowPassFilterNodes[chan].get() );
+        // the monitor has to process some silence before stopping, so that the oscilloscope does not freeze on the last sound 
+        mOutputMonitorNodes[chan]->setSilenceTail( kMonitorSilenceTailBlocks * ctx->getFramesPerBlock() );
+
+        // time spent in each node goes in the load meter 
+        const std::string waveName = "w" + std::to_string( chan ) + ".";
+        mBufferRecorderNodes[chan]->setDspLoadMeter( &mDspLoadMeter, mDspLoadMeter.addSlot( waveName + "recorder" ) );
+        mPGranularNodes[chan]->setDspLoadMeter( &mDspLoadMeter, mDspLoadMeter.addSlot( waveName + "granular" ) );
+        mPGranularNodes[chan]->setLatencyTracer( &mLatencyTracer );
+        mLowPassFilterNodes[chan]->setDspLoadMeter( &mDspLoadMeter, mDspLoadMeter.addSlot( waveName + "filter" ) );
+        mOutputMonitorNodes[chan]->setDspLoadMeter( &mDspLoadMeter, mDspLoadMeter.addSlot( waveName + "monitor" ) );
+    }
+
+    // the whole audio callback, as measured by the jack context 
+    mDspLoadMeter.setBlockBudget( ctx->getFramesPerBlock(), ctx->getSampleRate() );
+#if defined( CINDER_LINUX )
+    auto jackCtx = dynamic_cast<linux::ContextJack*>( ctx );
+    if ( jackCtx != nullptr ){
+        const size_t callbackSlot = mDspLoadMeter.addSlot( "callback" );
+        DspLoadMeter *meter = &mDspLoadMeter;
+        jackCtx->setProcessTimeCallback( [meter, callbackSlot]( uint64_t nanos ) { meter->record( callbackSlot, nanos ); } );
     }
+#endif
 
     ctx->getOutput()->enableClipDetection( false );
     /* enable the whole audio graph */
@@ -139,51 +234,134 @@ void AudioEngine::setup(const Config& config)
 
 size_t AudioEngine::getSampleRate()
 {
-    return Context::master()->getSampleRate();
+    return mContext->getSampleRate();
 }
 
-void AudioEngine::loopOn( size_t waveIdx )
+void AudioEngine::loopOn( size_t waveIdx, uint64_t inputTime )
 {
     NoteMsg msg = makeNoteMsg( Command::LOOP_ON, 1, 1.0 );
-    mPGranularNodes[waveIdx]->getNoteRingBuffer().write( &msg, 1 );
+    pushNoteMsg( waveIdx, msg, inputTime );
 }
 
-void AudioEngine::loopOff( size_t waveIdx )
+void AudioEngine::loopOff( size_t waveIdx, uint64_t inputTime )
 {
     NoteMsg msg = makeNoteMsg( Command::LOOP_OFF, 0, 0.0 );
-    mPGranularNodes[waveIdx]->getNoteRingBuffer().write( &msg, 1 );
+    pushNoteMsg( waveIdx, msg, inputTime );
 }
 
-void AudioEngine::record( size_t waveIdx )
+bool AudioEngine::record( size_t waveIdx )
 {
-    mBufferRecorderNodes[waveIdx]->start();
+    return record( waveIdx, mBufferRecorderNodes[waveIdx]->getCommandFrame() );
 }
 
-void AudioEngine::noteOn( size_t waveIdx, int midiNote )
+bool AudioEngine::record( size_t waveIdx, uint64_t frame )
+{
+    return mBufferRecorderNodes[waveIdx]->start( frame );
+}
+
+bool AudioEngine::finishRecord( size_t waveIdx )
+{
+    return finishRecord( waveIdx, mBufferRecorderNodes[waveIdx]->getCommandFrame() );
+}
+
+bool AudioEngine::finishRecord( size_t waveIdx, uint64_t frame )
+{
+    return mBufferRecorderNodes[waveIdx]->finish( frame );
+}
+
+void AudioEngine::overdub( size_t waveIdx )
+{
+    mBufferRecorderNodes[waveIdx]->overdub();
+}
+
+void AudioEngine::undo( size_t waveIdx )
+{
+    mBufferRecorderNodes[waveIdx]->undo();
+}
+
+void AudioEngine::redo( size_t waveIdx )
+{
+    mBufferRecorderNodes[waveIdx]->redo();
+}
+
+void AudioEngine::noteOn( size_t waveIdx, int midiNote, uint64_t inputTime )
 {
     
     double midiAsRate = calculateMidiNoteRatio(midiNote);
     NoteMsg msg = makeNoteMsg( Command::NOTE_ON, midiNote, midiAsRate );
 
-    mPGranularNodes[waveIdx]->getNoteRingBuffer().write( &msg, 1 );
+    pushNoteMsg( waveIdx, msg, inputTime );
 }
 
-void AudioEngine::noteOff( size_t waveIdx, int midiNote )
+void AudioEngine::noteOff( size_t waveIdx, int midiNote, uint64_t inputTime )
 {
     NoteMsg msg = makeNoteMsg( Command::NOTE_OFF, midiNote, 0.0 );
-    mPGranularNodes[waveIdx]->getNoteRingBuffer().write( &msg, 1 );
+    pushNoteMsg( waveIdx, msg, inputTime );
 }
 
+void AudioEngine::pushNoteMsg( size_t waveIdx, NoteMsg &msg, uint64_t inputTime )
+{
+    // the audio thread records the next hops from these stamps 
+    msg.inputTime = inputTime;
+    msg.dispatchTime = DspLoadMeter::now();
+    mLatencyTracer.recordSince( LatencyTracer::Hop::eInputToDispatch, inputTime, msg.dispatchTime );
+
+    mPGranularNodes[waveIdx]->getNoteQueue().push( msg );
+}
 
 
-void AudioEngine::setSelectionSize( size_t waveIdx, size_t size )
+
+template <typename Change>
+void AudioEngine::changeSelection( size_t waveIdx, Change change )
 {
-    mPGranularNodes[waveIdx]->setSelectionSize( size );
+    // the selection of the node is the only copy: the audio thread plays the start and size one thread set, and nothing else 
+    PGranularNode &node = *mPGranularNodes[waveIdx];
+    uint32_t selection = node.getSelection();
+    size_t start;
+    size_t size;
+
+    do {
+        start = PGranularNode::selectionStartOf( selection );
+        size = PGranularNode::selectionSizeOf( selection );
+        change( start, size );
+    } while ( !node.compareExchangeSelection( selection, PGranularNode::packSelection( start, size ) ) );
 }
 
-void AudioEngine::setSelectionStart( size_t waveIdx, size_t start )
+void AudioEngine::setSelectionSize( size_t waveIdx, size_t numChunks )
 {
-    mPGranularNodes[waveIdx]->setSelectionStart( start );
+    changeSelection( waveIdx, [numChunks]( size_t &start, size_t &size ) { size = numChunks; } );
+}
+
+void AudioEngine::setSelectionStart( size_t waveIdx, size_t startChunk )
+{
+    changeSelection( waveIdx, [startChunk]( size_t &start, size_t &size ) { start = startChunk; } );
+}
+
+void AudioEngine::moveSelection( size_t waveIdx, size_t startChunk )
+{
+    if ( startChunk >= mNumChunks )
+        return;
+
+    const size_t numChunks = mNumChunks;
+    changeSelection( waveIdx, [startChunk, numChunks]( size_t &start, size_t &size ) {
+        start = startChunk;
+        size = std::min( std::max<size_t>( size, 1 ), numChunks - start );
+    } );
+}
+
+void AudioEngine::resizeSelection( size_t waveIdx, size_t numChunks )
+{
+    const size_t maxChunks = mNumChunks;
+    changeSelection( waveIdx, [numChunks, maxChunks]( size_t &start, size_t &size ) {
+        size = std::min( numChunks, maxChunks - start );
+    } );
+}
+
+void AudioEngine::getSelection( size_t waveIdx, size_t &startChunk, size_t &numChunks ) const
+{
+    const uint32_t selection = mPGranularNodes[waveIdx]->getSelection();
+    startChunk = PGranularNode::selectionStartOf( selection );
+    numChunks = PGranularNode::selectionSizeOf( selection );
 }
 
 void AudioEngine::setGrainDurationCoeff( size_t waveIdx, double coeff )
@@ -193,37 +371,100 @@ void AudioEngine::setGrainDurationCoeff( size_t waveIdx, double coeff )
 
 void AudioEngine::setFilterCutoff( size_t waveIdx, double cutoff )
 {
-    mLowPassFilterNodes[waveIdx]->setCutoffFreq( cutoff );
+    mLowPassFilterNodes[waveIdx]->setCutoffFreqAsync( float( cutoff ) );
 }
 
 // ------------------------------------------------------
 // ----- methods for communication with main thread -----
 // ------------------------------------------------------
 
-size_t AudioEngine::getRecordWaveAvailable( size_t waveIdx )
+RecordWaveMsgQueue& AudioEngine::getRecordWaveQueue( size_t waveIdx )
 {
-    return mBufferRecorderNodes[waveIdx]->getRingBuffer().getAvailableRead();
+    return mBufferRecorderNodes[waveIdx]->getRecordWaveQueue();
 }
 
- 
-bool AudioEngine::readRecordWave( size_t waveIdx, RecordWaveMsg* buffer, size_t count )
+void AudioEngine::loadSample( size_t waveIdx, const ci::fs::path &path )
 {
-    return mBufferRecorderNodes[waveIdx]->getRingBuffer().read( buffer, count );
+    // the recorder, always enabled, publishes the loaded wave from process() 
+    mSampleLoader->load( mBufferRecorderNodes[waveIdx], path );
 }
 
-void AudioEngine::checkCursorTriggers( size_t waveIdx, std::vector<CursorTriggerMsg>& cursorTriggers )
+void AudioEngine::restoreWave( size_t waveIdx, const float *samples, size_t numFrames, const std::shared_ptr<const void> &owner )
 {
-    ci::audio::dsp::RingBufferT<CursorTriggerMsg> &ringBuffer = mCursorTriggerRingBufferPacks[waveIdx]->getBuffer();
-    CursorTriggerMsg* ringBufferReadArray = mCursorTriggerRingBufferPacks[waveIdx]->getExchangeArray();
+    mSampleLoader->load( mBufferRecorderNodes[waveIdx], samples, numFrames, owner );
+}
 
-    size_t availableRead = ringBuffer.getAvailableRead();
-    bool successfulRead = ringBuffer.read( ringBufferReadArray, availableRead );
+void AudioEngine::copyWave( size_t waveIdx, std::vector<float> &samples ) const
+{
+    samples.clear();
 
-    if ( successfulRead ){
-        for ( size_t i = 0; i < availableRead; i++ ){
-            cursorTriggers.push_back( ringBufferReadArray[i] );
-        }
+    const GrainBuffer *grainBuffer = mBufferRecorderNodes[waveIdx]->getGrainBuffer().load( std::memory_order_acquire );
+    if ( grainBuffer == nullptr || grainBuffer->data == nullptr || grainBuffer->numFrames == 0 )
+        return;
+
+    // a long wave is still in its sample file, and reading it all would bring all its pages in memory 
+    if ( grainBuffer->paged != nullptr )
+        return;
+
+    // the delay line of the live mode is being written: it's not a wave to keep 
+    if ( grainBuffer->live != nullptr )
+        return;
+
+    // unroll the circular buffer, so that the wave starts at index 0 
+    const float *data = grainBuffer->data;
+    samples.reserve( grainBuffer->numFrames );
+    samples.insert( samples.end(), data + grainBuffer->offset, data + grainBuffer->numFrames );
+    samples.insert( samples.end(), data, data + grainBuffer->offset );
+}
+
+size_t AudioEngine::getNumPageMisses( size_t waveIdx ) const
+{
+    return mPGranularNodes[waveIdx]->getNumPageMisses();
+}
+
+const PeakPyramid& AudioEngine::getPeakPyramid( size_t waveIdx ) const
+{
+    return mBufferRecorderNodes[waveIdx]->getPeakPyramid();
+}
+
+CursorTriggerMsgQueue& AudioEngine::getCursorTriggerQueue( size_t waveIdx )
+{
+    return *mCursorTriggerQueues[waveIdx];
+}
+
+MsgQueueStats AudioEngine::getRecordMsgStats( size_t waveIdx ) const
+{
+    return mBufferRecorderNodes[waveIdx]->getRecordMsgStats();
+}
+
+void AudioEngine::getQueueStats( std::vector<QueueStats> &stats ) const
+{
+    stats.clear();
+
+    for ( size_t i = 0; i < NUM_WAVES; i++ ){
+        const std::string waveName = "w" + std::to_string( i ) + ".";
+
+        stats.push_back( { waveName + "chunks", mBufferRecorderNodes[i]->getRecordWaveQueue().getStats() } );
+        stats.push_back( { waveName + "records", mBufferRecorderNodes[i]->getRecordMsgStats() } );
+        stats.push_back( { waveName + "retired", mBufferRecorderNodes[i]->getRetiredWaveStats() } );
+        stats.push_back( { waveName + "triggers", mCursorTriggerQueues[i]->getStats() } );
+        stats.push_back( { waveName + "notes", mPGranularNodes[i]->getNoteQueue().getStats() } );
+    }
+}
+
+std::string AudioEngine::queueStatsToString() const
+{
+    std::vector<QueueStats> stats;
+    getQueueStats( stats );
+
+    std::ostringstream ss;
+    ss << "queues (pushed/dropped modulo 2^32, high-water/capacity):";
+
+    for ( const auto &s : stats ){
+        ss << " " << s.name << " " << s.stats.numPushed << "/" << s.stats.numOverflows << " " << s.stats.highWater << "/" << s.stats.capacity;
     }
+
+    return ss.str();
 }
 
 const ci::audio::Buffer& AudioEngine::getAudioOutputBuffer( size_t waveIdx ) const
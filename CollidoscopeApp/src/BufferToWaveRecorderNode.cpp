@@ -44,9 +44,11 @@
 */
 
 #include "BufferToWaveRecorderNode.h"
+#include "Simd.h"
 #include "cinder/audio/Context.h"
-#include "cinder/audio/Target.h"
 #include <cmath>
+#include <cstring>
+#include <limits>
 
 
 // ----------------------------------------------------------------------------------------------------
@@ -57,149 +59,268 @@ namespace {
     
 const size_t DEFAULT_RECORD_BUFFER_FRAMES = 44100;
 
-void resizeBufferAndShuffleChannels(ci::audio::BufferDynamic *buffer, size_t resultNumFrames)
-{
-    const size_t currentNumFrames = buffer->getNumFrames();
-    const size_t sampleSize = sizeof(ci::audio::BufferDynamic::SampleType);
+// input kept before the record threshold is reached, in seconds. Longer than the fade in, so that the attack is not faded 
+const double kPreRollSeconds = 0.1;
 
-    if (currentNumFrames < resultNumFrames) {
-        // if expanding, resize and then shuffle. Make sure to get the data pointer after the resize.
-        buffer->setNumFrames(resultNumFrames);
-        float *data = buffer->getData();
+// value of the frame epoch before the first block is processed 
+const int32_t kNoEpoch = std::numeric_limits<int32_t>::min();
 
-        for (size_t ch = 1; ch < buffer->getNumChannels(); ch++) {
-            const size_t numZeroFrames = resultNumFrames - currentNumFrames;
-            const float *currentChannel = &data[ch * currentNumFrames];
-            float *resultChannel = &data[ch * resultNumFrames];
+// frames of the wave copied at each sub-block when an overdub begins: the copy stays well ahead of the overdub, 
+// and a wave of a few seconds is copied in a fraction of a second 
+const size_t kOverdubCopyFrames = 16 * kSubBlockFrames;
 
-            memmove(resultChannel, currentChannel, currentNumFrames * sampleSize);
-            memset(resultChannel - numZeroFrames, 0, numZeroFrames * sampleSize);
-        }
-    }
-    else if (currentNumFrames > resultNumFrames) {
-        // if shrinking, shuffle first and then resize.
-        float *data = buffer->getData();
+// frames of the capture buffer silenced, and of a captured wave written to disk, at each sub-block. A commit waits for both 
+const size_t kCaptureStepFrames = 16 * kSubBlockFrames;
 
-        for (size_t ch = 1; ch < buffer->getNumChannels(); ch++) {
-            const float *currentChannel = &data[ch * currentNumFrames];
-            float *resultChannel = &data[ch * resultNumFrames];
-
-            memmove(resultChannel, currentChannel, currentNumFrames * sampleSize);
-        }
-
-        const size_t numZeroFrames = (currentNumFrames - resultNumFrames) * buffer->getNumChannels();
-        memset(data + buffer->getSize() - numZeroFrames, 0, numZeroFrames * sampleSize);
-
-        buffer->setNumFrames(resultNumFrames);
-    }
 }
 
-}
 
-
-BufferToWaveRecorderNode::BufferToWaveRecorderNode( std::size_t numChunks, double numSeconds )
+BufferToWaveRecorderNode::BufferToWaveRecorderNode( std::size_t numChunks, double numSeconds, double minNumSeconds, std::size_t numSlots )
     : SampleRecorderNode( Format().channels( 1 ) ),
+    mBuffers( std::max<size_t>( numSlots, 2 ) ),
+    mRecorderBuffer( &mBuffers[0] ),
+    mBackBuffer( &mBuffers[1] ),
+    mGrainStorage( GrainStorage::eFloat ),
+    mCompactBuffers( mBuffers.size() ),
+    mGrainBuffers( mBuffers.size() ),
+    mPublishedGrainBuffer( &mGrainBuffers[0] ),
+    mNumPublishedWaves( 0 ),
+    mCaptureMode( CaptureMode::eOff ),
+    mCommitRequested( false ),
+    mCapturePos( 0 ),
+    mCapturedFrames( 0 ),
+    mClearedFrames( 0 ),
+    mArchiveData( nullptr ),
+    mArchiveOffset( 0 ),
+    mArchivePos( 0 ),
+    mArchiveLen( 0 ),
+    mCommitCountdown( 0 ),
+    mLiveOffset( 0 ),
+    mLiveScrollFrames( 0 ),
+    mChunkBatch( numChunks + 1 ),
+    mResendChunks( false ),
     mLastOverrun( 0 ),
+    // room for two batches of the WAVE_START message and all the chunks, that are sent at once when a wave is committed, 
+    // loaded or undone: two of them within one frame of the graphic thread are both drawn 
+    mRecordWaveQueue( 2 * ( numChunks + 1 ) ),
+    mRecordMsgs( kMaxRecordMsgs ),
+    mEpochReference( int64_t( DspLoadMeter::now() ) ),
+    mFrameEpoch( kNoEpoch ),
+    mPeakPyramids( mBuffers.size() ),
+    mPublishedPeakPyramid( &mPeakPyramids[0] ),
+    mHistory( mBuffers.size() - 1 ),
+    mHistoryStart( 0 ),
+    mHistoryLen( 0 ),
+    mHistoryPos( 0 ),
+    mReleasedSlots(),
+    mSlotReleaseTime( 0.0 ),
+    mSlotReleaseFrames( 0 ),
+    mHistorySteps( 0 ),
+    mPendingWave( nullptr ),
+    mLoadedWave( nullptr ),
+    mRetiredWaves( kMaxRetiredWaves ),
+    mHeldWaves(),
     mNumChunks( numChunks ),
     mNumSeconds( numSeconds ),
-    mRingBuffer( numChunks ),
+    mMinNumSeconds( minNumSeconds ),
+    mFinishRequested( false ),
+    mRecordLen( 0 ),
+    mMinRecordLen( 0 ),
+    mChunkIndex( 0 ),
     mChunkMaxAudioVal( kMinAudioVal ),
     mChunkMinAudioVal( kMaxAudioVal ),
-    mChunkSampleCounter( 0 ),
-    mChunkIndex( 0 )
+    mArmed( false ),
+    mRecordThreshold( 0.0f ),
+    mPreRollPos( 0 ),
+    mPreRollFrames( 0 ),
+    mOverdubRequested( false ),
+    mOverdubFeedback( 1.0f ),
+    mOverdubPos( 0 ),
+    mOverdubLen( 0 ),
+    mOverdubChunk( 0 ),
+    mOverdubBuffer( nullptr ),
+    mOverdubSource(),
+    mOverdubCopyPos( 0 ),
+    mDiskWritePos( 0 ),
+    mLoadMeter( nullptr ),
+    mLoadMeterSlot( DspLoadMeter::kNoSlot )
 {
-    
+    mFreeSlots.reserve( mBuffers.size() );
+    mReleasedSlots.reserve( mBuffers.size() );
+    mHeldWaves.reserve( kMaxRetiredWaves );
+}
+
+BufferToWaveRecorderNode::~BufferToWaveRecorderNode()
+{
+    delete mPendingWave.load();
+    delete mLoadedWave;
+
+    while ( const LoadedWave *wave = popRetiredWave() )
+        delete wave;
+    for ( const LoadedWave *wave : mHeldWaves )
+        delete wave;
 }
 
 void BufferToWaveRecorderNode::initialize()
 {
     // adjust recorder buffer to match channels once initialized, since they could have changed since construction.
-    bool resize = mRecorderBuffer.getNumFrames() != 0;
-    mRecorderBuffer.setNumChannels( getNumChannels() );
+    bool resize = mRecorderBuffer->getNumFrames() != 0;
+    for ( auto &buffer : mBuffers )
+        buffer.setNumChannels( getNumChannels() );
 
     // lenght of buffer is = number of seconds * sample rate 
     initBuffers( size_t( mNumSeconds * (double)getSampleRate() ) ); 
 
-    // How many samples each chunk contains. That is it calculates the min and max of 
-    // This is calculated here and not in the initializer list because it uses getNumFrames()
-    // FIXME probably could be done in constructor body 
-    mNumSamplesPerChunk = std::lround( float( getNumFrames() ) / mNumChunks );
-
     // if the buffer had already been resized, zero out any possibly existing data.
-    if( resize )
-        mRecorderBuffer.zero();
+    if( resize ){
+        for ( auto &buffer : mBuffers )
+            buffer.zero();
+    }
+
+    mCapturePos = 0;
+    mCapturedFrames = 0;
+    mArchivePos = 0;
+    mArchiveLen = 0;
+
+    // the history starts with the silent wave in the first slot 
+    mRecorderBuffer = &mBuffers[0];
+    mBackBuffer = &mBuffers[1];
+    mHistory[0] = 0;
+    mHistoryStart = 0;
+    mHistoryLen = 1;
+    mHistoryPos = 0;
+    mFreeSlots.clear();
+    mReleasedSlots.clear();
+    for ( size_t slot = 2; slot < mBuffers.size(); slot++ )
+        mFreeSlots.push_back( slot );
+
+    // the grains switch wave at the start of their next block, and the block the slot is released in can be just starting 
+    mSlotReleaseFrames = size_t( mSlotReleaseTime * getSampleRate() ) + 2 * getFramesPerBlock();
+
+    // the slots are silent and summarized once: a capture refreshes the summary of its buffer as it writes it 
+    mClearedFrames = mBackBuffer->getNumFrames();
+    if ( mCaptureMode == CaptureMode::eLast || mCaptureMode == CaptureMode::eNext ){
+        for ( auto &buffer : mBuffers )
+            peaksOf( &buffer ).update( buffer.getData(), 0, 0, buffer.getNumFrames() );
+    }
+
+    if ( mCaptureMode == CaptureMode::eLive )
+        publishLive();
+    else
+        publishGrainBuffer( 0, mRecorderBuffer->getNumFrames() );
+    mPublishedPeakPyramid.store( &peaksOf( mRecorderBuffer ), std::memory_order_release );
 
     mEnvRampLen = kRampTime * getSampleRate();
-    mEnvDecayStart = mRecorderBuffer.getNumFrames() - mEnvRampLen;
+    mRecordLen = mRecorderBuffer->getNumFrames();
+    // write position at the end of the buffer: process() runs but doesn't record until a start command 
+    mWritePos = mRecordLen;
+    mEnvDecayStart = mRecordLen - mEnvRampLen;
     if ( mEnvRampLen <= 0 ){
         mEnvRampRate = 0;
     }
     else{
         mEnvRampRate = 1.0f / mEnvRampLen;
     }
+
+    // a wave is long enough for both fades and one frame per chunk 
+    mMinRecordLen = std::max( size_t( mMinNumSeconds * getSampleRate() ), std::max( 2 * mEnvRampLen, mNumChunks ) );
+    mMinRecordLen = std::min( mMinRecordLen, mRecordLen );
+
+    // the pre-roll is allocated here, so that arming never allocates on the audio thread 
+    if ( mRecordThreshold > 0.0f )
+        mPreRoll.assign( std::min( size_t( kPreRollSeconds * getSampleRate() ), mRecordLen / 2 ), 0.0f );
+    mPreRollPos = 0;
+    mPreRollFrames = 0;
 }
 
 void BufferToWaveRecorderNode::initBuffers(size_t numFrames)
 {
-    mRecorderBuffer.setSize( numFrames, getNumChannels() );
-    mCopiedBuffer = std::make_shared<ci::audio::BufferDynamic>( numFrames, getNumChannels() );
+    // all the slots are allocated here, so that a recording, a capture or an overdub never allocates on the audio thread 
+    for ( auto &buffer : mBuffers )
+        buffer.setSize( numFrames, getNumChannels() );
+    for ( auto &peaks : mPeakPyramids )
+        peaks.setCapacity( numFrames );
+
+    for ( auto &compactBuffer : mCompactBuffers ){
+        if ( mGrainStorage == GrainStorage::eInt16 )
+            compactBuffer.assign( numFrames, 0 );
+        else
+            compactBuffer.clear();
+    }
 }
 
-void BufferToWaveRecorderNode::start()
+bool BufferToWaveRecorderNode::start( uint64_t frame )
 {
-    mWritePos = 0;
-    mChunkIndex = 0;
-    enable();
+    // the audio thread resets the write position at the frame of the command. 
+    // The queue is full after kMaxRecordMsgs commands within one block: the command is dropped and counted by the queue 
+    RecordMsg msg = makeRecordMsg( Command::RECORD_START, frame );
+    return mRecordMsgs.push( msg );
 }
 
-void BufferToWaveRecorderNode::stop()
+bool BufferToWaveRecorderNode::finish( uint64_t frame )
 {
-    disable();
+    RecordMsg msg = makeRecordMsg( Command::RECORD_FINISH, frame );
+    return mRecordMsgs.push( msg );
 }
 
-void BufferToWaveRecorderNode::setNumSeconds(double numSeconds, bool shrinkToFit)
+uint64_t BufferToWaveRecorderNode::getCommandFrame() const
 {
-    setNumFrames(size_t(numSeconds * (double)getSampleRate()), shrinkToFit);
+    const int32_t epoch = mFrameEpoch.load( std::memory_order_relaxed );
+    if ( epoch == kNoEpoch )
+        return 0;
+
+    // one block later, so that the frame is not past yet when the audio thread reads the command, 
+    // whenever it's sent during the period 
+    const int64_t epochNanos = mEpochReference + int64_t( epoch ) * 1000;
+    const double elapsed = std::max<int64_t>( int64_t( DspLoadMeter::now() ) - epochNanos, 0 ) * 1e-9;
+    return uint64_t( elapsed * getSampleRate() ) + getFramesPerBlock();
 }
 
-double BufferToWaveRecorderNode::getNumSeconds() const
+void BufferToWaveRecorderNode::stop()
 {
-    return (double)getNumFrames() / (double)getSampleRate();
+    disable();
 }
 
-void BufferToWaveRecorderNode::setNumFrames(size_t numFrames, bool shrinkToFit)
+void BufferToWaveRecorderNode::overdub()
 {
-    if (mRecorderBuffer.getNumFrames() == numFrames)
+    if ( mCaptureMode != CaptureMode::eOff )
         return;
 
-    std::lock_guard<std::mutex> lock(getContext()->getMutex());
-
-    if (mWritePos != 0)
-        resizeBufferAndShuffleChannels(&mRecorderBuffer, numFrames);
-    else
-        mRecorderBuffer.setNumFrames(numFrames);
+    // the audio thread starts the pass at the start of the next sub-block 
+    mOverdubRequested = true;
+}
 
-    if (shrinkToFit)
-        mRecorderBuffer.shrinkToFit();
+void BufferToWaveRecorderNode::undo()
+{
+    // the audio thread moves in the history at the start of the next block 
+    mHistorySteps.fetch_sub( 1 );
 }
 
-ci::audio::BufferRef BufferToWaveRecorderNode::getRecordedCopy() const
+void BufferToWaveRecorderNode::redo()
 {
-    // first grab the number of current frames, which may be increasing as the recording continues.
-    size_t numFrames = mWritePos;
-    mCopiedBuffer->setSize(numFrames, mRecorderBuffer.getNumChannels());
+    mHistorySteps.fetch_add( 1 );
+}
 
-    mCopiedBuffer->copy(mRecorderBuffer, numFrames);
-    return mCopiedBuffer;
+size_t BufferToWaveRecorderNode::getSlotSize( size_t numFrames, GrainStorage storage )
+{
+    const size_t sampleSize = sizeof( float ) + ( storage == GrainStorage::eInt16 ? sizeof( int16_t ) : 0 );
+    return numFrames * sampleSize + PeakPyramid::getMemorySize( numFrames );
 }
 
-void BufferToWaveRecorderNode::writeToFile(const ci::fs::path &filePath, ci::audio::SampleType sampleType)
+const LoadedWave* BufferToWaveRecorderNode::popRetiredWave()
 {
-    size_t currentWritePos = mWritePos;
-    ci::audio::BufferRef copiedBuffer = getRecordedCopy();
+    const auto span = mRetiredWaves.peek();
+    if ( span.size == 0 )
+        return nullptr;
 
-    ci::audio::TargetFileRef target = ci::audio::TargetFile::create(filePath, getSampleRate(), getNumChannels(), sampleType);
-    target->write(copiedBuffer.get(), currentWritePos);
+    const LoadedWave *wave = span.data[0];
+    mRetiredWaves.commitRead( 1 );
+    return wave;
+}
+
+double BufferToWaveRecorderNode::getNumSeconds() const
+{
+    return (double)getNumFrames() / (double)getSampleRate();
 }
 
 uint64_t BufferToWaveRecorderNode::getLastOverrun()
@@ -211,89 +332,780 @@ uint64_t BufferToWaveRecorderNode::getLastOverrun()
 
 
 void BufferToWaveRecorderNode::process(ci::audio::Buffer *buffer)
+{
+    DspLoadMeter::Scope loadScope( mLoadMeter, mLoadMeterSlot );
+
+    adoptPendingWave();
+    applyHistorySteps();
+
+    // a batch of chunks that didn't fit in the queue is sent again once there is room, unless a recording redraws the wave first 
+    if ( mResendChunks && mRecordWaveQueue.getAvailableWrite() >= mChunkBatch.size() )
+        sendAllChunks( *mPublishedPeakPyramid.load( std::memory_order_relaxed ) );
+
+    const uint64_t blockFrame = getContext()->getNumProcessedFrames();
+    const size_t numFrames = buffer->getNumFrames();
+    const int64_t epochNanos = int64_t( DspLoadMeter::now() ) - int64_t( blockFrame * 1e9 / getSampleRate() );
+    mFrameEpoch.store( int32_t( ( epochNanos - mEpochReference ) / 1000 ), std::memory_order_relaxed );
+
+    // the block is split at the frame of each command due in it, and the command applies from the next frame on. 
+    // A command due in a later block waits, and the commands after it wait too, so that they are applied in order 
+    size_t pos = 0;
+    for ( RecordMsgQueue::Span msgs = mRecordMsgs.peek(); msgs.size > 0; msgs = mRecordMsgs.peek() ){
+        const RecordMsg &msg = msgs.data[0];
+        if ( msg.frame >= blockFrame + numFrames )
+            break;
+
+        const size_t msgPos = msg.frame > blockFrame ? std::max( size_t( msg.frame - blockFrame ), pos ) : pos;
+        processFrames( buffer->getData() + pos, msgPos - pos );
+        pos = msgPos;
+
+        applyRecordMsg( msg );
+        mRecordMsgs.commitRead( 1 );
+    }
+
+    processFrames( buffer->getData() + pos, numFrames - pos );
+}
+
+void BufferToWaveRecorderNode::processFrames( const float *data, size_t numFrames )
+{
+    // the write position is read before each sub-block, so that a pending finish() is applied within kSubBlockFrames frames 
+    forEachSubBlock( numFrames, [this, data]( size_t offset, size_t subBlockFrames ) {
+        processSubBlock( data + offset, subBlockFrames );
+    } );
+}
+
+void BufferToWaveRecorderNode::applyRecordMsg( const RecordMsg &msg )
+{
+    if ( msg.cmd == Command::RECORD_FINISH ){
+        // read by the next sub-block, that starts right here 
+        mFinishRequested = true;
+        return;
+    }
+
+    if ( mCaptureMode == CaptureMode::eLive )
+        return;
+
+    if ( mCaptureMode != CaptureMode::eOff ){
+        // the next sub-block commits the captured input 
+        mCommitRequested = true;
+        return;
+    }
+
+    // a finish() applied before this recording doesn't end it 
+    mFinishRequested = false;
+    if ( mRecordThreshold > 0.0f && !mPreRoll.empty() )
+        mArmed = true;
+    mWritePos = 0;
+    mChunkIndex = 0;
+}
+
+void BufferToWaveRecorderNode::processSubBlock( const float *data, size_t numFrames )
+{
+    if ( mCaptureMode == CaptureMode::eLive ){
+        processLive( data, numFrames );
+        return;
+    }
+
+    if ( mCaptureMode != CaptureMode::eOff ){
+        processCapture( data, numFrames );
+        return;
+    }
+
+    // no recording is in progress when the write position is at the end of the wave 
+    if ( mOverdubRequested.exchange( false ) && mWritePos >= mRecordLen && !mArmed )
+        beginOverdub();
+
+    if ( mOverdubPos < mOverdubLen ){
+        if ( mWritePos >= mRecordLen ){
+            processOverdub( data, numFrames );
+            return;
+        }
+
+        // a new recording replaces the wave: the overdub stops 
+        mOverdubPos = 0;
+        mOverdubLen = 0;
+    }
+
+    if ( mArmed ){
+        processArmed( data, numFrames );
+        return;
+    }
+
+    recordFrames( data, numFrames );
+}
+
+void BufferToWaveRecorderNode::recordFrames( const float *data, size_t numFrames )
 {
     size_t writePos = mWritePos;
-    size_t numWriteFrames = buffer->getNumFrames();
+    size_t numWriteFrames = numFrames;
 
     if ( writePos == 0 ){
         RecordWaveMsg msg = makeRecordWaveMsg( Command::WAVE_START, 0, 0, 0 );
-        mRingBuffer.write( &msg, 1 );
+        mRecordWaveQueue.push( msg );
+        mResendChunks = false;
 
         // reset everything
         mChunkMinAudioVal = kMaxAudioVal;
         mChunkMaxAudioVal = kMinAudioVal;
-        mChunkSampleCounter = 0;
         mChunkIndex = 0;
-        mEnvRamp = 0.0f;
+        // the wave is as long as the buffer, unless finish() is called 
+        mRecordLen = mBackBuffer->getNumFrames();
+        mEnvDecayStart = mRecordLen - mEnvRampLen;
+        // the graphic thread draws the new wave as it gets recorded 
+        peaksOf( mBackBuffer ).setLength( mRecordLen );
+        mPublishedPeakPyramid.store( &peaksOf( mBackBuffer ), std::memory_order_release );
+
+        if ( mDiskWriter )
+            mDiskWriter->beginFile();
+        mDiskWritePos = 0;
     }
 
+    // finish() is ignored when no recording is in progress 
+    if ( mFinishRequested.exchange( false ) && writePos < mRecordLen ){
+        finishRecording( writePos );
+
+        // the wave ends right here 
+        if ( writePos == mRecordLen ){
+            completeRecording();
+            return;
+        }
+    }
+
+    // the chunks are laid out on the whole buffer while recording, as the length of the wave is not known yet 
+    const size_t bufferLen = mBackBuffer->getNumFrames();
+    const size_t waveLen = mRecordLen;
+
     // if buffer has too many frames (because we're nearly at the end or at the end ) 
-    // of mRecoderBuffer then numWriteFrames becomes the number of samples left to 
-    // fill mRecorderBuffer. Which is 0 if the buffer is at the end.
-    if ( writePos + numWriteFrames > mRecorderBuffer.getNumFrames() )
-        numWriteFrames = mRecorderBuffer.getNumFrames() - writePos;
+    // of the wave then numWriteFrames becomes the number of samples left to 
+    // fill the wave. Which is 0 if the wave is complete.
+    if ( writePos >= waveLen )
+        return;
+
+    if ( writePos + numWriteFrames > waveLen )
+        numWriteFrames = waveLen - writePos;
+
+    // the new wave is recorded in the back buffer while the grains keep reading the front buffer. The recorder buffer is one channel only 
+    float *wave = mBackBuffer->getData();
+    const size_t writeEnd = writePos + numWriteFrames;
+
+    // The sub-block is split at the chunk boundaries, so that each span is processed in one vectorized pass that applies 
+    // the envelope, writes the samples in the wave and extends the min and max of the chunk. 
+    // The envelope at the edges of the wave avoids clicks: it is a function of the position in the wave, clamped to [0, 1] 
+    for ( size_t pos = writePos; pos < writeEnd; ){
+        const size_t chunkEnd = ( mChunkIndex + 1 ) * bufferLen / mNumChunks;
+        const size_t spanEnd = std::min( writeEnd, chunkEnd );
+
+        float gain = 1.0f;
+        float gainInc = 0.0f;
+        if ( mEnvRampLen > 0 ){
+            if ( pos < mEnvRampLen ){ // beginning of wave 
+                gain = pos * mEnvRampRate;
+                gainInc = mEnvRampRate;
+            }
+            else if ( spanEnd > mEnvDecayStart ){ // end of wave 
+                gain = ( waveLen - pos ) * mEnvRampRate;
+                gainInc = -mEnvRampRate;
+            }
+        }
+
+        simd::rampCopyMinMax( data + ( pos - writePos ), wave + pos, spanEnd - pos, gain, gainInc, mChunkMinAudioVal, mChunkMaxAudioVal );
+        pos = spanEnd;
+
+        if ( pos == chunkEnd ){
+            // send chunk to GUI
+            size_t chunkIndex = mChunkIndex.fetch_add( 1 );
+
+            RecordWaveMsg msg = makeRecordWaveMsg( Command::WAVE_CHUNK, chunkIndex, mChunkMinAudioVal, mChunkMaxAudioVal );
+            mRecordWaveQueue.push( msg );
 
-    if ( numWriteFrames <= 0 )
+            // reset chunk info 
+            mChunkMinAudioVal = kMaxAudioVal;
+            mChunkMaxAudioVal = kMinAudioVal;
+        }
+    }
+
+    peaksOf( mBackBuffer ).update( wave, 0, writePos, writeEnd );
+    updateCompactBuffer( mBackBuffer, writePos, writeEnd );
+
+    // the frames that the fade out could still touch, if finish() is called, stay out of the file until the wave is complete 
+    const size_t diskEnd = writeEnd > mEnvRampLen ? writeEnd - mEnvRampLen : 0;
+    if ( mDiskWriter && diskEnd > mDiskWritePos ){
+        mDiskWriter->write( wave + mDiskWritePos, diskEnd - mDiskWritePos );
+        mDiskWritePos = diskEnd;
+    }
+
+    if ( numWriteFrames < numFrames )
+        mLastOverrun = getContext()->getNumProcessedFrames();
+
+    // the write position is only reset by a start command, applied between two sub-blocks 
+    mWritePos = writeEnd;
+
+    if ( writeEnd == waveLen )
+        completeRecording();
+
+}
+
+void BufferToWaveRecorderNode::processArmed( const float *data, size_t numFrames )
+{
+    const size_t preRollLen = mPreRoll.size();
+
+    // released before making any sound: nothing is recorded. The write position at the end of the buffer stops the recording 
+    if ( mFinishRequested.exchange( false ) ){
+        mArmed = false;
+        mPreRollPos = 0;
+        mPreRollFrames = 0;
+
+        mWritePos = getNumFrames();
+        return;
+    }
+
+    if ( simd::peak( data, numFrames ) >= mRecordThreshold ){
+        mArmed = false;
+
+        // the pre-roll, oldest frame first, then the sub-block that reached the threshold 
+        const size_t oldestPos = ( mPreRollPos + preRollLen - mPreRollFrames ) % preRollLen;
+        const size_t firstPart = std::min( mPreRollFrames, preRollLen - oldestPos );
+
+        if ( firstPart > 0 )
+            recordFrames( mPreRoll.data() + oldestPos, firstPart );
+        if ( mPreRollFrames > firstPart )
+            recordFrames( mPreRoll.data(), mPreRollFrames - firstPart );
+        recordFrames( data, numFrames );
+
+        mPreRollPos = 0;
+        mPreRollFrames = 0;
+        return;
+    }
+
+    // only the last frames fit if the sub-block is longer than the pre-roll 
+    if ( numFrames > preRollLen ){
+        data += numFrames - preRollLen;
+        numFrames = preRollLen;
+    }
+
+    // write the sub-block in the circular buffer, wrapping around at the end 
+    const size_t firstPart = std::min( numFrames, preRollLen - mPreRollPos );
+    std::memcpy( mPreRoll.data() + mPreRollPos, data, firstPart * sizeof( float ) );
+    std::memcpy( mPreRoll.data(), data + firstPart, ( numFrames - firstPart ) * sizeof( float ) );
+
+    mPreRollPos = ( mPreRollPos + numFrames ) % preRollLen;
+    mPreRollFrames = std::min( mPreRollFrames + numFrames, preRollLen );
+}
+
+void BufferToWaveRecorderNode::beginOverdub()
+{
+    // a long wave doesn't fit in a slot: it can't be overdubbed 
+    if ( mLoadedWave != nullptr && mLoadedWave->grainBuffer.paged != nullptr )
         return;
 
+    // the overdub makes a new version of the wave, so that it can be undone: the wave played, loaded or recorded, 
+    // is copied in the back buffer, that is published in its place, and the input is mixed into the copy. The copy is unrolled, 
+    // made a few sub-blocks at a time by processOverdub() ahead of the overdub, and published once complete, so that the history 
+    // never forks a slot in one block. A loaded wave is summarized again anyway, as its pyramid has another capacity 
+    mOverdubSource = mLoadedWave != nullptr ? mLoadedWave->grainBuffer : mGrainBuffers[slotOf( mRecorderBuffer )];
+    mOverdubBuffer = mBackBuffer;
+    mOverdubCopyPos = 0;
+    mOverdubLen = mOverdubSource.numFrames;
+    mOverdubPos = 0;
+    mOverdubChunk = 0;
+    peaksOf( mOverdubBuffer ).setLength( mOverdubLen );
+}
 
-    // apply envelope to the buffer at the edges to avoid clicks 
-    if ( writePos < mEnvRampLen ){ // beginning of wave 
-        for ( size_t i = 0; i < std::min( mEnvRampLen, numWriteFrames ); i++ ){
-            buffer->getData()[i] *= mEnvRamp;
-            mEnvRamp += mEnvRampRate;
-            if ( mEnvRamp > 1.0f )
-                mEnvRamp = 1.0f;
+void BufferToWaveRecorderNode::processOverdub( const float *data, size_t numFrames )
+{
+    const size_t waveLen = mOverdubLen;
+    const size_t rampLen = std::min( mEnvRampLen, waveLen / 2 );
+    const size_t decayStart = waveLen - rampLen;
+    const float feedback = mOverdubFeedback.load( std::memory_order_relaxed );
+
+    const size_t begin = mOverdubPos;
+    const size_t end = std::min( begin + numFrames, waveLen );
+
+    // the input is mixed only in frames already copied. The grains read the copy once it's complete 
+    if ( mOverdubCopyPos < waveLen )
+        copyOverdubFrames( std::max( end, mOverdubCopyPos + kOverdubCopyFrames ) );
+
+    float *wave = mOverdubBuffer->getData();
+
+    // The sub-block is split where the fades begin and end, so that each span is mixed in place in one vectorized pass. 
+    // The input fades in and out with the wave, to avoid clicks at the edges. The copy starts at the start of the buffer 
+    for ( size_t pos = begin; pos < end; ){
+        size_t spanEnd = end;
+        if ( pos < rampLen )
+            spanEnd = std::min( spanEnd, rampLen );
+        else if ( pos < decayStart )
+            spanEnd = std::min( spanEnd, decayStart );
+
+        float gain = 1.0f;
+        float gainInc = 0.0f;
+        if ( rampLen > 0 ){
+            const float rampRate = 1.0f / rampLen;
+            if ( pos < rampLen ){ // beginning of wave 
+                gain = pos * rampRate;
+                gainInc = rampRate;
+            }
+            else if ( pos >= decayStart ){ // end of wave 
+                gain = ( waveLen - pos ) * rampRate;
+                gainInc = -rampRate;
+            }
         }
+
+        simd::rampMix( data + ( pos - begin ), wave + pos, spanEnd - pos, feedback, gain, gainInc );
+        updateCompactBuffer( mOverdubBuffer, pos, spanEnd );
+        pos = spanEnd;
     }
-    else if ( writePos + numWriteFrames > mEnvDecayStart ){ // end of wave 
-        for ( size_t i = std::max( writePos, mEnvDecayStart ) - writePos; i < numWriteFrames; i++ ){
-            buffer->getData()[i] *= mEnvRamp;
-            mEnvRamp -= mEnvRampRate;
-            if ( mEnvRamp < 0.0f )
-                mEnvRamp = 0.0f;
+
+    // only the frames overdubbed are summarized again, and only the chunks they complete are sent to the graphic thread 
+    PeakPyramid &peaks = peaksOf( mOverdubBuffer );
+    peaks.refresh( wave, 0, begin, end );
+    mOverdubPos = end;
+
+    while ( mOverdubChunk < mNumChunks && ( mOverdubChunk + 1 ) * waveLen / mNumChunks <= end ){
+        const PeakPyramid::Peak peak = peaks.getPeak( mOverdubChunk * waveLen / mNumChunks, ( mOverdubChunk + 1 ) * waveLen / mNumChunks );
+        RecordWaveMsg msg = makeRecordWaveMsg( Command::WAVE_OVERDUB_CHUNK, mOverdubChunk, peak.min, peak.max );
+        mRecordWaveQueue.push( msg );
+        mOverdubChunk++;
+    }
+
+    // the wave changed: counted as a new one, so that the WaveAnalyzer indexes it again 
+    if ( end == waveLen )
+        mNumPublishedWaves.fetch_add( 1, std::memory_order_release );
+}
+
+void BufferToWaveRecorderNode::copyOverdubFrames( size_t end )
+{
+    const GrainBuffer &source = mOverdubSource;
+    const size_t begin = mOverdubCopyPos;
+    end = std::min( end, mOverdubLen );
+    float *copy = mOverdubBuffer->getData();
+
+    // frame i of the wave played is at ( offset + i ) % numFrames: the copy starts at the start of the buffer 
+    for ( size_t pos = begin; pos < end; ){
+        const size_t sourcePos = ( source.offset + pos ) % source.numFrames;
+        const size_t part = std::min( end - pos, source.numFrames - sourcePos );
+        std::memcpy( copy + pos, source.data + sourcePos, part * sizeof( float ) );
+        pos += part;
+    }
+
+    PeakPyramid &peaks = peaksOf( mOverdubBuffer );
+    peaks.update( copy, 0, begin, end );
+    updateCompactBuffer( mOverdubBuffer, begin, end );
+    mOverdubCopyPos = end;
+
+    // the back buffer is still mOverdubBuffer: a recording, a loaded wave or an undo would have stopped the overdub 
+    if ( end == mOverdubLen ){
+        commitVersion( 0, mOverdubLen );
+        mPublishedPeakPyramid.store( &peaks, std::memory_order_release );
+    }
+}
+
+void BufferToWaveRecorderNode::completeRecording()
+{
+    // a wave shorter than the buffer is drawn again, with the chunks laid out on its actual length 
+    if ( mRecordLen < mBackBuffer->getNumFrames() )
+        sendAllChunks( peaksOf( mBackBuffer ) );
+
+    // the new wave goes to the front 
+    commitVersion( 0, mRecordLen );
+
+    if ( mDiskWriter ){
+        mDiskWriter->write( mRecorderBuffer->getData() + mDiskWritePos, mRecordLen - mDiskWritePos );
+        mDiskWriter->endFile();
+    }
+    mDiskWritePos = mRecordLen;
+}
+
+void BufferToWaveRecorderNode::finishRecording( size_t writePos )
+{
+    const size_t bufferLen = mBackBuffer->getNumFrames();
+    const size_t prevRecordLen = mRecordLen;
+    const size_t prevDecayStart = mEnvDecayStart;
+    mRecordLen = std::min( std::max( writePos, mMinRecordLen ), bufferLen );
+    mEnvDecayStart = mRecordLen - mEnvRampLen;
+
+    // the frames already recorded past the start of the fade out are faded now, the others as they get recorded. 
+    // None of them was sent to the disk writer yet 
+    float *wave = mBackBuffer->getData();
+    if ( mEnvRampLen > 0 && writePos > mEnvDecayStart ){
+        for ( size_t i = mEnvDecayStart; i < writePos; i++ ){
+            // the frames past the previous start of the fade out were faded as they were recorded, for the longer wave: 
+            // that gain is replaced rather than applied twice 
+            if ( i >= prevDecayStart )
+                wave[i] *= float( mRecordLen - i ) / float( prevRecordLen - i );
+            else
+                wave[i] *= ( mRecordLen - i ) * mEnvRampRate;
         }
+
+        peaksOf( mBackBuffer ).update( wave, 0, mEnvDecayStart, writePos );
+        updateCompactBuffer( mBackBuffer, mEnvDecayStart, writePos );
     }
 
+    // the chunks sent so far are laid out on the whole buffer: the graphic thread redraws the wave when it's complete 
+    peaksOf( mBackBuffer ).setLength( mRecordLen );
+}
 
-    mRecorderBuffer.copyOffset(*buffer, numWriteFrames, writePos, 0);
 
-    if ( numWriteFrames < buffer->getNumFrames() )
-        mLastOverrun = getContext()->getNumProcessedFrames();
+void BufferToWaveRecorderNode::processCapture( const float *data, size_t numFrames )
+{
+    const size_t captureLen = mBackBuffer->getNumFrames();
+    if ( captureLen == 0 )
+        return;
 
-    /* find max and minimum of this buffer */
-    for ( size_t i = 0; i < numWriteFrames; i++ ){
+    if ( mCommitRequested ){
+        if ( mCaptureMode == CaptureMode::eNext ){
+            mCommitRequested = false;
+            mCommitCountdown = captureLen;
+        }
+        // the last capture must be silenced and the last wave archived first: a fraction of the wave length after the last commit 
+        else if ( mCapturedFrames + mClearedFrames >= captureLen && mArchivePos == mArchiveLen ){
+            mCommitRequested = false;
+            commitCapture();
+        }
+    }
+
+    // write the sub-block in the circular buffer, wrapping around at the end. It's summarized and converted in buffer order 
+    // as it's written, so that the commit has little left to do 
+    float *capture = mBackBuffer->getData();
+    for ( size_t done = 0; done < numFrames; ){
+        const size_t part = std::min( numFrames - done, captureLen - mCapturePos );
+        std::memcpy( capture + mCapturePos, data + done, part * sizeof( float ) );
+        refreshCapture( mCapturePos, part );
 
-        if ( buffer->getData()[i] < mChunkMinAudioVal ){
-            mChunkMinAudioVal = buffer->getData()[i];
+        mCapturePos = ( mCapturePos + part ) % captureLen;
+        done += part;
+    }
+
+    mCapturedFrames = std::min( mCapturedFrames + numFrames, captureLen );
+    mClearedFrames = mClearedFrames > numFrames ? mClearedFrames - numFrames : 0;
+
+    // the samples ahead of the write position that were not captured since the last commit belong to an older wave: 
+    // they are silenced a few sub-blocks at a time 
+    const size_t uncaptured = captureLen - mCapturedFrames;
+    if ( mClearedFrames < uncaptured ){
+        const size_t clearEnd = mClearedFrames + std::min( kCaptureStepFrames, uncaptured - mClearedFrames );
+        for ( size_t pos = mClearedFrames; pos < clearEnd; ){
+            const size_t bufferPos = ( mCapturePos + pos ) % captureLen;
+            const size_t part = std::min( clearEnd - pos, captureLen - bufferPos );
+            std::memset( capture + bufferPos, 0, part * sizeof( float ) );
+            refreshCapture( bufferPos, part );
+            pos += part;
         }
+        mClearedFrames = clearEnd;
+    }
 
-        if ( buffer->getData()[i] > mChunkMaxAudioVal ){
-            mChunkMaxAudioVal = buffer->getData()[i];
+    // the wave last committed is written to disk a few sub-blocks at a time too 
+    if ( mArchivePos < mArchiveLen ){
+        const size_t archiveEnd = std::min( mArchivePos + kCaptureStepFrames, mArchiveLen );
+        for ( size_t pos = mArchivePos; pos < archiveEnd; ){
+            const size_t bufferPos = ( mArchiveOffset + pos ) % mArchiveLen;
+            const size_t part = std::min( archiveEnd - pos, mArchiveLen - bufferPos );
+            mDiskWriter->write( mArchiveData + bufferPos, part );
+            pos += part;
         }
 
-        if ( mChunkSampleCounter >= mNumSamplesPerChunk              // if collected enough samples 
-            || writePos + i >= mRecorderBuffer.getNumFrames() - 1 ){ // or at the end of recorder buffer 
-            // send chunk to GUI
-            size_t chunkIndex = mChunkIndex.fetch_add( 1 );
+        mArchivePos = archiveEnd;
+        if ( mArchivePos == mArchiveLen )
+            mDiskWriter->endFile();
+    }
 
-            RecordWaveMsg msg = makeRecordWaveMsg( Command::WAVE_CHUNK, chunkIndex, mChunkMinAudioVal, mChunkMaxAudioVal );
-            mRingBuffer.write( &msg, 1 );
-            
-            // reset chunk info 
-            mChunkMinAudioVal = kMaxAudioVal;
-            mChunkMaxAudioVal = kMinAudioVal;
-            mChunkSampleCounter = 0;
+    if ( mCommitCountdown > 0 ){
+        // the wave is committed at the end of the sub-block where the countdown expires, so it can start up to one sub-block late 
+        if ( mCommitCountdown <= numFrames ){
+            mCommitCountdown = 0;
+            commitCapture();
         }
         else{
-            mChunkSampleCounter++;
+            mCommitCountdown -= numFrames;
+        }
+    }
+}
+
+void BufferToWaveRecorderNode::refreshCapture( size_t begin, size_t numFrames )
+{
+    updateCompactBuffer( mBackBuffer, begin, begin + numFrames );
+    peaksOf( mBackBuffer ).refresh( mBackBuffer->getData(), 0, begin, begin + numFrames );
+}
+
+void BufferToWaveRecorderNode::processLive( const float *data, size_t numFrames )
+{
+    const size_t lineLen = mRecorderBuffer->getNumFrames();
+    if ( lineLen == 0 )
+        return;
+
+    float *line = mRecorderBuffer->getData();
+    PeakPyramid &peaks = peaksOf( mRecorderBuffer );
+    size_t writePos = mLiveOffset.load( std::memory_order_relaxed );
+
+    // write the sub-block in the circular buffer, wrapping around at the end. The pyramid summarizes the line in buffer order 
+    for ( size_t done = 0; done < numFrames; ){
+        const size_t part = std::min( numFrames - done, lineLen - writePos );
+        std::memcpy( line + writePos, data + done, part * sizeof( float ) );
+        updateCompactBuffer( mRecorderBuffer, writePos, writePos + part );
+        peaks.refresh( line, 0, writePos, writePos + part );
+
+        writePos = ( writePos + part ) % lineLen;
+        done += part;
+    }
+
+    // the next frame to be written is the oldest one: the wave starts there, for the grains and for the graphic thread 
+    peaks.setOrigin( writePos );
+    mLiveOffset.store( writePos, std::memory_order_release );
+
+    mLiveScrollFrames += numFrames;
+    if ( mLiveScrollFrames >= lineLen / mNumChunks ){
+        // dropped if the graphic thread hasn't read the previous one yet: it redraws the whole wave anyway 
+        mLiveScrollFrames = 0;
+        if ( mRecordWaveQueue.getAvailableWrite() > 0 ){
+            RecordWaveMsg msg = makeRecordWaveMsg( Command::WAVE_SCROLL, 0, 0.0f, 0.0f );
+            mRecordWaveQueue.push( msg );
         }
     }
+}
+
+void BufferToWaveRecorderNode::publishLive()
+{
+    mLiveOffset = 0;
+    mLiveScrollFrames = 0;
+    peaksOf( mRecorderBuffer ).setLength( mRecorderBuffer->getNumFrames() );
+
+    // the front buffer is never swapped in live mode: the grains read it as it's written 
+    GrainBuffer &grainBuffer = mGrainBuffers[slotOf( mRecorderBuffer )];
+    grainBuffer.data = mRecorderBuffer->getData();
+    grainBuffer.numFrames = mRecorderBuffer->getNumFrames();
+    grainBuffer.offset = 0;
+    grainBuffer.data16 = mGrainStorage == GrainStorage::eInt16 ? mCompactBuffers[slotOf( mRecorderBuffer )].data() : nullptr;
+    grainBuffer.paged = nullptr;
+    grainBuffer.live = &mLiveOffset;
+
+    publishFront();
+}
+
+void BufferToWaveRecorderNode::commitCapture()
+{
+    // the capture buffer becomes the wave buffer and vice versa: no audio is copied. 
+    // The oldest captured sample, at mCapturePos, becomes the first sample of the wave. The samples not captured 
+    // since the last commit were silenced, and all of them summarized and converted, by processCapture() 
+    float *wave = mBackBuffer->getData();
+    const size_t waveLen = mBackBuffer->getNumFrames();
+    const size_t offset = mCapturePos;
+
+    // apply envelope to the edges of the wave to avoid clicks, as when recording 
+    const size_t rampLen = std::min( mEnvRampLen, waveLen / 2 );
+    for ( size_t i = 0; i < rampLen; i++ ){
+        const float ramp = i * mEnvRampRate;
+        wave[( offset + i ) % waveLen] *= ramp;
+        wave[( offset + waveLen - 1 - i ) % waveLen] *= ramp;
+    }
+
+    // only the edges changed since the frames were summarized, in buffer order 
+    for ( size_t edge : { offset, offset + waveLen - rampLen } ){
+        const size_t begin = edge % waveLen;
+        const size_t firstPart = std::min( rampLen, waveLen - begin );
+        refreshCapture( begin, firstPart );
+        refreshCapture( 0, rampLen - firstPart );
+    }
+
+    // the summary starts at the first sample of the wave. Take all the chunks from the summary and send them in one go 
+    PeakPyramid &peaks = peaksOf( mBackBuffer );
+    peaks.setLength( waveLen );
+    peaks.setOrigin( offset );
+    mPublishedPeakPyramid.store( &peaks, std::memory_order_release );
+    sendAllChunks( peaks );
+
+    // the wave is written to disk by the next sub-blocks. It stays in its slot until the next commit 
+    if ( mDiskWriter ){
+        mDiskWriter->beginFile();
+        mArchiveData = wave;
+        mArchiveOffset = offset;
+        mArchivePos = 0;
+        mArchiveLen = waveLen;
+    }
+
+    commitVersion( offset, waveLen );
+
+    mCapturedFrames = 0;
+    mClearedFrames = 0;
+}
+
+void BufferToWaveRecorderNode::commitVersion( size_t offset, size_t numFrames )
+{
+    const size_t historySize = mHistory.size();
+
+    // the versions undone can't be redone anymore: their slots are free. One of them could have been played until a moment ago 
+    while ( mHistoryLen > mHistoryPos + 1 ){
+        mHistoryLen--;
+        releaseSlot( historySlot( mHistoryLen ) );
+    }
+
+    // the oldest version is dropped when the history is full. With two slots it's the version played until now, 
+    // that the grains keep reading while they crossfade to the new one 
+    if ( mHistoryLen == historySize ){
+        releaseSlot( historySlot( 0 ) );
+        mHistoryStart = ( mHistoryStart + 1 ) % historySize;
+        mHistoryLen--;
+    }
+
+    mHistory[( mHistoryStart + mHistoryLen ) % historySize] = slotOf( mBackBuffer );
+    mHistoryPos = mHistoryLen;
+    mHistoryLen++;
+
+    // the new version goes to the front, and the next wave is recorded in a free slot 
+    mRecorderBuffer = mBackBuffer;
+    mBackBuffer = &mBuffers[takeFreeSlot()];
+
+    publishGrainBuffer( offset, numFrames );
+}
+
+void BufferToWaveRecorderNode::releaseSlot( size_t slot )
+{
+    mReleasedSlots.emplace_back( slot, getContext()->getNumProcessedFrames() + mSlotReleaseFrames );
+}
+
+size_t BufferToWaveRecorderNode::takeFreeSlot()
+{
+    const uint64_t frame = getContext()->getNumProcessedFrames();
+    size_t numReleased = 0;
+    while ( numReleased < mReleasedSlots.size() && mReleasedSlots[numReleased].second <= frame ){
+        mFreeSlots.push_back( mReleasedSlots[numReleased].first );
+        numReleased++;
+    }
+
+    // with two slots the slot dropped is the only one: it's written while the grains may still be reading it 
+    if ( mFreeSlots.empty() && numReleased < mReleasedSlots.size() ){
+        mFreeSlots.push_back( mReleasedSlots[numReleased].first );
+        numReleased++;
+    }
+    mReleasedSlots.erase( mReleasedSlots.begin(), mReleasedSlots.begin() + numReleased );
+
+    const size_t slot = mFreeSlots.back();
+    mFreeSlots.pop_back();
+    return slot;
+}
+
+void BufferToWaveRecorderNode::publishGrainBuffer( size_t offset, size_t numFrames )
+{
+    GrainBuffer &grainBuffer = mGrainBuffers[slotOf( mRecorderBuffer )];
+    grainBuffer.data = mRecorderBuffer->getData();
+    grainBuffer.numFrames = numFrames;
+    grainBuffer.offset = offset;
+    grainBuffer.data16 = mGrainStorage == GrainStorage::eInt16 ? mCompactBuffers[slotOf( mRecorderBuffer )].data() : nullptr;
+    grainBuffer.paged = nullptr;
+    grainBuffer.live = nullptr;
+
+    publishFront();
+}
+
+void BufferToWaveRecorderNode::publishFront()
+{
+    mPublishedGrainBuffer.store( &mGrainBuffers[slotOf( mRecorderBuffer )], std::memory_order_release );
+    mNumPublishedWaves.fetch_add( 1, std::memory_order_release );
+
+    if ( mLoadedWave != nullptr ){
+        retireWave( mLoadedWave );
+        mLoadedWave = nullptr;
+    }
+}
+
+void BufferToWaveRecorderNode::adoptPendingWave()
+{
+    // the waves that didn't fit in the queue before are given back first, in order 
+    size_t numHeld = 0;
+    while ( numHeld < mHeldWaves.size() && mRetiredWaves.push( mHeldWaves[numHeld] ) )
+        numHeld++;
+    mHeldWaves.erase( mHeldWaves.begin(), mHeldWaves.begin() + numHeld );
+
+    const LoadedWave *wave = mPendingWave.exchange( nullptr, std::memory_order_acq_rel );
+    if ( wave == nullptr )
+        return;
 
-    // check if write position has been reset by the GUI thread, if not write new value
-    const size_t writePosNew = writePos + numWriteFrames;
-    mWritePos.compare_exchange_strong( writePos, writePosNew );
+    // the grains always read the delay line in live mode: the wave is given back to the loader right away 
+    if ( mCaptureMode == CaptureMode::eLive ){
+        retireWave( wave );
+        return;
+    }
+
+    if ( mLoadedWave != nullptr )
+        retireWave( mLoadedWave );
+    mLoadedWave = wave;
+
+    // the wave being overdubbed is not played anymore 
+    mOverdubPos = 0;
+    mOverdubLen = 0;
+
+    // the grains read the loaded wave from their next block on, the graphic thread draws it at once 
+    mPublishedGrainBuffer.store( &wave->grainBuffer, std::memory_order_release );
+    mNumPublishedWaves.fetch_add( 1, std::memory_order_release );
+    mPublishedPeakPyramid.store( &wave->peaks, std::memory_order_release );
+    sendAllChunks( wave->peaks );
+}
+
+void BufferToWaveRecorderNode::retireWave( const LoadedWave *wave )
+{
+    // the push that doesn't fit is counted as an overflow by the queue. The wave is never freed on the audio thread: 
+    // it's only lost if the loader stopped collecting for more than twice the length of the queue 
+    if ( !mHeldWaves.empty() || !mRetiredWaves.push( wave ) ){
+        if ( mHeldWaves.size() < mHeldWaves.capacity() )
+            mHeldWaves.push_back( wave );
+    }
+}
+
+void BufferToWaveRecorderNode::applyHistorySteps()
+{
+    const int steps = mHistorySteps.exchange( 0 );
+    if ( steps == 0 || mCaptureMode == CaptureMode::eLive )
+        return;
+
+    // the graphic thread is drawing the wave being recorded: the steps requested meanwhile are dropped 
+    if ( mCaptureMode == CaptureMode::eOff && ( mWritePos < mRecordLen || mArmed ) )
+        return;
+
+    // a loaded wave is not in the history: undoing it goes back to the version played before it was loaded, 
+    // and there is nothing to redo 
+    int pos = int( mHistoryPos ) + steps;
+    if ( mLoadedWave != nullptr ){
+        if ( steps > 0 )
+            return;
+        pos++;
+    }
+
+    pos = std::max( 0, std::min( pos, int( mHistoryLen ) - 1 ) );
+    if ( size_t( pos ) == mHistoryPos && mLoadedWave == nullptr )
+        return;
+
+    // the overdub in progress stops. Its version, overdubbed so far, can be redone 
+    mOverdubPos = 0;
+    mOverdubLen = 0;
+
+    // no audio is copied: the slot of the version is published as it was 
+    mHistoryPos = size_t( pos );
+    mRecorderBuffer = &mBuffers[historySlot( mHistoryPos )];
+    publishFront();
+
+    const PeakPyramid &peaks = peaksOf( mRecorderBuffer );
+    mPublishedPeakPyramid.store( &peaks, std::memory_order_release );
+    sendAllChunks( peaks );
+}
+
+void BufferToWaveRecorderNode::sendAllChunks( const PeakPyramid &peaks )
+{
+    const size_t waveLen = peaks.getLength();
+
+    mChunkBatch[0] = makeRecordWaveMsg( Command::WAVE_START, 0, 0, 0 );
+    for ( size_t chunk = 0; chunk < mNumChunks; chunk++ ){
+        const PeakPyramid::Peak peak = peaks.getPeak( chunk * waveLen / mNumChunks, ( chunk + 1 ) * waveLen / mNumChunks );
+        mChunkBatch[chunk + 1] = makeRecordWaveMsg( Command::WAVE_CHUNK, chunk, peak.min, peak.max );
+    }
+    mResendChunks = !mRecordWaveQueue.push( mChunkBatch.data(), mChunkBatch.size() );
+}
+
+
+void BufferToWaveRecorderNode::updateCompactBuffer( const ci::audio::BufferDynamic *buffer, size_t begin, size_t end )
+{
+    if ( mGrainStorage != GrainStorage::eInt16 || begin >= end )
+        return;
 
+    int16_t *compact = mCompactBuffers[slotOf( buffer )].data();
+    simd::toInt16( buffer->getData() + begin, compact + begin, end - begin, kInt16FullScale );
 }
 
 
@@ -35,6 +35,7 @@
 #include "Oscilloscope.h"
 #include "Messages.h"
 #include "MIDI.h"
+#include "Session.h"
 
 using namespace ci;
 using namespace ci::app;
@@ -48,30 +49,86 @@ class CollidoscopeApp : public App {
     void setup() override;
     void setupGraphics();
 
-    /** Receives MIDI command messages from MIDI thread */
+    /** Receives MIDI command messages from MIDI thread, and updates the visuals */
     void receiveCommands();
+    /** 
+     * Passes a MIDI message to the audio engine. Called from the MIDI threads as soon as the message is received, with the direct 
+     * path ( see Config::isDirectMidiEnabled() ), otherwise from receiveCommands(). Only touches the audio engine and the config 
+     */
+    void dispatchMidiToAudio( const collidoscope::MIDIMessage &m );
+    /** Shows the selection of wave \a waveIdx as the audio engine plays it */
+    void showSelection( size_t waveIdx );
     /** Prints command line usage */
     void usage();
 
     void keyDown( KeyEvent event ) override;
+    /** Ends the recording when the record key is released, if the recording lasts as long as the key is held */
+    void keyUp( KeyEvent event ) override;
+    /** Loads the file dropped on the window in the wave controlled by the keyboard */
+    void fileDrop( FileDropEvent event ) override;
+    /** Loads the next sample of the sample library in wave \a waveIdx */
+    void loadNextSample( size_t waveIdx );
+    /** Sets the filter cutoff of wave \a waveIdx from the \a position of the filter knob, from 0 to 1 */
+    void setFilter( size_t waveIdx, double position );
+    /** Shows the \a position of the filter knob of wave \a waveIdx, from 0 to 1, and keeps it for the session */
+    void showFilter( size_t waveIdx, double position );
+    /** Returns the filter cutoff for the \a position of the filter knob, from 0 to 1. Can be called from any thread */
+    double getFilterCutoff( double position );
+    /** Returns the grain duration coefficient for the MIDI value \a midiVal of the duration knob. Can be called from any thread */
+    double getGrainDurationCoeff( unsigned char midiVal ) const;
+    /** Restores the waves and their settings from the session file */
+    void restoreSession();
+    /** Marks the session to be saved, once the changes are over */
+    void sessionChanged();
+    /** Saves the session in the background, if it changed and no changes happened for a while */
+    void saveSession();
     void update() override;
     void draw() override;
     void resize() override;
+    /** Draws the DSP load of the audio graph on top of the waves */
+    void drawDspLoad();
 
     Config mConfig;
-    collidoscope::MIDI mMIDI;
     AudioEngine mAudioEngine;
+    // declared after the audio engine, so that the MIDI threads are stopped before the engine they call is destroyed 
+    collidoscope::MIDI mMIDI;
     
     array< shared_ptr< Wave >, NUM_WAVES > mWaves;
     array< shared_ptr< DrawInfo >, NUM_WAVES > mDrawInfos;
     array< shared_ptr< Oscilloscope >, NUM_WAVES > mOscilloscopes;
-    // buffer to read the WAVE_* messages as a new wave gets recorded 
-    array< RecordWaveMsg*, NUM_WAVES> mRecordWaveMessageBuffers;
-    //buffer to read the TRIGGER_* messages as the pgranulars play
-    array< vector< CursorTriggerMsg >, NUM_WAVES > mCursorTriggerMessagesBuffers;
 
     double mSecondsPerChunk;
 
+    // draw the DSP load of the audio graph on screen 
+    bool mShowDspLoad;
+    // time of the last DSP load log line 
+    double mLastDspLoadLogTime;
+    // time of the last queue stats log line 
+    double mLastQueueStatsLogTime;
+    // time of the last latency histograms log 
+    double mLastLatencyLogTime;
+    // record commands dropped so far for each wave, as last logged. The MIDI threads can't log, so the drops are logged here 
+    array< uint32_t, NUM_WAVES > mDroppedRecordMsgs;
+    // snapshot of the DSP load, read from the audio engine each frame the overlay is shown
+    vector< DspLoadMeter::SlotStats > mDspLoadStats;
+
+    // index in the sample library of the last sample loaded 
+    size_t mSampleLibraryIndex = 0;
+
+    // the record key is held down: its repeats don't restart the recording 
+    bool mRecordKeyDown = false;
+
+    // saves the state of the waves, so that they come back after a reboot. nullptr if disabled 
+    unique_ptr< Session > mSession;
+    // true when the session changed since it was last saved 
+    bool mSessionChanged = false;
+    // time of the last change to the session 
+    double mSessionChangeTime = 0.0;
+    // whether a wave was recorded or loaded, and thus saved in the session 
+    array< bool, NUM_WAVES > mWaveRecorded;
+    // position of the filter knob of each wave, from 0 to 1 
+    array< double, NUM_WAVES > mFilterPositions;
+
     ~CollidoscopeApp();
 
 };
@@ -89,18 +146,30 @@ void CollidoscopeApp::setup()
         logError( string("Exception loading config from file:") + e.what() );
     }*/
 
-    // setup buffers to read messages from audio thread 
-    for ( size_t i = 0; i < NUM_WAVES; i++ ){
-        mRecordWaveMessageBuffers[i] = new RecordWaveMsg[mConfig.getNumChunks()];
-        mCursorTriggerMessagesBuffers[i].reserve( mConfig.getCursorTriggerMessageBufSize() );
-    }
-
     mAudioEngine.setup( mConfig );
 
     setupGraphics();
 
+    mWaveRecorded.fill( false );
+    mFilterPositions.fill( 1.0 );
+    if ( !mConfig.getSessionFile().empty() ){
+        mSession.reset( new Session( mConfig.getSessionFile(), mAudioEngine.getSampleRate(), 
+            size_t( mConfig.getWaveLen() * mAudioEngine.getSampleRate() ), mConfig.getNumChunks() ) );
+        restoreSession();
+    }
+
     mSecondsPerChunk = mConfig.getWaveLen() / mConfig.getNumChunks();
 
+    mShowDspLoad = mConfig.isDspLoadOverlayEnabled();
+    mLastDspLoadLogTime = getElapsedSeconds();
+    mLastQueueStatsLogTime = getElapsedSeconds();
+    mLastLatencyLogTime = getElapsedSeconds();
+    mDroppedRecordMsgs.fill( 0 );
+
+    // the notes, loop, record and controllers go straight from the MIDI threads to the audio engine, without waiting for the frame 
+    if ( mConfig.isDirectMidiEnabled() )
+        mMIDI.setDirectCallback( [this]( const collidoscope::MIDIMessage &m ) { dispatchMidiToAudio( m ); } );
+
     try {
         mMIDI.setup( mConfig );
     }
@@ -129,6 +198,11 @@ void CollidoscopeApp::keyDown( KeyEvent event )
 
     switch (c){
     case 'r' : 
+        if ( mConfig.isRecordHoldEnabled() ){
+            if ( mRecordKeyDown )
+                return;
+            mRecordKeyDown = true;
+        }
         mAudioEngine.record( waveIdx );
         break;
 
@@ -137,10 +211,8 @@ void CollidoscopeApp::keyDown( KeyEvent event )
         mWaves[waveIdx]->getSelection().setSize(mWaves[waveIdx]->getSelection().getSize() + 1);
 
         size_t numSelectionChunks = mWaves[waveIdx]->getSelection().getSize();
-        // how many samples in one selection ?
-        size_t selectionSize = numSelectionChunks * (mConfig.getWaveLen() * mAudioEngine.getSampleRate() / mConfig.getNumChunks());
-
-        mAudioEngine.setSelectionSize(waveIdx, selectionSize);
+        mAudioEngine.setSelectionSize(waveIdx, numSelectionChunks);
+        sessionChanged();
     };
         break;
 
@@ -148,8 +220,8 @@ void CollidoscopeApp::keyDown( KeyEvent event )
 
         mWaves[waveIdx]->getSelection().setSize( mWaves[waveIdx]->getSelection().getSize() - 1 );
 
-        size_t selectionSize = mWaves[waveIdx]->getSelection().getSize() *(mConfig.getWaveLen() * mAudioEngine.getSampleRate() / mConfig.getNumChunks());
-        mAudioEngine.setSelectionSize( waveIdx, selectionSize );
+        mAudioEngine.setSelectionSize( waveIdx, mWaves[waveIdx]->getSelection().getSize() );
+        sessionChanged();
     };
         break;
 
@@ -159,7 +231,8 @@ void CollidoscopeApp::keyDown( KeyEvent event )
         mWaves[waveIdx]->getSelection().setStart( selectionStart + 1 );
 
         selectionStart = mWaves[waveIdx]->getSelection().getStart();
-        mAudioEngine.setSelectionStart( waveIdx, selectionStart * (mConfig.getWaveLen() * mAudioEngine.getSampleRate() / mConfig.getNumChunks()) );
+        mAudioEngine.setSelectionStart( waveIdx, selectionStart );
+        sessionChanged();
     };
 
         break;
@@ -174,7 +247,8 @@ void CollidoscopeApp::keyDown( KeyEvent event )
 
         selectionStart = mWaves[waveIdx]->getSelection().getStart();
 
-        mAudioEngine.setSelectionStart( waveIdx, selectionStart * (mConfig.getWaveLen() * mAudioEngine.getSampleRate() / mConfig.getNumChunks()) );
+        mAudioEngine.setSelectionStart( waveIdx, selectionStart );
+        sessionChanged();
     };
         break;
 
@@ -182,6 +256,26 @@ void CollidoscopeApp::keyDown( KeyEvent event )
         setFullScreen( !isFullScreen() );
         break;
 
+    case 'l':
+        mShowDspLoad = !mShowDspLoad;
+        break;
+
+    case 'n':
+        loadNextSample( waveIdx );
+        break;
+
+    case 'o':
+        mAudioEngine.overdub( waveIdx );
+        break;
+
+    case 'z':
+        mAudioEngine.undo( waveIdx );
+        break;
+
+    case 'y':
+        mAudioEngine.redo( waveIdx );
+        break;
+
     case ' ': { 
         static bool isOn = false;
         isOn = !isOn;
@@ -203,6 +297,7 @@ void CollidoscopeApp::keyDown( KeyEvent event )
 
         mAudioEngine.setGrainDurationCoeff( waveIdx, c );
         mWaves[waveIdx]->getSelection().setParticleSpread( float( c ) );
+        sessionChanged();
 
     }; break;
 
@@ -215,39 +310,176 @@ void CollidoscopeApp::keyDown( KeyEvent event )
 
         mAudioEngine.setGrainDurationCoeff( waveIdx, c );
         mWaves[waveIdx]->getSelection().setParticleSpread( float( c ) );
+        sessionChanged();
     }; break;
     }
 
 }
 
+void CollidoscopeApp::keyUp( KeyEvent event )
+{
+    const size_t waveIdx = 0;
+
+    if ( event.getChar() == 'r' && mConfig.isRecordHoldEnabled() ){
+        mRecordKeyDown = false;
+        mAudioEngine.finishRecord( waveIdx );
+    }
+}
+
+void CollidoscopeApp::fileDrop( FileDropEvent event )
+{
+    const size_t waveIdx = 0;
+
+    if ( event.getNumFiles() > 0 )
+        mAudioEngine.loadSample( waveIdx, event.getFile( 0 ) );
+}
+
+void CollidoscopeApp::loadNextSample( size_t waveIdx )
+{
+    vector< fs::path > samples;
+    try {
+        for ( fs::directory_iterator it( mConfig.getSampleLibraryDirectory() ), end; it != end; ++it ){
+            if ( fs::is_regular_file( it->path() ) )
+                samples.push_back( it->path() );
+        }
+    }
+    catch ( const fs::filesystem_error &e ){
+        logError( string( "Exception reading the sample library: " ) + e.what() );
+    }
+
+    if ( samples.empty() )
+        return;
+
+    sort( samples.begin(), samples.end() );
+    mSampleLibraryIndex = ( mSampleLibraryIndex + 1 ) % samples.size();
+    mAudioEngine.loadSample( waveIdx, samples[mSampleLibraryIndex] );
+}
+
+void CollidoscopeApp::setFilter( size_t waveIdx, double position )
+{
+    mAudioEngine.setFilterCutoff( waveIdx, getFilterCutoff( position ) );
+    showFilter( waveIdx, position );
+}
+
+void CollidoscopeApp::showFilter( size_t waveIdx, double position )
+{
+    mWaves[waveIdx]->setselectionAlpha( float( position ) );
+    mFilterPositions[waveIdx] = position;
+}
+
+double CollidoscopeApp::getFilterCutoff( double position )
+{
+    const double minCutoff = mConfig.getMinFilterCutoffFreq();
+    const double maxCutoff = mConfig.getMaxFilterCutoffFreq( mAudioEngine.getSampleRate() );
+    return pow( maxCutoff / minCutoff, position ) * minCutoff;
+}
+
+double CollidoscopeApp::getGrainDurationCoeff( unsigned char midiVal ) const
+{
+    return ci::lmap<double>( midiVal, 0.0, 127, 1.0, mConfig.getMaxGrainDurationCoeff() );
+}
+
+void CollidoscopeApp::restoreSession()
+{
+    SessionState state;
+    if ( !mSession->restore( state ) )
+        return;
+
+    for ( size_t i = 0; i < NUM_WAVES; i++ ){
+        const WaveSession &wave = state.waves[i];
+
+        // the chunks are drawn right away, the samples are played as soon as the sample loader hands them to the audio thread 
+        if ( wave.mappedSamples != nullptr ){
+            for ( size_t chunk = 0; chunk < mConfig.getNumChunks(); chunk++ )
+                mWaves[i]->setChunk( chunk, wave.mappedChunks[2 * chunk], wave.mappedChunks[2 * chunk + 1] );
+
+            mAudioEngine.restoreWave( i, wave.mappedSamples, wave.numMappedFrames, state.mapping );
+            mWaveRecorded[i] = true;
+        }
+
+        if ( wave.selectionSize > 0 ){
+            mWaves[i]->getSelection().setStart( wave.selectionStart );
+            mWaves[i]->getSelection().setSize( wave.selectionSize );
+            mAudioEngine.setSelectionStart( i, mWaves[i]->getSelection().getStart() );
+            mAudioEngine.setSelectionSize( i, mWaves[i]->getSelection().getSize() );
+        }
+
+        const double coeff = std::min( std::max( wave.durationCoeff, 1.0 ), mConfig.getMaxGrainDurationCoeff() );
+        mAudioEngine.setGrainDurationCoeff( i, coeff );
+        mWaves[i]->getSelection().setParticleSpread( float( coeff ) );
+
+        setFilter( i, wave.filter );
+    }
+}
+
+void CollidoscopeApp::sessionChanged()
+{
+    mSessionChanged = true;
+    mSessionChangeTime = getElapsedSeconds();
+}
+
+void CollidoscopeApp::saveSession()
+{
+    if ( !mSession || !mSessionChanged || getElapsedSeconds() - mSessionChangeTime < mConfig.getSessionSaveDelay() )
+        return;
+
+    SessionState state;
+    for ( size_t i = 0; i < NUM_WAVES; i++ ){
+        WaveSession &wave = state.waves[i];
+        const Wave::Selection &selection = mWaves[i]->getSelection();
+
+        wave.selectionStart = selection.getStart();
+        wave.selectionSize = selection.getSize();
+        wave.durationCoeff = selection.getParticleSpread();
+        wave.filter = mFilterPositions[i];
+        if ( mWaveRecorded[i] )
+            mAudioEngine.copyWave( i, wave.samples );
+    }
+
+    mSession->save( state );
+    mSessionChanged = false;
+}
+
 void CollidoscopeApp::update()
 {
     // check incoming commands 
     receiveCommands();
 
-    // check new wave chunks from recorder buffer 
-    for ( size_t i = 0; i < NUM_WAVES; i++ ){
-        size_t availableRead = mAudioEngine.getRecordWaveAvailable( i );
-        mAudioEngine.readRecordWave( i, mRecordWaveMessageBuffers[i], availableRead );
-
-        for ( size_t msgIndex = 0; msgIndex < availableRead; msgIndex++ ){
-            const RecordWaveMsg & msg = mRecordWaveMessageBuffers[i][msgIndex];
+    saveSession();
 
-            if ( msg.cmd == Command::WAVE_CHUNK ){
-                mWaves[i]->setChunk( msg.index, msg.arg1, msg.arg2 );
-            }
-            else if ( msg.cmd == Command::WAVE_START ){
+    // check new wave chunks from recorder queue, read in place 
+    for ( size_t i = 0; i < NUM_WAVES; i++ ){
+        const size_t numRead = mAudioEngine.getRecordWaveQueue( i ).consume( [this, i]( const RecordWaveMsg &msg ) {
+            if ( msg.cmd == Command::WAVE_START ){
                 mWaves[i]->reset( true ); // reset only chunks but leave selection 
             }
-            
-        }
+            else if ( msg.cmd == Command::WAVE_CHUNK && msg.index == mConfig.getNumChunks() - 1 ){
+                // the wave is complete: save it with the session 
+                mWaveRecorded[i] = true;
+                sessionChanged();
+            }
+            else if ( msg.cmd == Command::WAVE_SCROLL ){
+                // the live wave moved by a chunk: all the chunks are drawn again below 
+                mWaves[i]->reset( true );
+            }
+            else if ( msg.cmd == Command::WAVE_OVERDUB_CHUNK ){
+                // only the chunks overdubbed are sent, with their new min and max 
+                mWaves[i]->setChunk( msg.index, msg.arg1, msg.arg2 );
+                if ( msg.index == mConfig.getNumChunks() - 1 ){
+                    mWaveRecorded[i] = true;
+                    sessionChanged();
+                }
+            }
+        } );
+
+        // the chunks are drawn from the peak pyramid rather than from the messages, so the wave can have any number of chunks 
+        if ( numRead > 0 )
+            mWaves[i]->setChunks( mAudioEngine.getPeakPyramid( i ) );
     }
 
     // check if new cursors have been triggered 
     for ( size_t i = 0; i < NUM_WAVES; i++ ){
-        
-        mAudioEngine.checkCursorTriggers( i, mCursorTriggerMessagesBuffers[i] );
-        for ( auto & trigger : mCursorTriggerMessagesBuffers[i] ){
+        mAudioEngine.getCursorTriggerQueue( i ).consume( [this, i]( const CursorTriggerMsg &trigger ) {
             const int nodeID = trigger.synthID;
 
             switch ( trigger.cmd ){
@@ -263,9 +495,7 @@ void CollidoscopeApp::update()
                 break;
 
             }
-            
-        }
-        mCursorTriggerMessagesBuffers[i].clear();
+        } );
     }
 
     // update cursors 
@@ -284,7 +514,43 @@ void CollidoscopeApp::update()
         }
     }
 
-    
+    // DSP load 
+    DspLoadMeter &dspLoadMeter = mAudioEngine.getDspLoadMeter();
+    if ( mShowDspLoad ){
+        dspLoadMeter.getStats( mDspLoadStats );
+    }
+
+    const double dspLoadLogInterval = mConfig.getDspLoadLogInterval();
+    if ( dspLoadLogInterval > 0.0 && getElapsedSeconds() - mLastDspLoadLogTime >= dspLoadLogInterval ){
+        logStats( dspLoadMeter.toString() );
+        // worst cases are per log interval 
+        dspLoadMeter.resetWorstCases();
+        mLastDspLoadLogTime = getElapsedSeconds();
+    }
+
+    // messages pushed, dropped and waiting at most in the queues between the threads, counted since the start 
+    const double queueStatsLogInterval = mConfig.getQueueStatsLogInterval();
+    if ( queueStatsLogInterval > 0.0 && getElapsedSeconds() - mLastQueueStatsLogTime >= queueStatsLogInterval ){
+        logStats( mAudioEngine.queueStatsToString() );
+        mLastQueueStatsLogTime = getElapsedSeconds();
+    }
+
+    // record and finish commands dropped since the last frame, from any thread 
+    for ( size_t i = 0; i < NUM_WAVES; i++ ){
+        // the counter wraps around: the difference is taken in 32 bits 
+        const uint32_t numDropped = mAudioEngine.getRecordMsgStats( i ).numOverflows;
+        if ( numDropped != mDroppedRecordMsgs[i] ){
+            logError( "wave " + to_string( i ) + ": " + to_string( numDropped - mDroppedRecordMsgs[i] ) + " record commands dropped, the queue was full" );
+            mDroppedRecordMsgs[i] = numDropped;
+        }
+    }
+
+    // latency of the notes and the loop from the MIDI input to their first grain, hop by hop, counted since the start 
+    const double latencyLogInterval = mConfig.getLatencyLogInterval();
+    if ( latencyLogInterval > 0.0 && getElapsedSeconds() - mLastLatencyLogTime >= latencyLogInterval ){
+        logStats( mAudioEngine.getLatencyTracer().toString() );
+        mLastLatencyLogTime = getElapsedSeconds();
+    }
     
 }
 
@@ -309,6 +575,27 @@ void CollidoscopeApp::draw()
             mWaves[i]->draw( *mDrawInfos[i] );
         }
     }
+
+    if ( mShowDspLoad ){
+        drawDspLoad();
+    }
+}
+
+void CollidoscopeApp::drawDspLoad()
+{
+    const float lineHeight = 14.0f;
+    vec2 pos( 10.0f, 10.0f );
+
+    for ( const auto &slot : mDspLoadStats ){
+        const string line = slot.name + ": " + toString( int( slot.avgMicros ) ) + " us avg " 
+            + toString( int( slot.worstMicros ) ) + " us worst " 
+            + toString( int( slot.avgLoad * 100.0 ) ) + "%";
+
+        // anything taking more than half of the block is in red 
+        const ColorA color = slot.avgLoad > 0.5 ? ColorA( 1.0f, 0.2f, 0.2f, 1.0f ) : ColorA( 1.0f, 1.0f, 1.0f, 1.0f );
+        gl::drawString( line, pos, color );
+        pos.y += lineHeight;
+    }
 }
 
 void CollidoscopeApp::resize()
@@ -334,6 +621,7 @@ void CollidoscopeApp::receiveCommands()
     static std::vector<collidoscope::MIDIMessage> midiMessages;
     mMIDI.checkMessages( midiMessages );
 
+    const bool directMidi = mConfig.isDirectMidiEnabled();
 
     for ( auto &m : midiMessages ){
         
@@ -341,112 +629,143 @@ void CollidoscopeApp::receiveCommands()
         if ( waveIdx >= NUM_WAVES )
             continue;
 
-        if ( m.getVoice() == collidoscope::MIDIMessage::Voice::eNoteOn ){
-            int midiNote = m.getData_1();
-	    unsigned int velocity = m.getData_2();
-	    if(velocity == 0){
-		    mAudioEngine.noteOff( waveIdx, midiNote );
-	    }else{
-		    mAudioEngine.noteOn( waveIdx, midiNote );
-	    }
-
-        }
-        else if ( m.getVoice() == collidoscope::MIDIMessage::Voice::eNoteOff ){
-            int midiNote = m.getData_1();
-            mAudioEngine.noteOff( waveIdx, midiNote );
-        } 
-        else if ( m.getVoice() == collidoscope::MIDIMessage::Voice::ePitchBend ){
-            const uint16_t MSB = m.getData_2() << 7;
-            uint16_t value = m.getData_1(); // LSB 
-
-            value |= MSB;
-            
-
-            // value ranges from 0 to 149. check boundaries in case sensor gives bad values 
-            if ( value > 149 ){ // FIXME can use wave.size() 
-                continue;
-            }
-
-            size_t startChunk = value;
-
-            const size_t selectionSizeBeforeStartUpdate = mWaves[waveIdx]->getSelection().getSize();
-            mWaves[waveIdx]->getSelection().setStart( startChunk );
-
-            mAudioEngine.setSelectionStart( waveIdx, startChunk * (mConfig.getWaveLen() * mAudioEngine.getSampleRate() / mConfig.getNumChunks()) );
-            
-            const size_t newSelectionSize = mWaves[waveIdx]->getSelection().getSize();
-            if ( selectionSizeBeforeStartUpdate != newSelectionSize ){
-                mAudioEngine.setSelectionSize( waveIdx, newSelectionSize * (mConfig.getWaveLen() * mAudioEngine.getSampleRate() / mConfig.getNumChunks()) );
-            }
-
+        // with the direct path the audio engine already got the message from the MIDI thread: only the visuals are left 
+        if ( !directMidi )
+            dispatchMidiToAudio( m );
 
+        if ( m.getVoice() == collidoscope::MIDIMessage::Voice::ePitchBend ){
+            // the audio engine may have shrunk the selection to keep it in the wave 
+            showSelection( waveIdx );
+            sessionChanged();
         }
         else if ( m.getVoice() == collidoscope::MIDIMessage::Voice::eControlChange ){
 
             switch ( m.getData_1() ){ //controller number 
-            case 1: { // selection size 
-                const size_t midiVal = m.getData_2();
-                size_t numSelectionChunks = ci::lmap<size_t>( midiVal, 0, 127, 1, mConfig.getMaxSelectionNumChunks() );
-
-                mWaves[waveIdx]->getSelection().setSize( numSelectionChunks );
-
-                // how many samples in one selection ?
-                size_t selectionSize = mWaves[waveIdx]->getSelection().getSize() * (mConfig.getWaveLen() * mAudioEngine.getSampleRate() / mConfig.getNumChunks());
-                mAudioEngine.setSelectionSize( waveIdx, selectionSize );
-
-            };
+            case 1: // selection size 
+                showSelection( waveIdx );
+                sessionChanged();
                 break;
 
-            case 4: { // loop on off
-                unsigned char midiVal = m.getData_2();
-
-                if ( midiVal > 0 )
-                    mAudioEngine.loopOn( waveIdx );
-                else
-                    mAudioEngine.loopOff( waveIdx );
-            };
+            case 2: // duration 
+                mWaves[waveIdx]->getSelection().setParticleSpread( float( getGrainDurationCoeff( m.getData_2() ) ) );
+                sessionChanged();
                 break;
 
-            case 5: // trigger record
-                mAudioEngine.record( waveIdx );
+            case 7: // filter 
+                showFilter( waveIdx, m.getData_2() / 127.0 );
+                sessionChanged();
                 break;
+            }
+        }
+    }
 
-            case 2: { // duration 
-                const double midiVal = m.getData_2(); // 0-127
-                const double coeff = ci::lmap<double>( midiVal, 0.0, 127, 1.0, mConfig.getMaxGrainDurationCoeff() );
-                mAudioEngine.setGrainDurationCoeff( waveIdx, coeff );
-                mWaves[waveIdx]->getSelection().setParticleSpread( float( coeff ) );
-            };
-                break;
+    midiMessages.clear();
+}
 
-            case 7: { // filter 
-                const double midiVal = m.getData_2(); // 0-127
-                const double minCutoff = mConfig.getMinFilterCutoffFreq();
-                const double maxCutoff = mConfig.getMaxFilterCutoffFreq();
-                const double cutoff = pow( maxCutoff / 200., midiVal / 127.0 ) * minCutoff;
-                mAudioEngine.setFilterCutoff( waveIdx, cutoff );
-                const float alpha = ci::lmap<double>( midiVal, 0.0f, 127.0f, 0.f, 1.f );
-                mWaves[waveIdx]->setselectionAlpha( alpha );
-            };
-                break;
+void CollidoscopeApp::dispatchMidiToAudio( const collidoscope::MIDIMessage &m )
+{
+    const size_t waveIdx = mConfig.getWaveForMIDIChannel( m.getChannel() );
+    if ( waveIdx >= NUM_WAVES )
+        return;
 
+    if ( m.getVoice() == collidoscope::MIDIMessage::Voice::eNoteOn ){
+        int midiNote = m.getData_1();
+        unsigned int velocity = m.getData_2();
+        if ( velocity == 0 ){
+            mAudioEngine.noteOff( waveIdx, midiNote, m.getTimestamp() );
+        }
+        else{
+            mAudioEngine.noteOn( waveIdx, midiNote, m.getTimestamp() );
+        }
+    }
+    else if ( m.getVoice() == collidoscope::MIDIMessage::Voice::eNoteOff ){
+        int midiNote = m.getData_1();
+        mAudioEngine.noteOff( waveIdx, midiNote, m.getTimestamp() );
+    } 
+    else if ( m.getVoice() == collidoscope::MIDIMessage::Voice::ePitchBend ){
+        const uint16_t MSB = m.getData_2() << 7;
+        uint16_t value = m.getData_1(); // LSB 
+
+        value |= MSB;
+
+        // value ranges from 0 to 149. check boundaries in case sensor gives bad values 
+        if ( value > 149 ){ // FIXME can use wave.size() 
+            return;
+        }
 
-                
-            }
+        mAudioEngine.moveSelection( waveIdx, value );
+    }
+    else if ( m.getVoice() == collidoscope::MIDIMessage::Voice::eControlChange ){
+
+        switch ( m.getData_1() ){ //controller number 
+        case 1: { // selection size 
+            const size_t midiVal = m.getData_2();
+            size_t numSelectionChunks = ci::lmap<size_t>( midiVal, 0, 127, 1, mConfig.getMaxSelectionNumChunks() );
+            mAudioEngine.resizeSelection( waveIdx, numSelectionChunks );
+        };
+            break;
+
+        case 4: { // loop on off
+            unsigned char midiVal = m.getData_2();
+
+            if ( midiVal > 0 )
+                mAudioEngine.loopOn( waveIdx, m.getTimestamp() );
+            else
+                mAudioEngine.loopOff( waveIdx, m.getTimestamp() );
+        };
+            break;
+
+        case 5: // trigger record
+            // when the recording lasts as long as the button is held, the button sends 0 when released 
+            if ( mConfig.isRecordHoldEnabled() && m.getData_2() == 0 )
+                mAudioEngine.finishRecord( waveIdx );
+            else
+                mAudioEngine.record( waveIdx );
+            break;
+
+        case 6: // trigger overdub 
+            if ( m.getData_2() > 0 )
+                mAudioEngine.overdub( waveIdx );
+            break;
+
+        case 8: // undo 
+            if ( m.getData_2() > 0 )
+                mAudioEngine.undo( waveIdx );
+            break;
+
+        case 9: // redo 
+            if ( m.getData_2() > 0 )
+                mAudioEngine.redo( waveIdx );
+            break;
+
+        case 2: // duration 
+            mAudioEngine.setGrainDurationCoeff( waveIdx, getGrainDurationCoeff( m.getData_2() ) );
+            break;
+
+        case 7: // filter 
+            mAudioEngine.setFilterCutoff( waveIdx, getFilterCutoff( m.getData_2() / 127.0 ) );
+            break;
         }
     }
+}
 
-    midiMessages.clear();
+void CollidoscopeApp::showSelection( size_t waveIdx )
+{
+    size_t startChunk;
+    size_t numChunks;
+    mAudioEngine.getSelection( waveIdx, startChunk, numChunks );
+
+    // the wave shrinks the selection past its end as the audio engine does, so moving the start usually sets the size too 
+    Wave::Selection &selection = mWaves[waveIdx]->getSelection();
+    selection.setStart( startChunk );
+    if ( selection.getSize() != numChunks )
+        selection.setSize( numChunks );
 }
 
 
 
 CollidoscopeApp::~CollidoscopeApp()
 {
-    for ( int chan = 0; chan < NUM_WAVES; chan++ ){
-        /* delete the array for wave messages from audio thread */
-        delete[] mRecordWaveMessageBuffers[chan];
-    }
 }
 
 
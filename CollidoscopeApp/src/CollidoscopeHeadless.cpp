@@ -0,0 +1,417 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Runs the Collidoscope audio engine without jack, without a sound card and without graphics.
+ *
+ * The input is read from a WAV file ( or is silence ), the output is written to a WAV file ( or discarded ) and
+ * the graph is processed block after block as fast as the CPU allows. The performance is driven by a script of
+ * timed events, one per line:
+ *
+ *   # seconds  command          wave  value
+ *   0.0        record           0
+ *   1.5        finish_record    0               ( ends the recording before the wave length )
+ *   2.1        selection_start  0     40      ( in chunks )
+ *   2.1        selection_size   0     10      ( in chunks )
+ *   2.2        loop_on          0
+ *   3.0        note_on          0     64      ( MIDI note )
+ *   4.0        note_off         0     64
+ *   5.0        duration         0     4.0     ( grain duration coefficient )
+ *   5.0        filter           0     2000    ( cutoff frequency in Hz )
+ *   6.0        loop_off         0
+ *   6.5        overdub          0               ( mixes the input in the wave )
+ *   8.0        undo             0               ( plays the previous version of the wave )
+ *   8.5        redo             0
+ *
+ * Events are applied at the start of the block they fall into, but for record and finish_record that take effect on their exact frame. 
+ * At the end the time spent in each node is printed.
+ *
+ * --frames-per-block and --sample-rate take a comma separated list of values, e.g. 64,128,256,512,1024,2048 or 44100,96000,192000:
+ * the same script is run once for each combination, to benchmark the engine across the range of jack period sizes and sample rates.
+ * When more than one sample rate is given, the time spent in the granular synths ( the voices ) at each rate is compared
+ * to the first rate, so that one can check it grows in proportion to the sample rate.
+ *
+ * --grain-benchmark voices runs no script: it plays a wave with that many granular synths, all the grains overlapping, 
+ * once reading the float samples and once reading the 16 bits copy ( see GrainStorage ). It prints how many grains 
+ * one core can play in real time with each storage, and how far the 16 bits output is from the float output.
+ *
+ * usage: CollidoscopeHeadless [--script events.txt] [--input in.wav] [--output out.wav] [--seconds length]
+ *                             [--sample-rate rate[,rate...]] [--frames-per-block frames[,frames...]] [--grain-benchmark voices]
+ */
+
+#include "AudioEngine.h"
+#include "ContextHeadless.h"
+#include "Config.h"
+#include "PGranular.h"
+#include "Simd.h"
+
+#include "cinder/Exception.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+struct ScriptEvent
+{
+    double seconds;
+    std::string command;
+    size_t wave;
+    double value;
+};
+
+/* Reads the script at path. Returns false and prints the offending line if the script is malformed */
+bool loadScript( const std::string &path, std::vector<ScriptEvent> &events )
+{
+    std::ifstream file( path );
+    if ( !file ){
+        std::cerr << "cannot open script " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    size_t lineNum = 0;
+    while ( std::getline( file, line ) ){
+        lineNum++;
+
+        line = line.substr( 0, line.find( '#' ) );
+        std::istringstream ss( line );
+
+        ScriptEvent event;
+        event.value = 0.0;
+
+        if ( !( ss >> event.seconds ) )
+            continue; // empty line or comment
+
+        if ( !( ss >> event.command >> event.wave ) || event.wave >= NUM_WAVES || event.seconds < 0.0 ){
+            std::cerr << path << ":" << lineNum << ": malformed event" << std::endl;
+            return false;
+        }
+
+        ss >> event.value;
+        events.push_back( event );
+    }
+
+    std::stable_sort( events.begin(), events.end(), []( const ScriptEvent &a, const ScriptEvent &b ) { return a.seconds < b.seconds; } );
+    return true;
+}
+
+/* Sends the event, due at frame, to the audio engine, the same way the app does with keyboard and MIDI input */
+bool applyEvent( const ScriptEvent &event, uint64_t frame, AudioEngine &audioEngine )
+{
+    if ( event.command == "record" )
+        audioEngine.record( event.wave, frame );
+    else if ( event.command == "finish_record" )
+        audioEngine.finishRecord( event.wave, frame );
+    else if ( event.command == "overdub" )
+        audioEngine.overdub( event.wave );
+    else if ( event.command == "undo" )
+        audioEngine.undo( event.wave );
+    else if ( event.command == "redo" )
+        audioEngine.redo( event.wave );
+    else if ( event.command == "loop_on" )
+        audioEngine.loopOn( event.wave );
+    else if ( event.command == "loop_off" )
+        audioEngine.loopOff( event.wave );
+    else if ( event.command == "note_on" )
+        audioEngine.noteOn( event.wave, int( event.value ) );
+    else if ( event.command == "note_off" )
+        audioEngine.noteOff( event.wave, int( event.value ) );
+    else if ( event.command == "selection_start" )
+        audioEngine.setSelectionStart( event.wave, size_t( event.value ) );
+    else if ( event.command == "selection_size" )
+        audioEngine.setSelectionSize( event.wave, size_t( event.value ) );
+    else if ( event.command == "duration" )
+        audioEngine.setGrainDurationCoeff( event.wave, event.value );
+    else if ( event.command == "filter" )
+        audioEngine.setFilterCutoff( event.wave, event.value );
+    else
+        return false;
+
+    return true;
+}
+
+/* Parses a comma separated list of sizes */
+std::vector<size_t> parseList( const std::string &list )
+{
+    std::vector<size_t> values;
+    std::istringstream ss( list );
+    for ( std::string value; std::getline( ss, value, ',' ); ){
+        values.push_back( std::stoul( value ) );
+    }
+    return values;
+}
+
+/* 
+ * Runs the whole script once with blocks of framesPerBlock frames at sampleRate and prints the statistics. 
+ * granularLoad is set to the time spent in the granular synths over the length of the audio processed. 
+ * Returns false if the engine cannot be set up 
+ */
+bool run( std::map<std::string, std::string> &args, const std::vector<ScriptEvent> &events, size_t sampleRate, size_t framesPerBlock, double seconds, double &granularLoad )
+{
+    Config config;
+
+    const size_t numBlocks = size_t( std::ceil( seconds * sampleRate / framesPerBlock ) );
+
+    auto ctx = ContextHeadless::create( sampleRate, framesPerBlock );
+    auto inputNode = ctx->createInputFileNode();
+
+    AudioEngine audioEngine;
+    DspLoadMeter &meter = audioEngine.getDspLoadMeter();
+    const size_t blockSlot = meter.addSlot( "block" );
+
+    try {
+        if ( args.count( "--input" ) )
+            inputNode->loadFile( args["--input"] );
+
+        if ( args.count( "--output" ) )
+            ctx->getHeadlessOutput()->setOutputFile( args["--output"] );
+
+        audioEngine.setup( config, ctx.get(), inputNode );
+    }
+    catch ( const ci::Exception &e ){
+        std::cerr << "cannot set up the audio engine: " << e.what() << std::endl;
+        return false;
+    }
+
+    size_t numRecordWaveMessages = 0;
+    size_t numCursorTriggers = 0;
+    size_t nextEvent = 0;
+
+    const uint64_t runStart = DspLoadMeter::now();
+
+    for ( size_t block = 0; block < numBlocks; block++ ){
+        const size_t blockEnd = ( block + 1 ) * framesPerBlock;
+
+        for ( ; nextEvent < events.size() && size_t( std::round( events[nextEvent].seconds * sampleRate ) ) < blockEnd; nextEvent++ ){
+            const uint64_t eventFrame = uint64_t( std::round( events[nextEvent].seconds * sampleRate ) );
+            if ( !applyEvent( events[nextEvent], eventFrame, audioEngine ) )
+                std::cerr << "unknown command " << events[nextEvent].command << std::endl;
+        }
+
+        {
+            DspLoadMeter::Scope loadScope( &meter, blockSlot );
+            ctx->processBlock();
+        }
+
+        // drain the queues as the graphic thread would
+        for ( size_t i = 0; i < NUM_WAVES; i++ ){
+            numRecordWaveMessages += audioEngine.getRecordWaveQueue( i ).consume( []( const RecordWaveMsg & ) {} );
+            numCursorTriggers += audioEngine.getCursorTriggerQueue( i ).consume( []( const CursorTriggerMsg & ) {} );
+        }
+    }
+
+    const double wallSeconds = ( DspLoadMeter::now() - runStart ) / 1e9;
+    const double audioSeconds = double( numBlocks * framesPerBlock ) / sampleRate;
+
+    ctx->disable();
+
+    std::cout << "processed " << audioSeconds << " s of audio in " << wallSeconds << " s ( "
+        << ( wallSeconds > 0.0 ? audioSeconds / wallSeconds : 0.0 ) << "x real time, "
+        << ( wallSeconds * 1e9 / ( numBlocks * framesPerBlock ) ) << " ns per frame ), "
+        << sampleRate << " Hz, " << framesPerBlock << " frames per block" << std::endl;
+    std::cout << "chunk messages: " << numRecordWaveMessages << ", cursor triggers: " << numCursorTriggers << std::endl;
+    for ( size_t i = 0; i < NUM_WAVES; i++ ){
+        if ( audioEngine.getNumPageMisses( i ) > 0 )
+            std::cout << "wave " << i << ": " << audioEngine.getNumPageMisses( i ) << " grains read a page not resident" << std::endl;
+    }
+    std::cout << meter.toString() << std::endl;
+    std::cout << audioEngine.queueStatsToString() << std::endl;
+    // the script events are not stamped at the input: only the hops from the dispatch are traced 
+    std::cout << audioEngine.getLatencyTracer().toString() << std::endl;
+
+    // rolling average time per block of all the granular nodes, in proportion to the duration of a block 
+    std::vector<DspLoadMeter::SlotStats> stats;
+    meter.getStats( stats );
+    granularLoad = 0.0;
+    for ( const auto &slot : stats ){
+        if ( slot.name.find( "granular" ) != std::string::npos )
+            granularLoad += slot.avgMicros * 1e-6 * sampleRate / framesPerBlock;
+    }
+
+    return true;
+}
+
+/* Random offset of the grains with a fixed seed, so that the runs with each storage play the same grains */
+struct BenchmarkRand
+{
+    BenchmarkRand( size_t max ) : mState( 1 ), mMax( max ) {}
+
+    size_t operator()()
+    {
+        mState = mState * 1664525u + 1013904223u;
+        return mState % mMax;
+    }
+
+    uint32_t mState;
+    size_t mMax;
+};
+
+struct BenchmarkTrigger
+{
+    void operator()( char, int ) {}
+};
+
+/* 
+ * Plays numVoices granular synths over a wave for the given seconds, reading compactWave if not nullptr, else wave. 
+ * The output is appended to output. Returns the CPU time in seconds, and sets aliveGrains to the average number of grains playing 
+ */
+double runGrains( const std::vector<float> &wave, const int16_t *compactWave, size_t sampleRate, size_t framesPerBlock, double seconds, 
+    size_t numVoices, std::vector<float> &output, double &aliveGrains )
+{
+    typedef collidoscope::PGranular<float, BenchmarkRand, BenchmarkTrigger> Granular;
+
+    BenchmarkRand rand( size_t( 0.01 * sampleRate ) + 1 );
+    BenchmarkTrigger trigger;
+
+    // each voice plays a different part of the wave at a different pitch, with as many grains overlapping as possible 
+    std::vector<std::unique_ptr<Granular>> voices;
+    for ( size_t i = 0; i < numVoices; i++ ){
+        voices.emplace_back( new Granular( wave.data(), wave.size(), sampleRate, rand, trigger, int( i ) ) );
+        voices.back()->setBuffer( wave.data(), wave.size(), 0, 0, compactWave );
+        voices.back()->setGrainsDurationCoeff( 8.0 );
+        voices.back()->setSelectionSize( wave.size() / 8 );
+        voices.back()->setSelectionStart( i * wave.size() / numVoices );
+        voices.back()->noteOn( std::pow( 2.0, ( int( i % 12 ) - 6 ) / 12.0 ) );
+    }
+
+    const size_t numBlocks = size_t( std::ceil( seconds * sampleRate / framesPerBlock ) );
+    std::vector<float> block( framesPerBlock );
+    std::vector<float> temp( framesPerBlock );
+    uint64_t cpuTime = 0;
+    size_t aliveGrainsSum = 0;
+
+    for ( size_t b = 0; b < numBlocks; b++ ){
+        std::fill( block.begin(), block.end(), 0.0f );
+
+        const uint64_t start = DspLoadMeter::now();
+        for ( auto &voice : voices )
+            voice->process( block.data(), temp.data(), framesPerBlock );
+        cpuTime += DspLoadMeter::now() - start;
+
+        for ( auto &voice : voices )
+            aliveGrainsSum += voice->getNumAliveGrains();
+        output.insert( output.end(), block.begin(), block.end() );
+    }
+
+    aliveGrains = double( aliveGrainsSum ) / numBlocks;
+    return cpuTime / 1e9;
+}
+
+/* Compares the granular synthesis reading the float samples and the 16 bits samples of the same wave */
+void benchmarkGrainStorage( size_t sampleRate, size_t framesPerBlock, double seconds, size_t numVoices )
+{
+    // a wave as long as a recording, with a spread spectrum: a sweep plus a little noise 
+    const size_t waveLen = size_t( Config().getWaveLen() * sampleRate );
+    std::vector<float> wave( waveLen );
+    BenchmarkRand noise( 1000 );
+    for ( size_t i = 0; i < waveLen; i++ ){
+        const double t = double( i ) / sampleRate;
+        wave[i] = float( 0.7 * std::sin( 2.0 * M_PI * ( 100.0 * t + 1000.0 * t * t ) ) + 0.0002 * ( double( noise() ) - 500.0 ) );
+    }
+
+    std::vector<int16_t> compactWave( waveLen );
+    simd::toInt16( wave.data(), compactWave.data(), waveLen, kInt16FullScale );
+
+    std::vector<float> floatOutput;
+    std::vector<float> compactOutput;
+    double floatGrains = 0.0;
+    double compactGrains = 0.0;
+    const double floatTime = runGrains( wave, nullptr, sampleRate, framesPerBlock, seconds, numVoices, floatOutput, floatGrains );
+    const double compactTime = runGrains( wave, compactWave.data(), sampleRate, framesPerBlock, seconds, numVoices, compactOutput, compactGrains );
+
+    // grains one core can play in real time: the grains playing, times how much faster than real time they were played 
+    const double audioSeconds = double( floatOutput.size() ) / sampleRate;
+    std::cout << numVoices << " voices, " << sampleRate << " Hz, " << framesPerBlock << " frames per block, wave of " << waveLen * sizeof( float ) / 1024 
+        << " KB in float" << std::endl;
+    std::cout << "float: " << floatGrains << " grains playing, " << floatGrains * audioSeconds / floatTime << " grains per core" << std::endl;
+    std::cout << "int16: " << compactGrains << " grains playing, " << compactGrains * audioSeconds / compactTime << " grains per core" << std::endl;
+
+    double signal = 0.0;
+    double error = 0.0;
+    double maxError = 0.0;
+    for ( size_t i = 0; i < floatOutput.size(); i++ ){
+        const double diff = double( compactOutput[i] ) - floatOutput[i];
+        signal += double( floatOutput[i] ) * floatOutput[i];
+        error += diff * diff;
+        maxError = std::max( maxError, std::abs( diff ) );
+    }
+
+    std::cout << "int16 accuracy: signal to error ratio " << ( error > 0.0 ? 10.0 * std::log10( signal / error ) : INFINITY ) << " dB, max error " 
+        << maxError << " ( " << ( maxError > 0.0 ? 20.0 * std::log10( maxError ) : -INFINITY ) << " dBFS )" << std::endl;
+}
+
+int main( int argc, char *argv[] )
+{
+    std::map<std::string, std::string> args;
+    for ( int i = 1; i + 1 < argc; i += 2 ){
+        args[argv[i]] = argv[i + 1];
+    }
+
+    const std::vector<size_t> sampleRates = parseList( args.count( "--sample-rate" ) ? args["--sample-rate"] : "44100" );
+    const std::vector<size_t> blockSizes = parseList( args.count( "--frames-per-block" ) ? args["--frames-per-block"] : "512" );
+
+    if ( sampleRates.size() * blockSizes.size() > 1 && args.count( "--output" ) ){
+        std::cerr << "--output can only be used with one block size and one sample rate" << std::endl;
+        return 1;
+    }
+
+    std::vector<ScriptEvent> events;
+    if ( args.count( "--script" ) && !loadScript( args["--script"], events ) )
+        return 1;
+
+    // by default run until one second after the last event
+    double seconds = events.empty() ? Config().getWaveLen() : events.back().seconds + 1.0;
+    if ( args.count( "--seconds" ) )
+        seconds = std::stod( args["--seconds"] );
+
+    if ( args.count( "--grain-benchmark" ) ){
+        benchmarkGrainStorage( sampleRates.front(), blockSizes.front(), seconds, std::stoul( args["--grain-benchmark"] ) );
+        return 0;
+    }
+
+    for ( size_t framesPerBlock : blockSizes ){
+        double referenceLoad = 0.0;
+
+        for ( size_t sampleRate : sampleRates ){
+            double granularLoad = 0.0;
+            if ( !run( args, events, sampleRate, framesPerBlock, seconds, granularLoad ) )
+                return 1;
+
+            if ( sampleRate == sampleRates.front() ){
+                referenceLoad = granularLoad;
+            }
+            else if ( referenceLoad > 0.0 ){
+                std::cout << "granular load at " << sampleRate << " Hz is " << granularLoad / referenceLoad << " times the load at " 
+                    << sampleRates.front() << " Hz ( sample rate ratio " << double( sampleRate ) / sampleRates.front() << " )" << std::endl;
+            }
+        }
+    }
+
+    return 0;
+}
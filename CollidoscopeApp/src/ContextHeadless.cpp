@@ -0,0 +1,140 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ContextHeadless.h"
+#include "cinder/audio/Source.h"
+#include "cinder/audio/Exception.h"
+#include "cinder/DataSource.h"
+
+#include <algorithm>
+#include <cstring>
+
+#define NUM_CHANNELS 2
+
+using namespace ci::audio;
+
+
+// ------------------------------------------ InputNodeFile ------------------------------------------------
+
+InputNodeFile::InputNodeFile( const Format &format ) :
+    InputNode( format ),
+    mReadPos( 0 )
+{
+}
+
+void InputNodeFile::loadFile( const ci::fs::path &path )
+{
+    auto sourceFile = load( ci::loadFile( path ), getContext()->getSampleRate() );
+
+    mSourceBuffer = sourceFile->loadBuffer();
+    mReadPos = 0;
+}
+
+// Called when the output node pulls all the inputs. Copies the next frames of the file in the node buffer
+void InputNodeFile::process( Buffer *buffer )
+{
+    const size_t numFrames = buffer->getNumFrames();
+
+    if ( !mSourceBuffer || mReadPos >= mSourceBuffer->getNumFrames() ){
+        buffer->zero();
+        return;
+    }
+
+    const size_t framesToCopy = std::min( numFrames, mSourceBuffer->getNumFrames() - mReadPos );
+    const size_t sourceChannels = mSourceBuffer->getNumChannels();
+
+    for ( size_t chan = 0; chan < buffer->getNumChannels(); chan++ ){
+        // mono files go to all the channels
+        const float *source = mSourceBuffer->getChannel( std::min( chan, sourceChannels - 1 ) ) + mReadPos;
+        float *dest = buffer->getChannel( chan );
+
+        std::memcpy( dest, source, framesToCopy * sizeof( float ) );
+        // end of the file reached in the middle of the block
+        std::fill( dest + framesToCopy, dest + numFrames, 0.0f );
+    }
+
+    mReadPos += framesToCopy;
+}
+
+
+// ------------------------------------------ OutputNodeHeadless ------------------------------------------------
+
+OutputNodeHeadless::OutputNodeHeadless( const Format &format, size_t sampleRate, size_t framesPerBlock ) :
+    OutputNode( format ),
+    mSampleRate( sampleRate ),
+    mFramesPerBlock( framesPerBlock )
+{
+}
+
+void OutputNodeHeadless::setOutputFile( const ci::fs::path &path )
+{
+    mTargetFile = TargetFile::create( path, mSampleRate, NUM_CHANNELS, SampleType::FLOAT_32 );
+}
+
+void OutputNodeHeadless::render()
+{
+    auto ctx = getContext();
+    if ( !ctx )
+        return;
+
+    std::lock_guard<std::mutex> lock( ctx->getMutex() );
+
+    Buffer *internalBuffer = getInternalBuffer();
+    internalBuffer->zero();
+
+    ctx->preProcess();
+    // process the whole audio graph by recursively pulling the input all the way to the top of the graph
+    pullInputs( internalBuffer );
+
+    if ( mTargetFile )
+        mTargetFile->write( internalBuffer );
+
+    ctx->postProcess();
+}
+
+
+// ------------------------------------------ ContextHeadless ------------------------------------------------
+
+std::shared_ptr<ContextHeadless> ContextHeadless::create( size_t sampleRate, size_t framesPerBlock )
+{
+    std::shared_ptr<ContextHeadless> ctx( new ContextHeadless() );
+
+    // the output node is made here rather than in the constructor, as makeNode() needs a shared_ptr to the context
+    ctx->mOutputNode = ctx->makeNode( new OutputNodeHeadless( Node::Format().channels( NUM_CHANNELS ), sampleRate, framesPerBlock ) );
+    ctx->setOutput( ctx->mOutputNode );
+
+    return ctx;
+}
+
+OutputDeviceNodeRef ContextHeadless::createOutputDeviceNode( const DeviceRef &device, const Node::Format &format )
+{
+    throw AudioContextExc( "no output device available in a headless context" );
+}
+
+InputDeviceNodeRef ContextHeadless::createInputDeviceNode( const DeviceRef &device, const Node::Format &format )
+{
+    throw AudioContextExc( "no input device available in a headless context" );
+}
+
+std::shared_ptr<InputNodeFile> ContextHeadless::createInputFileNode()
+{
+    return makeNode( new InputNodeFile( Node::Format().channels( NUM_CHANNELS ) ) );
+}
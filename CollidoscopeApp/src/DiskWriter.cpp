@@ -0,0 +1,189 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "DiskWriter.h"
+#include "Log.h"
+
+#include "cinder/audio/Exception.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+namespace {
+    // frames written to the file at a time
+    const size_t kStagingFrames = 4096;
+    // how long the writer thread sleeps when the ring is empty
+    const std::chrono::milliseconds kPollInterval( 20 );
+}
+
+
+DiskWriter::DiskWriter( const ci::fs::path &directory, const std::string &prefix, const std::string &extension, size_t sampleRate, size_t capacityFrames ) :
+    mDirectory( directory ),
+    mPrefix( prefix ),
+    mExtension( extension ),
+    mSampleRate( sampleRate ),
+    mRing( ( capacityFrames + kSubBlockFrames - 1 ) / kSubBlockFrames ),
+    mStagingBuffer( kStagingFrames, 1 ),
+    mStagingFrames( 0 ),
+    mFileCounter( 0 ),
+    mRunning( true ),
+    mNumOverruns( 0 ),
+    mNumFilesWritten( 0 )
+{
+    mThread = std::thread( &DiskWriter::run, this );
+}
+
+DiskWriter::~DiskWriter()
+{
+    mRunning = false;
+    mThread.join();
+}
+
+void DiskWriter::push( const Block &block )
+{
+    if ( !mRing.write( &block, 1 ) )
+        mNumOverruns.fetch_add( 1, std::memory_order_relaxed );
+}
+
+void DiskWriter::beginFile()
+{
+    Block block;
+    block.type = BlockType::eBegin;
+    block.numFrames = 0;
+    push( block );
+}
+
+void DiskWriter::write( const float *data, size_t numFrames )
+{
+    Block block;
+    block.type = BlockType::eData;
+
+    for ( size_t offset = 0; offset < numFrames; offset += kSubBlockFrames ){
+        block.numFrames = uint32_t( std::min( kSubBlockFrames, numFrames - offset ) );
+        std::memcpy( block.data, data + offset, block.numFrames * sizeof( float ) );
+        push( block );
+    }
+}
+
+void DiskWriter::endFile()
+{
+    Block block;
+    block.type = BlockType::eEnd;
+    block.numFrames = 0;
+    push( block );
+}
+
+void DiskWriter::run()
+{
+#ifdef __linux__
+    // the writer can wait: leave the CPU to the graphics ( jack runs in its own real time thread anyway )
+    setpriority( PRIO_PROCESS, 0, 10 );
+#endif
+
+    Block block;
+
+    // when stopped, drain what is left in the ring before quitting
+    for ( ;; ){
+        if ( mRing.getAvailableRead() == 0 ){
+            if ( !mRunning )
+                break;
+
+            std::this_thread::sleep_for( kPollInterval );
+            continue;
+        }
+
+        mRing.read( &block, 1 );
+
+        switch ( block.type ){
+        case BlockType::eBegin:
+            closeFile();
+            openFile();
+            break;
+
+        case BlockType::eData:
+            if ( !mTargetFile )
+                break; // no file open, or it could not be created
+
+            std::memcpy( mStagingBuffer.getData() + mStagingFrames, block.data, block.numFrames * sizeof( float ) );
+            mStagingFrames += block.numFrames;
+            if ( mStagingFrames + kSubBlockFrames > kStagingFrames )
+                flush();
+            break;
+
+        case BlockType::eEnd:
+            closeFile();
+            break;
+        }
+    }
+
+    closeFile();
+}
+
+void DiskWriter::openFile()
+{
+    char date[32];
+    const std::time_t now = std::time( nullptr );
+    std::strftime( date, sizeof( date ), "%Y%m%d-%H%M%S", std::localtime( &now ) );
+
+    std::ostringstream fileName;
+    fileName << mPrefix << "-" << date << "-" << mFileCounter++ << "." << mExtension;
+
+    try {
+        mTargetFile = ci::audio::TargetFile::create( mDirectory / fileName.str(), mSampleRate, 1, ci::audio::SampleType::INT_16 );
+    }
+    catch ( const ci::audio::AudioFileExc &e ){
+        logError( std::string( "cannot create recording file " ) + ( mDirectory / fileName.str() ).string() + ": " + e.what() );
+        mTargetFile.reset();
+    }
+}
+
+void DiskWriter::closeFile()
+{
+    flush();
+    if ( !mTargetFile )
+        return;
+
+    // the file header is finalized when the target is destroyed
+    mTargetFile.reset();
+    mNumFilesWritten.fetch_add( 1, std::memory_order_relaxed );
+}
+
+void DiskWriter::flush()
+{
+    if ( mTargetFile && mStagingFrames > 0 ){
+        try {
+            mTargetFile->write( &mStagingBuffer, mStagingFrames );
+        }
+        catch ( const ci::audio::AudioFileExc &e ){
+            logError( std::string( "cannot write recording file: " ) + e.what() );
+            mTargetFile.reset();
+        }
+    }
+
+    mStagingFrames = 0;
+}
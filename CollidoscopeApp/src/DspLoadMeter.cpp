@@ -0,0 +1,99 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "DspLoadMeter.h"
+
+#include <sstream>
+#include <iomanip>
+
+
+DspLoadMeter::DspLoadMeter() :
+    mNumSlots( 0 ),
+    mBlockBudgetNanos( 0 )
+{
+}
+
+size_t DspLoadMeter::addSlot( const std::string &name )
+{
+    const size_t slot = mNumSlots;
+    if ( slot >= kMaxSlots )
+        return kNoSlot;
+
+    mSlots[slot].name = name;
+    mNumSlots = slot + 1;
+
+    return slot;
+}
+
+void DspLoadMeter::setBlockBudget( size_t framesPerBlock, size_t sampleRate )
+{
+    if ( sampleRate == 0 )
+        return;
+
+    mBlockBudgetNanos = uint32_t( ( 1e9 * framesPerBlock ) / sampleRate );
+}
+
+void DspLoadMeter::getStats( std::vector<SlotStats> &stats ) const
+{
+    const size_t numSlots = mNumSlots;
+    const double budget = mBlockBudgetNanos;
+
+    stats.resize( numSlots );
+
+    for ( size_t i = 0; i < numSlots; i++ ){
+        const Slot &s = mSlots[i];
+        SlotStats &out = stats[i];
+
+        const double avg = s.avg.load( std::memory_order_relaxed );
+
+        out.name = s.name;
+        out.lastMicros = s.last.load( std::memory_order_relaxed ) / 1000.0;
+        out.avgMicros = avg / 1000.0;
+        out.worstMicros = s.worst.load( std::memory_order_relaxed ) / 1000.0;
+        out.avgLoad = budget > 0 ? avg / budget : 0.0;
+    }
+}
+
+void DspLoadMeter::resetWorstCases()
+{
+    const size_t numSlots = mNumSlots;
+    for ( size_t i = 0; i < numSlots; i++ ){
+        mSlots[i].worst.store( 0, std::memory_order_relaxed );
+    }
+}
+
+std::string DspLoadMeter::toString() const
+{
+    std::vector<SlotStats> stats;
+    getStats( stats );
+
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision( 1 ) << "DSP load (us avg/worst, % of block):";
+
+    for ( const auto &s : stats ){
+        ss << " " << s.name << " " << s.avgMicros << "/" << s.worstMicros << " " << ( s.avgLoad * 100.0 ) << "%";
+    }
+
+    return ss.str();
+}
+
+
+const double DspLoadMeter::kAvgCoeff = 1.0 / 64.0;
@@ -0,0 +1,89 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "LatencyTracer.h"
+
+#include <sstream>
+#include <iomanip>
+
+
+namespace {
+    const char *const kHopNames[LatencyTracer::kNumHops] = { "input>dispatch", "dispatch>dequeue", "dequeue>rendered", "input>rendered" };
+
+    // upper bound of the bucket where the \a fraction of the \a count times is reached 
+    double percentileMicros( const std::array<uint32_t, LatencyTracer::kNumBuckets> &buckets, uint32_t count, double fraction )
+    {
+        const double target = fraction * count;
+        uint32_t sum = 0;
+        for ( size_t i = 0; i < buckets.size(); i++ ){
+            sum += buckets[i];
+            if ( sum > 0 && sum >= target )
+                return LatencyTracer::getBucketMicros( i );
+        }
+        return 0.0;
+    }
+}
+
+
+LatencyTracer::LatencyTracer()
+{
+}
+
+void LatencyTracer::getStats( std::vector<HopStats> &stats ) const
+{
+    stats.resize( kNumHops );
+
+    for ( size_t i = 0; i < kNumHops; i++ ){
+        const Histogram &h = mHistograms[i];
+        HopStats &out = stats[i];
+
+        out.name = kHopNames[i];
+        out.maxMicros = h.max.load( std::memory_order_relaxed ) / 1000.0;
+
+        out.count = 0;
+        for ( size_t b = 0; b < kNumBuckets; b++ ){
+            out.buckets[b] = h.buckets[b].load( std::memory_order_relaxed );
+            out.count += out.buckets[b];
+        }
+
+        out.p50Micros = percentileMicros( out.buckets, out.count, 0.5 );
+        out.p99Micros = percentileMicros( out.buckets, out.count, 0.99 );
+    }
+}
+
+std::string LatencyTracer::toString() const
+{
+    std::vector<HopStats> stats;
+    getStats( stats );
+
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision( 1 ) << "latency (us, p50 and p99 are bucket bounds, count per bucket bound):";
+
+    for ( const auto &s : stats ){
+        ss << "\n  " << s.name << " n " << s.count << " p50 " << s.p50Micros << " p99 " << s.p99Micros << " max " << s.maxMicros << " |";
+        for ( size_t b = 0; b < kNumBuckets; b++ ){
+            if ( s.buckets[b] > 0 )
+                ss << " <" << uint32_t( getBucketMicros( b ) ) << ":" << s.buckets[b];
+        }
+    }
+
+    return ss.str();
+}
@@ -55,3 +55,15 @@ void logInfo( const std::string &infoMsg )
     log->write( logMeta, infoMsg );
 #endif
 }
+
+void logStats( const std::string &statsMsg )
+{
+    using namespace ci::log;
+
+    LogManager *log = LogManager::instance();
+
+    Metadata logMeta;
+    logMeta.mLevel = LEVEL_INFO;
+
+    log->write( logMeta, statsMsg );
+}
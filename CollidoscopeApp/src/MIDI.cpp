@@ -21,6 +21,7 @@
 
 #include "MIDI.h"
 #include "Config.h"
+#include "DspLoadMeter.h"
 
 
 collidoscope::MIDI::MIDI()
@@ -37,10 +38,19 @@ collidoscope::MIDI::~MIDI()
 
 void collidoscope::MIDI::RtMidiInCallback( double deltatime, std::vector<unsigned char> *message, void *userData )
 {
+    // stamped before waiting for the lock, that is part of the latency to the graphic thread 
+    const uint64_t timestamp = DspLoadMeter::now();
+
     collidoscope::MIDI* midi = ((collidoscope::MIDI*)userData);
-    std::lock_guard< std::mutex > lock( midi->mMutex );
 
     MIDIMessage msg = midi->parseRtMidiMessage( message );
+    msg.mTimestamp = timestamp;
+
+    // the audio engine gets the message right away, the graphic thread gets a copy for the visuals at its next frame 
+    if ( midi->mDirectCallback && msg.getVoice() != MIDIMessage::Voice::eIgnore )
+        midi->mDirectCallback( msg );
+
+    std::lock_guard< std::mutex > lock( midi->mMutex );
 
     switch ( msg.getVoice() ){
     case MIDIMessage::Voice::ePitchBend:
@@ -0,0 +1,115 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "MappedFile.h"
+
+#include <cstdint>
+
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+std::shared_ptr<void> mapFile( const ci::fs::path &path, size_t &size )
+{
+#ifdef _WIN32
+    // no mmap: read the whole file instead
+    std::ifstream file( path.string(), std::ios::binary | std::ios::ate );
+    if ( !file )
+        return nullptr;
+
+    size = size_t( file.tellg() );
+    std::shared_ptr<void> data( new char[size], []( void *p ) { delete[] static_cast<char*>( p ); } );
+    file.seekg( 0 );
+    if ( size == 0 || !file.read( static_cast<char*>( data.get() ), size ) )
+        return nullptr;
+
+    return data;
+#else
+    const int fd = open( path.c_str(), O_RDONLY );
+    if ( fd < 0 )
+        return nullptr;
+
+    struct stat fileStat;
+    if ( fstat( fd, &fileStat ) != 0 || fileStat.st_size == 0 ){
+        close( fd );
+        return nullptr;
+    }
+
+    size = size_t( fileStat.st_size );
+    void *data = mmap( nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+    // the mapping stays valid after the file is closed
+    close( fd );
+
+    if ( data == MAP_FAILED )
+        return nullptr;
+
+    return std::shared_ptr<void>( data, [size]( void *p ) { munmap( p, size ); } );
+#endif
+}
+
+void prefetchMapping( void *data, size_t size )
+{
+#ifndef _WIN32
+    madvise( data, size, MADV_WILLNEED );
+#endif
+}
+
+void releaseMapping( const void *data, size_t size )
+{
+#ifndef _WIN32
+    // the pages partly in the range are kept 
+    const uintptr_t pageSize = uintptr_t( sysconf( _SC_PAGESIZE ) );
+    const uintptr_t begin = ( uintptr_t( data ) + pageSize - 1 ) / pageSize * pageSize;
+    const uintptr_t end = ( uintptr_t( data ) + size ) / pageSize * pageSize;
+    if ( begin < end )
+        madvise( reinterpret_cast<void*>( begin ), end - begin, MADV_DONTNEED );
+#endif
+}
+
+void protectMapping( void *data, size_t size )
+{
+#ifndef _WIN32
+    // pinning a writable private mapping would copy all its pages, which then could never be dropped again
+    mprotect( data, size, PROT_READ );
+#endif
+}
+
+bool lockMapping( const void *data, size_t size )
+{
+#ifdef _WIN32
+    return false;
+#else
+    return mlock( data, size ) == 0;
+#endif
+}
+
+void unlockMapping( const void *data, size_t size )
+{
+#ifndef _WIN32
+    munlock( data, size );
+#endif
+}
@@ -20,11 +20,15 @@
 */
 
 #include "PGranularNode.h"
+#include "PagedWave.h"
 
 #include "cinder/audio/Context.h"
 
 #include "cinder/Rand.h"
 
+#include <algorithm>
+#include <cmath>
+
 // generate random numbers from 0 to max 
 // it's passed to PGranular to randomize the phase offset at grain creation 
 struct RandomGenerator
@@ -41,60 +45,234 @@ struct RandomGenerator
 };
 // FIXME maybe use only one random gen 
 
-PGranularNode::PGranularNode( ci::audio::Buffer *grainBuffer, CursorTriggerMsgRingBuffer &triggerRingBuffer ) :
+// maximum random offset of the grains start, in seconds. Converted in samples in initialize() 
+const double kMaxGrainsRandomOffsetSeconds = 0.01;
+// how far the start of a grain can move to a zero crossing or to an onset, in seconds 
+const double kMaxZeroCrossingSnapSeconds = 0.005;
+const double kMaxOnsetSnapSeconds = 0.05;
+
+// pages the grains read a paged wave through, or nullptr 
+static const PagedWave::Page* pagesOf( const GrainBuffer &grainBuffer )
+{
+    return grainBuffer.paged != nullptr ? grainBuffer.paged->getPages() : nullptr;
+}
+
+PGranularNode::PGranularNode( const AtomicGrainBuffer &grainBuffer, CursorTriggerMsgQueue &triggerQueue, size_t numChunks, size_t noteQueueSize ) :
     Node( Format().channels( 1 ) ),
     mGrainBuffer(grainBuffer),
-    mSelectionStart( 0 ),
-    mSelectionSize( 0 ),
+    mGrainBufferCrossfadeTime( 0.0 ),
+    mGrainBufferCrossfadeLen( 0 ),
+    mLiveDelayTime( 0.0 ),
+    mLiveDelayLen( 0 ),
+    mWaveIndex( nullptr ),
+    mSnapMode( SnapMode::eOff ),
+    mNumChunks( numChunks ),
+    mSelection( 0 ),
+    mSelectionSizeChunks( 0 ),
+    mSelectionStartChunk( 0 ),
     mGrainDurationCoeff( 1 ),
-    mTriggerRingBuffer( triggerRingBuffer ),
-    mNoteMsgRingBufferPack( 128 )
+    mTriggerQueue( triggerQueue ),
+    mNoteQueue( noteQueueSize ),
+    mSilent( true ),
+    mLoadMeter( nullptr ),
+    mLoadMeterSlot( DspLoadMeter::kNoSlot ),
+    mLatencyTracer( nullptr ),
+    mDequeueTime( 0 ),
+    mPrefetchBegin( 0 ),
+    mPrefetchNumFrames( 0 ),
+    mNumPageMisses( 0 )
 {
     for ( int i = 0; i < kMaxVoices; i++ ){
         mMidiNotes[i] = kNoMidiNote;
 
     }
+
+    for ( auto &trace : mPendingTraces )
+        trace = { 0, 0 };
 }
 
 
 PGranularNode::~PGranularNode()
 {
+    delete mWaveIndex.load();
 }
 
 void PGranularNode::initialize()
 {
-    mTempBuffer = std::make_shared< ci::audio::Buffer >( getFramesPerBlock() );
+    // the envelope of the PGranulars is computed one sub-block at a time 
+    mTempBuffer = std::make_shared< ci::audio::Buffer >( kSubBlockFrames );
 
-    mRandomOffset.reset( new RandomGenerator( getSampleRate() / 100 ) ); // divided by 100 corresponds to multiplied by 0.01 in the time domain 
+    mRandomOffset.reset( new RandomGenerator( size_t( std::lround( kMaxGrainsRandomOffsetSeconds * getSampleRate() ) ) ) );
+
+    mCurrentGrainBuffer = *mGrainBuffer.load( std::memory_order_acquire );
+    mGrainBufferCrossfadeLen = size_t( std::lround( mGrainBufferCrossfadeTime * getSampleRate() ) );
+    // at least one sample, so that the grains never read the one being written 
+    mLiveDelayLen = std::max<size_t>( std::lround( mLiveDelayTime * getSampleRate() ), 1 );
+    const size_t liveDelay = mCurrentGrainBuffer.live != nullptr ? mLiveDelayLen : 0;
 
     /* create the PGranular object for looping */
-    mPGranularLoop.reset( new collidoscope::PGranular<float, RandomGenerator, PGranularNode>( mGrainBuffer->getData(), mGrainBuffer->getNumFrames(), getSampleRate(), *mRandomOffset, *this, -1 ) );
+    mPGranularLoop.reset( new collidoscope::PGranular<float, RandomGenerator, PGranularNode>( mCurrentGrainBuffer.data, mCurrentGrainBuffer.numFrames, getSampleRate(), *mRandomOffset, *this, -1 ) );
+    mPGranularLoop->setBuffer( mCurrentGrainBuffer.data, mCurrentGrainBuffer.numFrames, mCurrentGrainBuffer.offset, 0, mCurrentGrainBuffer.data16, 
+        pagesOf( mCurrentGrainBuffer ), PagedWave::kPageShift );
+    mPGranularLoop->setLiveDelay( liveDelay );
 
     /* create the PGranular object for notes */
     for ( size_t i = 0; i < kMaxVoices; i++ ){
-        mPGranularNotes[i].reset( new collidoscope::PGranular<float, RandomGenerator, PGranularNode>( mGrainBuffer->getData(), mGrainBuffer->getNumFrames(), getSampleRate(), *mRandomOffset, *this, i ) );
+        mPGranularNotes[i].reset( new collidoscope::PGranular<float, RandomGenerator, PGranularNode>( mCurrentGrainBuffer.data, mCurrentGrainBuffer.numFrames, getSampleRate(), *mRandomOffset, *this, i ) );
+        mPGranularNotes[i]->setBuffer( mCurrentGrainBuffer.data, mCurrentGrainBuffer.numFrames, mCurrentGrainBuffer.offset, 0, mCurrentGrainBuffer.data16,
+            pagesOf( mCurrentGrainBuffer ), PagedWave::kPageShift );
+        mPGranularNotes[i]->setLiveDelay( liveDelay );
     }
 
 }
 
 void PGranularNode::process (ci::audio::Buffer *buffer )
 {
-    // only update PGranular if the atomic value has changed from the previous time
-    const boost::optional<size_t> selectionSize = mSelectionSize.get();
-    if ( selectionSize ){
-        mPGranularLoop->setSelectionSize( *selectionSize );
+    DspLoadMeter::Scope loadScope( mLoadMeter, mLoadMeterSlot );
+
+    updateGrainBuffer();
+    if ( mCurrentGrainBuffer.live != nullptr )
+        updateLiveOffset();
+    updateSnapPoints();
+
+    /* buffer is one channel only so I can use getData */
+    float *audioOut = buffer->getData();
+    bool silent = true;
+
+    // control data is read before each sub-block, so that its resolution is the same whatever the jack period 
+    forEachSubBlock( buffer->getNumFrames(), [this, audioOut, &silent]( size_t offset, size_t numFrames ) {
+        updateControls();
+
+        if ( !processSubBlock( audioOut + offset, numFrames ) )
+            silent = false;
+    } );
+
+    mSilent = silent;
+
+    if ( mCurrentGrainBuffer.paged != nullptr )
+        updatePrefetchWindow();
+}
+
+void PGranularNode::updateGrainBuffer()
+{
+    const GrainBuffer &grainBuffer = *mGrainBuffer.load( std::memory_order_acquire );
+    if ( grainBuffer == mCurrentGrainBuffer )
+        return;
+
+    const bool lengthChanged = ( grainBuffer.numFrames != mCurrentGrainBuffer.numFrames );
+    mCurrentGrainBuffer = grainBuffer;
+    const size_t liveDelay = grainBuffer.live != nullptr ? mLiveDelayLen : 0;
+
+    // this happens at the start of a block, so all the PGranulars switch buffer at the same time 
+    mPGranularLoop->setBuffer( grainBuffer.data, grainBuffer.numFrames, grainBuffer.offset, mGrainBufferCrossfadeLen, grainBuffer.data16, 
+        pagesOf( grainBuffer ), PagedWave::kPageShift );
+    mPGranularLoop->setLiveDelay( liveDelay );
+    for ( size_t i = 0; i < kMaxVoices; i++ ){
+        mPGranularNotes[i]->setBuffer( grainBuffer.data, grainBuffer.numFrames, grainBuffer.offset, mGrainBufferCrossfadeLen, grainBuffer.data16,
+            pagesOf( grainBuffer ), PagedWave::kPageShift );
+        mPGranularNotes[i]->setLiveDelay( liveDelay );
+    }
+
+    // the same chunks span a different number of samples. A selection size never set leaves the PGranulars silent 
+    if ( lengthChanged )
+        updateSelection( mSelectionSizeChunks > 0, true );
+}
+
+void PGranularNode::updateLiveOffset()
+{
+    // the recorder publishes the write head after writing each sub-block. The grains that are playing keep their position 
+    // in the buffer, so they move away from the write head only as fast as their rate differs from 1 
+    const size_t offset = mCurrentGrainBuffer.live->load( std::memory_order_acquire );
+    mPGranularLoop->setBufferOffset( offset );
+    for ( size_t i = 0; i < kMaxVoices; i++ ){
+        mPGranularNotes[i]->setBufferOffset( offset );
+    }
+}
+
+void PGranularNode::updateSnapPoints()
+{
+    if ( mSnapMode == SnapMode::eOff )
+        return;
+
+    // the index of a previous wave, or of a wave not played anymore, is of no use 
+    const WaveIndex *index = mWaveIndex.load( std::memory_order_acquire );
+    if ( index != nullptr && index->grainBuffer != mCurrentGrainBuffer )
+        index = nullptr;
+
+    const uint32_t *points = nullptr;
+    size_t numPoints = 0;
+    double maxDistance = 0.0;
+
+    if ( index != nullptr && mSnapMode == SnapMode::eZeroCrossings ){
+        points = index->zeroCrossings.data();
+        numPoints = index->zeroCrossings.size();
+        maxDistance = kMaxZeroCrossingSnapSeconds;
+    }
+    else if ( index != nullptr && mSnapMode == SnapMode::eOnsets ){
+        points = index->onsets.data();
+        numPoints = index->onsets.size();
+        maxDistance = kMaxOnsetSnapSeconds;
+    }
+
+    // set at each block, as the analyzer frees the previous indexes a while after replacing them 
+    const size_t maxDistanceFrames = size_t( std::lround( maxDistance * getSampleRate() ) );
+    mPGranularLoop->setSnapPoints( points, numPoints, maxDistanceFrames );
+    for ( size_t i = 0; i < kMaxVoices; i++ ){
+        mPGranularNotes[i]->setSnapPoints( points, numPoints, maxDistanceFrames );
+    }
+}
+
+void PGranularNode::updateSelection( bool updateSize, bool updateStart )
+{
+    const size_t waveLen = mCurrentGrainBuffer.numFrames;
+
+    if ( updateSize ){
+        const size_t selectionSize = mSelectionSizeChunks * waveLen / mNumChunks;
+        mPGranularLoop->setSelectionSize( selectionSize );
         for ( size_t i = 0; i < kMaxVoices; i++ ){
-            mPGranularNotes[i]->setSelectionSize( *selectionSize );
+            mPGranularNotes[i]->setSelectionSize( selectionSize );
         }
     }
 
-    const boost::optional<size_t> selectionStart = mSelectionStart.get();
-    if ( selectionStart ){
-        mPGranularLoop->setSelectionStart( *selectionStart );
+    if ( updateStart ){
+        const size_t selectionStart = mSelectionStartChunk * waveLen / mNumChunks;
+        mPGranularLoop->setSelectionStart( selectionStart );
         for ( size_t i = 0; i < kMaxVoices; i++ ){
-            mPGranularNotes[i]->setSelectionStart( *selectionStart );
+            mPGranularNotes[i]->setSelectionStart( selectionStart );
         }
     }
+}
+
+void PGranularNode::updatePrefetchWindow()
+{
+    // the grains start from the selection start, plus the random offset, and read as far as their duration at their rate. 
+    // The voices keep the rate of their last note 
+    size_t reach = mPGranularLoop->getGrainsReach();
+    size_t numPageMisses = mPGranularLoop->getNumPageMisses();
+    for ( size_t i = 0; i < kMaxVoices; i++ ){
+        reach = std::max( reach, mPGranularNotes[i]->getGrainsReach() );
+        numPageMisses += mPGranularNotes[i]->getNumPageMisses();
+    }
+
+    mPrefetchBegin.store( mSelectionStartChunk * mCurrentGrainBuffer.numFrames / mNumChunks, std::memory_order_relaxed );
+    mPrefetchNumFrames.store( reach + mRandomOffset->mMax, std::memory_order_relaxed );
+    mNumPageMisses.store( numPageMisses, std::memory_order_relaxed );
+}
+
+void PGranularNode::updateControls()
+{
+    // only update PGranular if the atomic value has changed from the previous time
+    const boost::optional<uint32_t> selection = mSelection.get();
+    if ( selection ){
+        const size_t sizeChunks = selectionSizeOf( *selection );
+        const size_t startChunk = selectionStartOf( *selection );
+        const bool sizeChanged = ( sizeChunks != mSelectionSizeChunks );
+        const bool startChanged = ( startChunk != mSelectionStartChunk );
+
+        mSelectionSizeChunks = sizeChunks;
+        mSelectionStartChunk = startChunk;
+        updateSelection( sizeChanged, startChanged );
+    }
 
     const boost::optional<double> grainDurationCoeff = mGrainDurationCoeff.get();
     if ( grainDurationCoeff ){
@@ -104,17 +282,19 @@ void PGranularNode::process (ci::audio::Buffer *buffer )
         }
     }
 
-    // check messages to start/stop notes or loop 
-    size_t availableRead = mNoteMsgRingBufferPack.getBuffer().getAvailableRead();
-    mNoteMsgRingBufferPack.getBuffer().read( mNoteMsgRingBufferPack.getExchangeArray(), availableRead );
-    for ( size_t i = 0; i < availableRead; i++ ){
-        handleNoteMsg( mNoteMsgRingBufferPack.getExchangeArray()[i] );
-    }
+    // check messages to start/stop notes or loop, read in place. The first message read stamps the dequeue time of all of them 
+    mDequeueTime = 0;
+    mNoteQueue.consume( [this]( const NoteMsg &msg ) { handleNoteMsg( msg ); } );
+}
+
+bool PGranularNode::processSubBlock( float *audioOut, size_t numFrames )
+{
+    // if nothing was playing and no note started, the output stays silent and there is nothing to process 
+    bool silent = mPGranularLoop->isIdle();
 
     // process loop if not idle 
     if ( !mPGranularLoop->isIdle() ){
-        /* buffer is one channel only so I can use getData */
-        mPGranularLoop->process( buffer->getData(), mTempBuffer->getData(), buffer->getSize() );
+        mPGranularLoop->process( audioOut, mTempBuffer->getData(), numFrames );
     }
 
     // process notes if not idle 
@@ -122,7 +302,8 @@ void PGranularNode::process (ci::audio::Buffer *buffer )
         if ( mPGranularNotes[i]->isIdle() )
             continue;
 
-        mPGranularNotes[i]->process( buffer->getData(), mTempBuffer->getData(), buffer->getSize() );
+        silent = false;
+        mPGranularNotes[i]->process( audioOut, mTempBuffer->getData(), numFrames );
 
         if ( mPGranularNotes[i]->isIdle() ){
             // this note became idle so update mMidiNotes
@@ -130,21 +311,42 @@ void PGranularNode::process (ci::audio::Buffer *buffer )
         }
             
     }
+
+    return silent;
+}
+
+void PGranularNode::startTrace( size_t voice, const NoteMsg &msg )
+{
+    if ( mLatencyTracer != nullptr && msg.dispatchTime != 0 )
+        mPendingTraces[voice] = { msg.inputTime, mDequeueTime };
 }
 
 // Called back when new PGranular is triggered or turned off. Sends notification message to graphic thread.
 void PGranularNode::operator()( char msgType, int ID ) {
 
+    // the loop calls back with ID -1 
+    PendingTrace &trace = mPendingTraces[ID < 0 ? kMaxVoices : size_t( ID )];
+
     switch ( msgType ){
     case 't':  { // trigger 
         CursorTriggerMsg msg = makeCursorTriggerMsg( Command::TRIGGER_UPDATE, ID ); // put ID 
-        mTriggerRingBuffer.write( &msg, 1 );
+        mTriggerQueue.push( msg );
+
+        // called at the end of the sub-block where the grain started: the stamp includes rendering the whole sub-block 
+        if ( trace.dequeueTime != 0 ){
+            const uint64_t now = DspLoadMeter::now();
+            mLatencyTracer->recordSince( LatencyTracer::Hop::eDequeueToRender, trace.dequeueTime, now );
+            mLatencyTracer->recordSince( LatencyTracer::Hop::eInputToRender, trace.inputTime, now );
+            trace = { 0, 0 };
+        }
     };
         break;
 
     case 'e': // end envelope 
         CursorTriggerMsg msg = makeCursorTriggerMsg( Command::TRIGGER_END, ID ); // put ID 
-        mTriggerRingBuffer.write( &msg, 1 );
+        mTriggerQueue.push( msg );
+        // released before any grain: nothing was heard 
+        trace = { 0, 0 };
         break;
     }
 
@@ -153,6 +355,12 @@ void PGranularNode::operator()( char msgType, int ID ) {
 
 void PGranularNode::handleNoteMsg( const NoteMsg &msg )
 {
+    if ( mLatencyTracer != nullptr ){
+        if ( mDequeueTime == 0 )
+            mDequeueTime = DspLoadMeter::now();
+        mLatencyTracer->recordSince( LatencyTracer::Hop::eDispatchToDequeue, msg.dispatchTime, mDequeueTime );
+    }
+
     switch ( msg.cmd ){
     case Command::NOTE_ON: {
         bool synthFound = false;
@@ -171,6 +379,7 @@ void PGranularNode::handleNoteMsg( const NoteMsg &msg )
             for ( int i = 0; i < kMaxVoices; i++ ){
 
                 if ( mMidiNotes[i] == kNoMidiNote ){
+                    startTrace( i, msg );
                     mPGranularNotes[i]->noteOn( msg.rate );
                     mMidiNotes[i] = msg.midiNote;
                     synthFound = true;
@@ -192,6 +401,9 @@ void PGranularNode::handleNoteMsg( const NoteMsg &msg )
         break;
 
     case Command::LOOP_ON: {
+        // a loop already playing goes on with its grains 
+        if ( mPGranularLoop->isIdle() )
+            startTrace( kMaxVoices, msg );
         mPGranularLoop->noteOn( 1.0 );
     };
         break;
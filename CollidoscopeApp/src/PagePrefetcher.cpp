@@ -0,0 +1,81 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#include "PagePrefetcher.h"
+#include "PagedWave.h"
+
+#include <chrono>
+
+
+namespace {
+
+    // how often the windows are checked. A page takes this long at most to be prefetched after the selection moves
+    const std::chrono::milliseconds kPollInterval( 10 );
+}
+
+
+PagePrefetcher::PagePrefetcher() :
+    mRunning( true )
+{
+    mThread = std::thread( &PagePrefetcher::run, this );
+}
+
+PagePrefetcher::~PagePrefetcher()
+{
+    {
+        std::lock_guard<std::mutex> lock( mMutex );
+        mRunning = false;
+    }
+    mCondition.notify_one();
+    mThread.join();
+}
+
+void PagePrefetcher::addWave( const BufferToWaveRecorderNodeRef &recorder, const PGranularNodeRef &granular )
+{
+    std::lock_guard<std::mutex> lock( mMutex );
+
+    Wave wave;
+    wave.recorder = recorder;
+    wave.granular = granular;
+    mWaves.push_back( wave );
+}
+
+void PagePrefetcher::run()
+{
+    std::unique_lock<std::mutex> lock( mMutex );
+
+    while ( !mCondition.wait_for( lock, kPollInterval, [this] { return !mRunning; } ) ){
+        for ( auto &wave : mWaves ){
+            // a loaded wave is freed a while after being replaced, much later than this prefetch is over. 
+            // The window can still be the one of the previous wave for a block: it only prefetches the wrong pages once
+            const GrainBuffer grainBuffer = *wave.recorder->getGrainBuffer().load( std::memory_order_acquire );
+            if ( grainBuffer.paged == nullptr )
+                continue;
+
+            size_t begin = 0;
+            size_t numFrames = 0;
+            wave.granular->getPrefetchWindow( begin, numFrames );
+            grainBuffer.paged->prefetch( grainBuffer.offset + begin, numFrames );
+        }
+    }
+}
@@ -0,0 +1,158 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "PagedWave.h"
+#include "Log.h"
+#include "MappedFile.h"
+
+#include <algorithm>
+
+
+namespace {
+
+    // pages made resident per call to prefetch(), so that a jump of the selection doesn't hold the prefetcher for long
+    const size_t kMaxPagesPerPrefetch = 16;
+    // a page not needed anymore is withdrawn after this time, when the grains triggered before can't be reading it anymore
+    const std::chrono::seconds kLingerDelay( 1 );
+    // bytes between two reads when a page is read in without pinning it
+    const size_t kTouchStride = 4096;
+}
+
+
+PagedWave::PagedWave( const float *data, size_t numFrames ) :
+    mData( data ),
+    mNumFrames( numFrames ),
+    mPages( ( numFrames + kPageFrames - 1 ) / kPageFrames ),
+    mStates( mPages.size(), PageState::eOut ),
+    mPinned( mPages.size(), false ),
+    mLingerSince( mPages.size() ),
+    mNeeded( mPages.size(), false ),
+    mPinningFailed( false )
+{
+    for ( auto &page : mPages )
+        page.store( nullptr, std::memory_order_relaxed );
+}
+
+PagedWave::~PagedWave()
+{
+    for ( size_t page = 0; page < mPages.size(); page++ )
+        unpin( page );
+}
+
+void PagedWave::prefetch( size_t begin, size_t numFrames )
+{
+    const size_t numPages = mPages.size();
+    if ( numPages == 0 )
+        return;
+
+    // the window plus one page on each side, for the grains snapped before the selection start or reading past the window
+    begin %= mNumFrames;
+    const size_t firstPage = begin >> kPageShift;
+    const size_t numNeeded = std::min( numPages, ( ( begin + numFrames ) >> kPageShift ) - firstPage + 3 );
+
+    std::fill( mNeeded.begin(), mNeeded.end(), false );
+    for ( size_t i = 0; i < numNeeded; i++ )
+        mNeeded[( firstPage + numPages - 1 + i ) % numPages] = true;
+
+    const auto now = std::chrono::steady_clock::now();
+    size_t numPinned = 0;
+
+    for ( size_t page = 0; page < numPages; page++ ){
+        switch ( mStates[page] ){
+        case PageState::eOut:
+            if ( mNeeded[page] && numPinned < kMaxPagesPerPrefetch ){
+                pin( page );
+                numPinned++;
+            }
+            break;
+
+        case PageState::eResident:
+            if ( !mNeeded[page] ){
+                mStates[page] = PageState::eLingering;
+                mLingerSince[page] = now;
+            }
+            break;
+
+        case PageState::eLingering:
+            if ( mNeeded[page] ){
+                mStates[page] = PageState::eResident;
+            }
+            else if ( now - mLingerSince[page] >= kLingerDelay ){
+                mPages[page].store( nullptr, std::memory_order_release );
+                mStates[page] = PageState::eWithdrawn;
+            }
+            break;
+
+        case PageState::eWithdrawn:
+            if ( mNeeded[page] ){
+                mPages[page].store( mData + ( page << kPageShift ), std::memory_order_release );
+                mStates[page] = PageState::eResident;
+            }
+            else{
+                // withdrawn at the previous call: the audio thread only holds a page for the duration of a block
+                unpin( page );
+                mStates[page] = PageState::eOut;
+            }
+            break;
+        }
+    }
+}
+
+size_t PagedWave::getNumResidentPages() const
+{
+    return size_t( std::count_if( mStates.begin(), mStates.end(), []( PageState state ) { 
+        return state == PageState::eResident || state == PageState::eLingering; } ) );
+}
+
+void PagedWave::pin( size_t page )
+{
+    const float *pageData = mData + ( page << kPageShift );
+    const size_t size = std::min( kPageFrames, mNumFrames - ( page << kPageShift ) ) * sizeof( float );
+
+    if ( !mPinningFailed ){
+        mPinned[page] = lockMapping( pageData, size );
+        if ( !mPinned[page] ){
+            logError( "cannot pin the pages of a long wave in memory: raise the memory lock limit ( ulimit -l ) to avoid dropouts" );
+            mPinningFailed = true;
+        }
+    }
+
+    if ( !mPinned[page] ){
+        // read the page in now rather than in the audio thread
+        const volatile char *bytes = reinterpret_cast<const volatile char*>( pageData );
+        for ( size_t offset = 0; offset < size; offset += kTouchStride )
+            (void)bytes[offset];
+    }
+
+    mPages[page].store( pageData, std::memory_order_release );
+    mStates[page] = PageState::eResident;
+}
+
+void PagedWave::unpin( size_t page )
+{
+    if ( !mPinned[page] )
+        return;
+
+    const size_t size = std::min( kPageFrames, mNumFrames - ( page << kPageShift ) ) * sizeof( float );
+    unlockMapping( mData + ( page << kPageShift ), size );
+    mPinned[page] = false;
+}
@@ -0,0 +1,211 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "PeakPyramid.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+const std::size_t PeakPyramid::kLeafFrames;
+
+namespace {
+    const PeakPyramid::Peak kSilence = { 0.0f, 0.0f, 0.0f };
+}
+
+
+PeakPyramid::PeakPyramid() :
+    mCapacity( 0 ),
+    mLength( 0 ),
+    mNumFrames( 0 ),
+    mOrigin( 0 )
+{
+}
+
+void PeakPyramid::setCapacity( std::size_t numFrames )
+{
+    mCapacity = numFrames;
+    mLength = numFrames;
+    mNumFrames = 0;
+    mOrigin = 0;
+
+    mLevels.clear();
+    mLevels.push_back( 0 );
+
+    // each level has half the nodes of the level below, rounded up, down to a level with one node
+    std::size_t levelSize = ( numFrames + kLeafFrames - 1 ) / kLeafFrames;
+    while ( levelSize > 0 ){
+        mLevels.push_back( mLevels.back() + levelSize );
+        if ( levelSize == 1 )
+            break;
+        levelSize = ( levelSize + 1 ) / 2;
+    }
+
+    const Node empty = { 0.0f, 0.0f, 0.0f, 0 };
+    mNodes.assign( mLevels.back(), empty );
+}
+
+std::size_t PeakPyramid::getMemorySize( std::size_t numFrames )
+{
+    // the levels of setCapacity()
+    std::size_t numNodes = 0;
+    std::size_t levelSize = ( numFrames + kLeafFrames - 1 ) / kLeafFrames;
+    while ( levelSize > 0 ){
+        numNodes += levelSize;
+        if ( levelSize == 1 )
+            break;
+        levelSize = ( levelSize + 1 ) / 2;
+    }
+
+    return numNodes * sizeof( Node );
+}
+
+PeakPyramid::Node PeakPyramid::combine( const Node &lhs, const Node &rhs )
+{
+    if ( lhs.numFrames == 0 )
+        return rhs;
+    if ( rhs.numFrames == 0 )
+        return lhs;
+
+    Node node;
+    node.min = std::min( lhs.min, rhs.min );
+    node.max = std::max( lhs.max, rhs.max );
+    node.sumSquares = lhs.sumSquares + rhs.sumSquares;
+    node.numFrames = lhs.numFrames + rhs.numFrames;
+    return node;
+}
+
+void PeakPyramid::update( const float *data, std::size_t offset, std::size_t begin, std::size_t end )
+{
+    end = std::min( end, mCapacity );
+    if ( begin >= end )
+        return;
+
+    recompute( data, offset, begin, end );
+    mNumFrames.store( end, std::memory_order_release );
+}
+
+void PeakPyramid::refresh( const float *data, std::size_t offset, std::size_t begin, std::size_t end )
+{
+    end = std::min( end, mCapacity );
+    if ( begin >= end )
+        return;
+
+    // the range is extended to the frames already summarized: down to them if it starts past them, 
+    // and up to them in the last leaf, so that none is dropped 
+    const std::size_t numFrames = std::max( end, getNumFrames() );
+    begin = std::min( begin, getNumFrames() );
+    recompute( data, offset, begin, std::min( ( ( end - 1 ) / kLeafFrames + 1 ) * kLeafFrames, numFrames ) );
+    mNumFrames.store( numFrames, std::memory_order_release );
+}
+
+void PeakPyramid::recompute( const float *data, std::size_t offset, std::size_t begin, std::size_t end )
+{
+    std::size_t firstNode = begin / kLeafFrames;
+    std::size_t lastNode = ( end - 1 ) / kLeafFrames;
+
+    // leaves
+    for ( std::size_t leaf = firstNode; leaf <= lastNode; leaf++ ){
+        const std::size_t leafEnd = std::min( ( leaf + 1 ) * kLeafFrames, end );
+        std::size_t pos = ( offset + leaf * kLeafFrames ) % mCapacity;
+
+        Node node = { std::numeric_limits<float>::max(), std::numeric_limits<float>::lowest(), 0.0f, leafEnd - leaf * kLeafFrames };
+        for ( std::size_t i = 0; i < node.numFrames; i++ ){
+            const float sample = data[pos];
+            node.min = std::min( node.min, sample );
+            node.max = std::max( node.max, sample );
+            node.sumSquares += sample * sample;
+
+            if ( ++pos == mCapacity )
+                pos = 0;
+        }
+
+        mNodes[leaf] = node;
+    }
+
+    // ancestors of the leaves, one level at a time
+    for ( std::size_t level = 1; level + 1 < mLevels.size(); level++ ){
+        firstNode /= 2;
+        lastNode /= 2;
+
+        const std::size_t childLevel = mLevels[level - 1];
+        const std::size_t childLevelSize = mLevels[level] - childLevel;
+
+        for ( std::size_t i = firstNode; i <= lastNode; i++ ){
+            const Node &left = mNodes[childLevel + 2 * i];
+            // the last node of a level with an odd number of nodes has only one child
+            mNodes[mLevels[level] + i] = 2 * i + 1 < childLevelSize ? combine( left, mNodes[childLevel + 2 * i + 1] ) : left;
+        }
+    }
+}
+
+PeakPyramid::Peak PeakPyramid::getPeak( std::size_t begin, std::size_t end ) const
+{
+    Node peak;
+    const std::size_t origin = mOrigin.load( std::memory_order_acquire );
+
+    if ( origin == 0 ){
+        peak = sum( begin, end );
+    }
+    else{
+        // the wave starts at the origin and wraps around the end of the summary: the range is split in two at most 
+        begin = std::min( begin, mCapacity ) + origin;
+        end = std::min( end, mCapacity ) + origin;
+        peak = combine( sum( std::min( begin, mCapacity ), std::min( end, mCapacity ) ),
+            sum( begin > mCapacity ? begin - mCapacity : 0, end > mCapacity ? end - mCapacity : 0 ) );
+    }
+
+    if ( peak.numFrames == 0 )
+        return kSilence;
+
+    Peak result;
+    result.min = peak.min;
+    result.max = peak.max;
+    result.rms = std::sqrt( peak.sumSquares / peak.numFrames );
+    return result;
+}
+
+PeakPyramid::Node PeakPyramid::sum( std::size_t begin, std::size_t end ) const
+{
+    Node peak = { 0.0f, 0.0f, 0.0f, 0 };
+
+    end = std::min( end, getNumFrames() );
+    if ( begin >= end )
+        return peak;
+
+    // walk up the levels from the leaves, taking the nodes at the edges of the range that don't share the parent with a node in the range
+    std::size_t first = begin / kLeafFrames;
+    std::size_t last = ( end + kLeafFrames - 1 ) / kLeafFrames; // one past the last
+
+    for ( std::size_t level = 0; level + 1 < mLevels.size() && first < last; level++ ){
+        const std::size_t levelStart = mLevels[level];
+
+        if ( first & 1 )
+            peak = combine( peak, mNodes[levelStart + first++] );
+        if ( last & 1 )
+            peak = combine( peak, mNodes[levelStart + --last] );
+
+        first /= 2;
+        last /= 2;
+    }
+
+    return peak;
+}
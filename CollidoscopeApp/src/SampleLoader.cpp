@@ -0,0 +1,358 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "SampleLoader.h"
+#include "Log.h"
+#include "MappedFile.h"
+#include "Simd.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+
+
+namespace {
+
+    // a retired wave is freed after this time, when no grain can be reading it anymore
+    const std::chrono::seconds kRetireDelay( 1 );
+    // the peak pyramid of a paged wave is built this many frames at a time ( 1 MB ), dropping the pages of each step once read. 
+    // Much longer than the fades, that are in the first and the last step 
+    const size_t kPeakStepFrames = 16 * PagedWave::kPageFrames;
+    // how often the loader thread collects the retired waves when there is nothing to load
+    const std::chrono::milliseconds kPollInterval( 100 );
+
+    // where the samples are in a file and how they are stored
+    struct SampleFormat
+    {
+        size_t dataOffset;
+        size_t numFrames;
+        size_t numChannels;
+        size_t sampleRate;
+        bool isFloat; // 32 bits float, otherwise 16 bits integer
+    };
+
+    // WAV files are little endian, as are the Raspberry Pi and the PC
+    uint32_t readU32( const unsigned char *bytes ) { uint32_t val; std::memcpy( &val, bytes, 4 ); return val; }
+    uint16_t readU16( const unsigned char *bytes ) { uint16_t val; std::memcpy( &val, bytes, 2 ); return val; }
+
+    /* Finds the format and the samples of a WAV file. Returns false if the file is not a 16 bits PCM or 32 bits float WAV */
+    bool parseWav( const unsigned char *bytes, size_t size, SampleFormat &format )
+    {
+        if ( size < 12 || std::memcmp( bytes, "RIFF", 4 ) != 0 || std::memcmp( bytes + 8, "WAVE", 4 ) != 0 )
+            return false;
+
+        uint16_t formatTag = 0;
+        uint16_t bitsPerSample = 0;
+        bool fmtFound = false;
+        bool dataFound = false;
+        size_t dataSize = 0;
+
+        for ( size_t pos = 12; pos + 8 <= size && !dataFound; ){
+            const uint32_t chunkSize = readU32( bytes + pos + 4 );
+            const unsigned char *chunk = bytes + pos + 8;
+
+            if ( std::memcmp( bytes + pos, "fmt ", 4 ) == 0 && chunkSize >= 16 && pos + 8 + chunkSize <= size ){
+                formatTag = readU16( chunk );
+                format.numChannels = readU16( chunk + 2 );
+                format.sampleRate = readU32( chunk + 4 );
+                bitsPerSample = readU16( chunk + 14 );
+
+                // WAVE_FORMAT_EXTENSIBLE: the actual format is at the start of the sub format GUID
+                if ( formatTag == 0xFFFE && chunkSize >= 40 )
+                    formatTag = readU16( chunk + 24 );
+
+                fmtFound = true;
+            }
+            else if ( std::memcmp( bytes + pos, "data", 4 ) == 0 ){
+                format.dataOffset = pos + 8;
+                dataSize = std::min<size_t>( chunkSize, size - format.dataOffset );
+                dataFound = true;
+            }
+
+            // chunks are padded to an even size
+            pos += 8 + chunkSize + ( chunkSize & 1 );
+        }
+
+        if ( !fmtFound || !dataFound || format.numChannels == 0 || format.sampleRate == 0 )
+            return false;
+
+        if ( formatTag == 1 && bitsPerSample == 16 )
+            format.isFloat = false;
+        else if ( formatTag == 3 && bitsPerSample == 32 )
+            format.isFloat = true;
+        else
+            return false;
+
+        format.numFrames = dataSize / ( format.numChannels * ( bitsPerSample / 8 ) );
+        return true;
+    }
+}
+
+
+SampleLoader::SampleLoader( size_t sampleRate, size_t waveLen, GrainStorage grainStorage, size_t maxSampleLen ) :
+    mSampleRate( sampleRate ),
+    mWaveLen( waveLen ),
+    mGrainStorage( grainStorage ),
+    mMaxSampleLen( std::max( maxSampleLen, waveLen ) ),
+    mRunning( true )
+{
+    mThread = std::thread( &SampleLoader::run, this );
+}
+
+SampleLoader::~SampleLoader()
+{
+    {
+        std::lock_guard<std::mutex> lock( mMutex );
+        mRunning = false;
+    }
+    mCondition.notify_one();
+    mThread.join();
+
+    for ( auto &retired : mRetiredWaves )
+        delete retired.first;
+}
+
+void SampleLoader::load( const BufferToWaveRecorderNodeRef &recorder, const ci::fs::path &path )
+{
+    Request request;
+    request.recorder = recorder;
+    request.path = path;
+    request.data = nullptr;
+    queue( request );
+}
+
+void SampleLoader::load( const BufferToWaveRecorderNodeRef &recorder, const float *data, size_t numFrames, const std::shared_ptr<const void> &owner )
+{
+    Request request;
+    request.recorder = recorder;
+    request.data = data;
+    request.numFrames = std::min( numFrames, mWaveLen );
+    request.owner = owner;
+    queue( request );
+}
+
+void SampleLoader::queue( const Request &request )
+{
+    {
+        std::lock_guard<std::mutex> lock( mMutex );
+        mRequests.push_back( request );
+    }
+    mCondition.notify_one();
+}
+
+void SampleLoader::run()
+{
+    for ( ;; ){
+        Request request;
+
+        {
+            std::unique_lock<std::mutex> lock( mMutex );
+            mCondition.wait_for( lock, kPollInterval, [this] { return !mRunning || !mRequests.empty(); } );
+
+            if ( !mRunning )
+                break;
+
+            if ( !mRequests.empty() ){
+                request = mRequests.front();
+                mRequests.pop_front();
+            }
+        }
+
+        collectRetiredWaves();
+
+        if ( !request.recorder )
+            continue;
+
+        LoadedWave *wave = nullptr;
+        if ( request.data != nullptr ){
+            wave = new LoadedWave;
+            wave->mapping = request.owner;
+            wave = finishWave( wave, request.data, request.numFrames );
+        }
+        else{
+            wave = loadFile( request.path );
+        }
+
+        if ( wave == nullptr )
+            continue;
+
+        if ( std::find( mRecorders.begin(), mRecorders.end(), request.recorder ) == mRecorders.end() )
+            mRecorders.push_back( request.recorder );
+
+        // a wave loaded before and not published yet is replaced. The audio thread never saw it, so it's freed right away
+        delete request.recorder->loadWave( wave );
+    }
+}
+
+LoadedWave* SampleLoader::loadFile( const ci::fs::path &path ) const
+{
+    size_t size = 0;
+    std::shared_ptr<void> mapping = mapFile( path, size );
+    if ( !mapping ){
+        logError( "cannot open sample " + path.string() );
+        return nullptr;
+    }
+
+    unsigned char *bytes = static_cast<unsigned char*>( mapping.get() );
+
+    SampleFormat format;
+    std::string extension = path.extension().string();
+    std::transform( extension.begin(), extension.end(), extension.begin(), ::tolower );
+
+    if ( extension == ".f32" || extension == ".s16" ){
+        format.dataOffset = 0;
+        format.numChannels = 1;
+        format.sampleRate = mSampleRate;
+        format.isFloat = ( extension == ".f32" );
+        format.numFrames = size / ( format.isFloat ? sizeof( float ) : sizeof( int16_t ) );
+    }
+    else if ( !parseWav( bytes, size, format ) ){
+        logError( "cannot load sample " + path.string() + ": only 16 bits PCM and 32 bits float WAV, .f32 and .s16 files are supported" );
+        return nullptr;
+    }
+
+    std::unique_ptr<LoadedWave> wave( new LoadedWave );
+    float *data = nullptr;
+    size_t numFrames = mWaveLen;
+
+    if ( format.isFloat && format.numChannels == 1 && format.sampleRate == mSampleRate && format.numFrames >= mWaveLen
+        && format.dataOffset % sizeof( float ) == 0 ){
+        // the samples are played straight from the mapped file. The fades below only copy the pages they write to
+        data = reinterpret_cast<float*>( bytes + format.dataOffset );
+        numFrames = std::min( format.numFrames, mMaxSampleLen );
+        wave->mapping = mapping;
+        // a long sample is read in one page at a time, as the grains get close to it 
+        if ( numFrames == mWaveLen )
+            prefetchMapping( bytes, size );
+    }
+    else{
+        const size_t bytesPerFrame = format.numChannels * ( format.isFloat ? sizeof( float ) : sizeof( int16_t ) );
+        // first channel of the frame at index
+        auto sampleAt = [&]( size_t index ) -> float {
+            const unsigned char *sample = bytes + format.dataOffset + index * bytesPerFrame;
+            if ( format.isFloat ){
+                float val;
+                std::memcpy( &val, sample, sizeof( float ) );
+                return val;
+            }
+            else{
+                int16_t val;
+                std::memcpy( &val, sample, sizeof( int16_t ) );
+                return val / 32768.0f;
+            }
+        };
+
+        wave->samples.assign( mWaveLen, 0.0f );
+        data = wave->samples.data();
+
+        // linear interpolation is enough when the sample rates differ, as the grains interpolate linearly too
+        const double step = double( format.sampleRate ) / mSampleRate;
+        const size_t numFrames = std::min( mWaveLen, size_t( format.numFrames / step ) );
+        for ( size_t i = 0; i < numFrames; i++ ){
+            const double pos = i * step;
+            const size_t index = size_t( pos );
+            const float frac = float( pos - index );
+
+            const float current = sampleAt( index );
+            const float next = index + 1 < format.numFrames ? sampleAt( index + 1 ) : current;
+            data[i] = current + ( next - current ) * frac;
+        }
+    }
+
+    // fade in and out as a recorded wave, to avoid clicks
+    const size_t rampLen = std::min( size_t( std::lround( BufferToWaveRecorderNode::kRampTime * mSampleRate ) ), mWaveLen / 2 );
+    for ( size_t i = 0; i < rampLen; i++ ){
+        const float ramp = float( i ) / rampLen;
+        data[i] *= ramp;
+        data[numFrames - 1 - i] *= ramp;
+    }
+
+    // the pages of a long sample are pinned in memory: they must not be copied on write anymore 
+    if ( numFrames > mWaveLen )
+        protectMapping( bytes, size );
+
+    return finishWave( wave.release(), data, numFrames );
+}
+
+LoadedWave* SampleLoader::finishWave( LoadedWave *wave, const float *data, size_t numFrames ) const
+{
+    wave->peaks.setCapacity( numFrames );
+    if ( numFrames <= mWaveLen ){
+        // reading all the samples also brings all the pages of a mapped file in memory
+        wave->peaks.update( data, 0, 0, numFrames );
+    }
+    else{
+        // a paged wave is read once, in steps: the pages of each step are dropped as soon as it's summarized, 
+        // so that they don't stay in memory ( and are pinned by the PagePrefetcher only when the grains get close ). 
+        // The first and the last steps hold the fades, that are not in the file anymore 
+        for ( size_t begin = 0; begin < numFrames; begin += kPeakStepFrames ){
+            const size_t end = std::min( begin + kPeakStepFrames, numFrames );
+            wave->peaks.update( data, 0, begin, end );
+            if ( begin >= kPeakStepFrames && end + kPeakStepFrames <= numFrames )
+                releaseMapping( data + begin, ( end - begin ) * sizeof( float ) );
+        }
+    }
+
+    wave->grainBuffer.data = data;
+    wave->grainBuffer.numFrames = numFrames;
+    wave->grainBuffer.offset = 0;
+    wave->grainBuffer.data16 = nullptr;
+    wave->grainBuffer.paged = nullptr;
+    wave->grainBuffer.live = nullptr;
+
+    if ( numFrames > mWaveLen ){
+        // the grains read the float samples of a paged wave from the file, whatever the grain storage: a 16 bits copy 
+        // would be resident and half as long as the file, when the point of paging is to keep only the pages played in memory 
+        wave->paged.reset( new PagedWave( data, numFrames ) );
+        wave->grainBuffer.paged = wave->paged.get();
+    }
+    else if ( mGrainStorage == GrainStorage::eInt16 ){
+        wave->compactSamples.resize( numFrames );
+        simd::toInt16( data, wave->compactSamples.data(), numFrames, kInt16FullScale );
+        wave->grainBuffer.data16 = wave->compactSamples.data();
+    }
+
+    return wave;
+}
+
+void SampleLoader::collectRetiredWaves()
+{
+    const auto now = std::chrono::steady_clock::now();
+
+    for ( auto &recorder : mRecorders ){
+        while ( const LoadedWave *wave = recorder->popRetiredWave() )
+            mRetiredWaves.emplace_back( wave, now );
+    }
+
+    auto it = mRetiredWaves.begin();
+    while ( it != mRetiredWaves.end() ){
+        if ( now - it->second >= kRetireDelay ){
+            delete it->first;
+            it = mRetiredWaves.erase( it );
+        }
+        else{
+            ++it;
+        }
+    }
+}
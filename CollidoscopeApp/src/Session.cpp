@@ -0,0 +1,269 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "Session.h"
+#include "Log.h"
+#include "MappedFile.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+
+namespace {
+
+    const char kMagic[4] = { 'C', 'L', 'D', 'S' };
+    // to be increased at any change of the file layout
+    const uint32_t kVersion = 2;
+
+    /* 
+     * The file is made of 32 bits fields in native byte order. The header is followed by the state of each wave:
+     * the WaveHeader, the min and max of each chunk and the samples of the wave.
+     */
+    struct FileHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint32_t numWaves;
+        uint32_t sampleRate;
+        uint32_t waveLen;
+        uint32_t numChunks;
+    };
+
+    struct WaveHeader
+    {
+        uint32_t numFrames; // 0 if no wave was saved 
+        uint32_t selectionStart;
+        uint32_t selectionSize;
+        float durationCoeff;
+        float filter;
+    };
+
+    bool writeAll( std::FILE *file, const void *data, size_t size )
+    {
+        return std::fwrite( data, 1, size, file ) == size;
+    }
+}
+
+
+Session::Session( const ci::fs::path &path, size_t sampleRate, size_t waveLen, size_t numChunks ) :
+    mPath( path ),
+    mSampleRate( sampleRate ),
+    mWaveLen( waveLen ),
+    mNumChunks( numChunks ),
+    mRunning( true )
+{
+    mThread = std::thread( &Session::run, this );
+}
+
+Session::~Session()
+{
+    {
+        std::lock_guard<std::mutex> lock( mMutex );
+        mRunning = false;
+    }
+    mCondition.notify_one();
+    mThread.join();
+}
+
+size_t Session::getFileSize() const
+{
+    return sizeof( FileHeader ) + NUM_WAVES * ( sizeof( WaveHeader ) + ( 2 * mNumChunks + mWaveLen ) * sizeof( float ) );
+}
+
+bool Session::restore( SessionState &state ) const
+{
+    size_t size = 0;
+    std::shared_ptr<void> mapping = mapFile( mPath, size );
+    if ( !mapping )
+        return false; // no session saved yet 
+
+    const unsigned char *bytes = static_cast<const unsigned char*>( mapping.get() );
+
+    FileHeader header;
+    if ( size < sizeof( header ) ){
+        logError( "session file " + mPath.string() + " is corrupted, ignored" );
+        return false;
+    }
+    std::memcpy( &header, bytes, sizeof( header ) );
+
+    if ( std::memcmp( header.magic, kMagic, sizeof( kMagic ) ) != 0 || header.version != kVersion || header.numWaves != NUM_WAVES
+        || header.sampleRate != mSampleRate || header.waveLen != mWaveLen || header.numChunks != mNumChunks ){
+        logError( "session file " + mPath.string() + " was saved with different settings, ignored" );
+        return false;
+    }
+
+    if ( size != getFileSize() ){
+        logError( "session file " + mPath.string() + " is corrupted, ignored" );
+        return false;
+    }
+
+    // touch all the pages of the samples before they get to the audio thread 
+    prefetchMapping( mapping.get(), size );
+
+    size_t pos = sizeof( FileHeader );
+    for ( auto &wave : state.waves ){
+        WaveHeader waveHeader;
+        std::memcpy( &waveHeader, bytes + pos, sizeof( waveHeader ) );
+        pos += sizeof( WaveHeader );
+
+        wave.selectionStart = std::min<size_t>( waveHeader.selectionStart, mNumChunks - 1 );
+        wave.selectionSize = std::min<size_t>( waveHeader.selectionSize, mNumChunks );
+        wave.durationCoeff = waveHeader.durationCoeff;
+        wave.filter = std::min( std::max( double( waveHeader.filter ), 0.0 ), 1.0 );
+
+        // the fields are 4 bytes each and the mapping is page aligned, so the floats are aligned 
+        const float *chunks = reinterpret_cast<const float*>( bytes + pos );
+        pos += 2 * mNumChunks * sizeof( float );
+        const float *samples = reinterpret_cast<const float*>( bytes + pos );
+        pos += mWaveLen * sizeof( float );
+
+        const bool hasWave = ( waveHeader.numFrames > 0 && waveHeader.numFrames <= mWaveLen );
+        wave.samples.clear();
+        wave.mappedChunks = hasWave ? chunks : nullptr;
+        wave.mappedSamples = hasWave ? samples : nullptr;
+        wave.numMappedFrames = hasWave ? waveHeader.numFrames : 0;
+    }
+
+    state.mapping = mapping;
+    return true;
+}
+
+void Session::save( SessionState &state )
+{
+    std::unique_ptr<SessionState> pending( new SessionState );
+    for ( size_t i = 0; i < NUM_WAVES; i++ ){
+        WaveSession &wave = pending->waves[i];
+        wave.selectionStart = state.waves[i].selectionStart;
+        wave.selectionSize = state.waves[i].selectionSize;
+        wave.durationCoeff = state.waves[i].durationCoeff;
+        wave.filter = state.waves[i].filter;
+        wave.samples.swap( state.waves[i].samples );
+    }
+
+    {
+        std::lock_guard<std::mutex> lock( mMutex );
+        mPendingState = std::move( pending );
+    }
+    mCondition.notify_one();
+}
+
+void Session::run()
+{
+    for ( ;; ){
+        std::unique_ptr<SessionState> state;
+
+        {
+            std::unique_lock<std::mutex> lock( mMutex );
+            mCondition.wait( lock, [this] { return !mRunning || mPendingState; } );
+
+            // the last state queued is saved before quitting 
+            if ( !mPendingState )
+                break;
+
+            state = std::move( mPendingState );
+        }
+
+        write( *state );
+    }
+}
+
+void Session::write( const SessionState &state ) const
+{
+    const ci::fs::path tmpPath = mPath.string() + ".tmp";
+
+    std::FILE *file = std::fopen( tmpPath.string().c_str(), "wb" );
+    if ( file == nullptr ){
+        logError( "cannot create session file " + tmpPath.string() );
+        return;
+    }
+
+    FileHeader header;
+    std::memcpy( header.magic, kMagic, sizeof( kMagic ) );
+    header.version = kVersion;
+    header.numWaves = NUM_WAVES;
+    header.sampleRate = uint32_t( mSampleRate );
+    header.waveLen = uint32_t( mWaveLen );
+    header.numChunks = uint32_t( mNumChunks );
+
+    bool ok = writeAll( file, &header, sizeof( header ) );
+
+    std::vector<float> chunks( 2 * mNumChunks );
+    const std::vector<float> silence( mWaveLen, 0.0f );
+
+    for ( const auto &wave : state.waves ){
+        const size_t numFrames = wave.samples.size();
+        const bool hasWave = ( numFrames > 0 && numFrames <= mWaveLen );
+
+        WaveHeader waveHeader;
+        waveHeader.numFrames = hasWave ? uint32_t( numFrames ) : 0;
+        waveHeader.selectionStart = uint32_t( wave.selectionStart );
+        waveHeader.selectionSize = uint32_t( wave.selectionSize );
+        waveHeader.durationCoeff = float( wave.durationCoeff );
+        waveHeader.filter = float( wave.filter );
+
+        // chunks span the wave the same way as in Wave::setChunks() 
+        std::fill( chunks.begin(), chunks.end(), 0.0f );
+        for ( size_t i = 0; hasWave && i < mNumChunks; i++ ){
+            const auto first = wave.samples.begin() + i * numFrames / mNumChunks;
+            const auto last = wave.samples.begin() + ( i + 1 ) * numFrames / mNumChunks;
+            if ( first == last )
+                continue;
+
+            const auto minMax = std::minmax_element( first, last );
+            chunks[2 * i] = *minMax.first;
+            chunks[2 * i + 1] = *minMax.second;
+        }
+
+        ok = ok && writeAll( file, &waveHeader, sizeof( waveHeader ) );
+        ok = ok && writeAll( file, chunks.data(), chunks.size() * sizeof( float ) );
+        // the room left after a short wave is padded with silence 
+        const size_t numSamples = hasWave ? numFrames : 0;
+        ok = ok && writeAll( file, wave.samples.data(), numSamples * sizeof( float ) );
+        ok = ok && writeAll( file, silence.data(), ( mWaveLen - numSamples ) * sizeof( float ) );
+    }
+
+    // the data must be on disk before the rename, or a power cut can leave an empty file in place of the session 
+    ok = ok && std::fflush( file ) == 0;
+#ifndef _WIN32
+    ok = ok && fsync( fileno( file ) ) == 0;
+#endif
+    ok = ( std::fclose( file ) == 0 ) && ok;
+
+    if ( !ok ){
+        logError( "cannot write session file " + tmpPath.string() );
+        std::remove( tmpPath.string().c_str() );
+        return;
+    }
+
+#ifdef _WIN32
+    // rename does not replace an existing file on Windows 
+    std::remove( mPath.string().c_str() );
+#endif
+    if ( std::rename( tmpPath.string().c_str(), mPath.string().c_str() ) != 0 )
+        logError( "cannot replace session file " + mPath.string() );
+}
@@ -24,11 +24,14 @@
 #include "Wave.h"
 #include "DrawInfo.h"
 
+#include <algorithm>
+
 
 using namespace ci;
 
 Wave::Wave( size_t numChunks, Color selectionColor ):
     mNumChunks( numChunks ),
+    mNumChunksSet( 0 ),
     mSelection( this, selectionColor ),
     mColor(Color(0.5f, 0.5f, 0.5f)),
     mFilterCoeff( 1.0f )
@@ -50,6 +53,7 @@ void Wave::reset( bool onlyChunks )
     for (size_t i = 0; i < getSize(); i++){
         mChunks[i].reset();
     }
+    mNumChunksSet = 0;
 
     if (onlyChunks)
         return;
@@ -65,6 +69,21 @@ void Wave::setChunk(size_t index, float bottom, float top)
     c.setBottom(bottom);
 }
 
+void Wave::setChunks( const PeakPyramid &peaks )
+{
+    const size_t waveLen = peaks.getLength();
+    if ( waveLen == 0 )
+        return;
+
+    // chunks whose last frame has been recorded 
+    const size_t numChunksRecorded = std::min( peaks.getNumFrames() * mNumChunks / waveLen, mNumChunks );
+
+    for ( ; mNumChunksSet < numChunksRecorded; mNumChunksSet++ ){
+        const PeakPyramid::Peak peak = peaks.getPeak( mNumChunksSet * waveLen / mNumChunks, ( mNumChunksSet + 1 ) * waveLen / mNumChunks );
+        setChunk( mNumChunksSet, peak.min, peak.max );
+    }
+}
+
 inline const Chunk & Wave::getChunk(size_t index)
 {
     return mChunks[index];
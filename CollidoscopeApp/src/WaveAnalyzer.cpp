@@ -0,0 +1,229 @@
+/*
+
+ Copyright (C) 2016  Queen Mary University of London
+ Author: Fiore Martin
+
+ This file is part of Collidoscope.
+
+ Collidoscope is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#include "WaveAnalyzer.h"
+
+#include "cinder/audio/dsp/Dsp.h"
+#include "cinder/audio/dsp/Fft.h"
+
+#include <algorithm>
+#include <cmath>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
+
+
+namespace {
+
+    // an index replaced is freed after this time, when the PGranularNode can't be reading it anymore
+    const std::chrono::seconds kRetireDelay( 1 );
+    // how often the recorders are checked for new waves
+    const std::chrono::milliseconds kPollInterval( 100 );
+
+    // FFT frames of the spectral flux, and how far apart they are
+    const size_t kFftSize = 1024;
+    const size_t kHopSize = 512;
+    // an onset is the highest flux within this many frames on each side...
+    const size_t kOnsetPeakFrames = 3;
+    // ... higher than the average flux around it by this ratio ...
+    const float kOnsetThresholdRatio = 1.5f;
+    // ... and not negligible compared to the highest flux of the wave
+    const float kOnsetMinFluxRatio = 0.1f;
+    // frames on each side the average flux is taken from
+    const size_t kOnsetAverageFrames = 8;
+    // onsets closer than this are the same onset
+    const double kMinOnsetDistanceSeconds = 0.03;
+}
+
+
+WaveAnalyzer::WaveAnalyzer( size_t sampleRate ) :
+    mSampleRate( sampleRate ),
+    mRunning( true )
+{
+    mThread = std::thread( &WaveAnalyzer::run, this );
+}
+
+WaveAnalyzer::~WaveAnalyzer()
+{
+    {
+        std::lock_guard<std::mutex> lock( mMutex );
+        mRunning = false;
+    }
+    mCondition.notify_one();
+    mThread.join();
+
+    for ( auto &retired : mRetiredIndexes )
+        delete retired.first;
+}
+
+void WaveAnalyzer::addWave( const BufferToWaveRecorderNodeRef &recorder, const PGranularNodeRef &granular )
+{
+    std::lock_guard<std::mutex> lock( mMutex );
+
+    Wave wave;
+    wave.recorder = recorder;
+    wave.granular = granular;
+    wave.numPublishedWaves = 0;
+    mWaves.push_back( wave );
+}
+
+void WaveAnalyzer::run()
+{
+#ifdef __linux__
+    // the analysis can wait: leave the CPU to the graphics
+    setpriority( PRIO_PROCESS, 0, 10 );
+#endif
+
+    std::unique_lock<std::mutex> lock( mMutex );
+
+    while ( !mCondition.wait_for( lock, kPollInterval, [this] { return !mRunning; } ) ){
+        for ( auto &wave : mWaves ){
+            const uint32_t numPublishedWaves = wave.recorder->getNumPublishedWaves();
+            if ( numPublishedWaves == wave.numPublishedWaves )
+                continue;
+
+            wave.numPublishedWaves = numPublishedWaves;
+
+            // the wave is read while the grains play it. The recorder can write in its slot again once it's dropped from the history, 
+            // e.g. by the next recording with two slots: the index is then built from a wave no longer played, and the PGranularNode 
+            // ignores it, as it only uses the index of the wave it reads. A loaded wave is freed long after the analysis is over
+            const GrainBuffer grainBuffer = *wave.recorder->getGrainBuffer().load( std::memory_order_acquire );
+            if ( grainBuffer.data == nullptr || grainBuffer.numFrames == 0 )
+                continue;
+
+            // a paged wave is not indexed: unrolling it would bring all its pages in memory 
+            if ( grainBuffer.paged != nullptr )
+                continue;
+
+            // the delay line of the live mode changes all the time: its index would be wrong as soon as it's built 
+            if ( grainBuffer.live != nullptr )
+                continue;
+
+            const WaveIndex *replaced = wave.granular->getWaveIndex().exchange( analyze( grainBuffer ), std::memory_order_acq_rel );
+            if ( replaced != nullptr )
+                mRetiredIndexes.emplace_back( replaced, std::chrono::steady_clock::now() );
+        }
+
+        collectRetiredIndexes();
+    }
+}
+
+WaveIndex* WaveAnalyzer::analyze( const GrainBuffer &grainBuffer ) const
+{
+    // unroll the circular buffer, so that the wave starts at index 0
+    std::vector<float> wave( grainBuffer.data + grainBuffer.offset, grainBuffer.data + grainBuffer.numFrames );
+    wave.insert( wave.end(), grainBuffer.data, grainBuffer.data + grainBuffer.offset );
+
+    WaveIndex *index = new WaveIndex;
+    index->grainBuffer = grainBuffer;
+    findZeroCrossings( wave, index->zeroCrossings );
+    findOnsets( wave, index->onsets );
+
+    return index;
+}
+
+void WaveAnalyzer::findZeroCrossings( const std::vector<float> &wave, std::vector<uint32_t> &zeroCrossings ) const
+{
+    for ( size_t i = 1; i < wave.size(); i++ ){
+        if ( ( wave[i - 1] < 0.0f ) != ( wave[i] < 0.0f ) )
+            zeroCrossings.push_back( uint32_t( i ) );
+    }
+}
+
+void WaveAnalyzer::findOnsets( const std::vector<float> &wave, std::vector<uint32_t> &onsets ) const
+{
+    if ( wave.size() < kFftSize )
+        return;
+
+    ci::audio::dsp::Fft fft( kFftSize );
+    ci::audio::Buffer frame( kFftSize );
+    ci::audio::BufferSpectral spectrum( kFftSize );
+
+    std::vector<float> window( kFftSize );
+    ci::audio::dsp::generateWindow( ci::audio::dsp::WindowType::HANN, window.data(), kFftSize );
+
+    // spectral flux of each frame: how much the magnitudes of the bins grew since the previous frame
+    std::vector<float> prevMagnitudes( kFftSize / 2, 0.0f );
+    std::vector<float> flux;
+
+    for ( size_t start = 0; start + kFftSize <= wave.size(); start += kHopSize ){
+        float *frameData = frame.getData();
+        for ( size_t i = 0; i < kFftSize; i++ )
+            frameData[i] = wave[start + i] * window[i];
+
+        fft.forward( &frame, &spectrum );
+
+        // bin 0 holds the DC in the real part and the Nyquist bin in the imaginary part: both are left out
+        float frameFlux = 0.0f;
+        for ( size_t bin = 1; bin < kFftSize / 2; bin++ ){
+            const float magnitude = std::hypot( spectrum.getReal()[bin], spectrum.getImag()[bin] );
+            frameFlux += std::max( magnitude - prevMagnitudes[bin], 0.0f );
+            prevMagnitudes[bin] = magnitude;
+        }
+
+        // the first frame grows from nothing: it's an onset only if it's loud, which the threshold takes care of
+        flux.push_back( frameFlux );
+    }
+
+    const float maxFlux = *std::max_element( flux.begin(), flux.end() );
+    if ( maxFlux <= 0.0f )
+        return;
+
+    for ( size_t i = 0; i < flux.size(); i++ ){
+        const size_t peakBegin = i >= kOnsetPeakFrames ? i - kOnsetPeakFrames : 0;
+        const size_t peakEnd = std::min( i + kOnsetPeakFrames + 1, flux.size() );
+        if ( flux[i] < *std::max_element( flux.begin() + peakBegin, flux.begin() + peakEnd ) )
+            continue;
+
+        const size_t averageBegin = i >= kOnsetAverageFrames ? i - kOnsetAverageFrames : 0;
+        const size_t averageEnd = std::min( i + kOnsetAverageFrames + 1, flux.size() );
+        float average = 0.0f;
+        for ( size_t j = averageBegin; j < averageEnd; j++ )
+            average += flux[j];
+        average /= ( averageEnd - averageBegin );
+
+        if ( flux[i] < kOnsetThresholdRatio * average || flux[i] < kOnsetMinFluxRatio * maxFlux )
+            continue;
+
+        // the onset is between the centres of the two frames compared
+        const uint32_t onset = uint32_t( i * kHopSize + ( kFftSize - kHopSize ) / 2 );
+        if ( onsets.empty() || onset - onsets.back() > kMinOnsetDistanceSeconds * mSampleRate )
+            onsets.push_back( onset );
+    }
+}
+
+void WaveAnalyzer::collectRetiredIndexes()
+{
+    const auto now = std::chrono::steady_clock::now();
+
+    auto it = mRetiredIndexes.begin();
+    while ( it != mRetiredIndexes.end() ){
+        if ( now - it->second >= kRetireDelay ){
+            delete it->first;
+            it = mRetiredIndexes.erase( it );
+        }
+        else{
+            ++it;
+        }
+    }
+}
@@ -47,6 +47,8 @@
 #include "cinder/audio/linux/ContextJack.h"
 #include "cinder/audio/Exception.h"
 
+#include <chrono>
+
 #define NUM_CHANNELS 2
 
 namespace cinder { namespace audio { namespace linux {
@@ -84,6 +86,8 @@ inline void copyFromJackPort(jack_port_t *port, float *dest, jack_nframes_t nfra
 
 int OutputDeviceNodeJack::jackCallback(jack_nframes_t nframes, void* userData)
 {
+    const auto callbackStart = std::chrono::steady_clock::now();
+
     // retrieve user data 
     RenderData *renderData = static_cast<RenderData *>( userData );
 
@@ -130,6 +134,13 @@ int OutputDeviceNodeJack::jackCallback(jack_nframes_t nframes, void* userData)
 
     ctx->postProcess();
 
+    // report how long it took to process the whole graph 
+    const ContextJack::ProcessTimeCallback &processTimeCallback = renderData->context->getProcessTimeCallback();
+    if( processTimeCallback ){
+        const auto elapsed = std::chrono::steady_clock::now() - callbackStart;
+        processTimeCallback( uint64_t( std::chrono::duration_cast<std::chrono::nanoseconds>( elapsed ).count() ) );
+    }
+
     return 0;
 }
 
@@ -47,6 +47,7 @@
 
 #include "cinder/audio/Context.h" 
 #include <jack/jack.h>
+#include <functional>
 
 namespace cinder { namespace audio { namespace linux {
 
@@ -128,11 +129,21 @@ class ContextJack : public Context {
     OutputDeviceNodeRef createOutputDeviceNode( const DeviceRef &device, const Node::Format &format = Node::Format() ) override;
     InputDeviceNodeRef  createInputDeviceNode( const DeviceRef &device, const Node::Format &format = Node::Format()  ) override;
 
+    typedef std::function<void( uint64_t )> ProcessTimeCallback;
+
+    /** Sets a function that is called in the audio thread at the end of each jack process callback, 
+     *  with the time in nanoseconds spent in the callback. It must be set before the context is enabled. 
+     */
+    void setProcessTimeCallback( const ProcessTimeCallback &callback ) { mProcessTimeCallback = callback; }
+
+    const ProcessTimeCallback& getProcessTimeCallback() const { return mProcessTimeCallback; }
+
     OutputDeviceNodeRef mOutputDeviceNode;
     InputDeviceNodeRef  mInputDeviceNode;
 
 
   private:
+    ProcessTimeCallback mProcessTimeCallback;
 };  
 
 } } } // namespace cinder::audio::linux